@@ -0,0 +1,452 @@
+/* CSSE2310 2025 Assignment Four
+ * cache.c
+ *
+ * Written by William White
+ */
+
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_MULTIPLIER_A 0x9e3779b97f4a7c15ULL
+#define HASH_MULTIPLIER_B 0xc2b2ae3d27d4eb4fULL
+#define MIX_MULTIPLIER_A 0xff51afd7ed558ccdULL
+#define MIX_MULTIPLIER_B 0xc4ceb9fe1a85ec53ULL
+
+typedef enum {
+    WORD_BYTES = 8,
+    MIX_SHIFT = 33,
+    ROTATE_BITS = 31,
+    BITS_PER_WORD = 64,
+    INITIAL_BUCKETS = 64
+} CacheConstants;
+
+/* mix64()
+ * -------
+ * Scrambles the bits of a 64-bit value so that every input bit affects every
+ * output bit.
+ *
+ * value: value to mix
+ *
+ * Returns: mixed value
+ */
+static uint64_t mix64(uint64_t value)
+{
+    value ^= value >> MIX_SHIFT;
+    value *= MIX_MULTIPLIER_A;
+    value ^= value >> MIX_SHIFT;
+    value *= MIX_MULTIPLIER_B;
+    value ^= value >> MIX_SHIFT;
+    return value;
+}
+
+/* hash_lane()
+ * -----------
+ * Folds one 64-bit word into a running hash.
+ *
+ * hash: running hash
+ * word: next word of input
+ * multiplier: odd constant distinguishing the two halves of a key
+ *
+ * Returns: updated hash
+ */
+static uint64_t hash_lane(uint64_t hash, uint64_t word, uint64_t multiplier)
+{
+    hash ^= word * multiplier;
+    hash = (hash << ROTATE_BITS) | (hash >> (BITS_PER_WORD - ROTATE_BITS));
+    return hash * HASH_MULTIPLIER_A;
+}
+
+/* hash_bytes()
+ * ------------
+ * Computes a 128-bit hash of a block of memory a word at a time. This is not
+ * a cryptographic hash, but with 128 bits accidental collisions between
+ * images are not a practical concern.
+ *
+ * data: bytes to hash
+ * size: number of bytes
+ *
+ * Returns: key identifying the bytes
+ */
+CacheKey hash_bytes(const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    CacheKey key = {size * HASH_MULTIPLIER_A, ~size * HASH_MULTIPLIER_B};
+    size_t remaining = size;
+    for (; remaining >= WORD_BYTES; remaining -= WORD_BYTES) {
+        uint64_t word;
+        memcpy(&word, bytes, WORD_BYTES);
+        key.high = hash_lane(key.high, word, HASH_MULTIPLIER_B);
+        key.low = hash_lane(key.low, word, MIX_MULTIPLIER_A);
+        bytes += WORD_BYTES;
+    }
+    if (remaining > 0) {
+        uint64_t word = 0;
+        memcpy(&word, bytes, remaining);
+        key.high = hash_lane(key.high, word, HASH_MULTIPLIER_B);
+        key.low = hash_lane(key.low, word, MIX_MULTIPLIER_A);
+    }
+    key.high = mix64(key.high);
+    key.low = mix64(key.low ^ key.high);
+    return key;
+}
+
+/* combine_cache_key()
+ * -------------------
+ * Mixes a further value, such as an operation type or part of another key,
+ * into a key.
+ *
+ * key: key to extend
+ * value: value to mix in
+ *
+ * Returns: combined key
+ */
+CacheKey combine_cache_key(CacheKey key, uint64_t value)
+{
+    key.high = mix64(hash_lane(key.high, value, HASH_MULTIPLIER_B));
+    key.low = mix64(hash_lane(key.low, value, MIX_MULTIPLIER_A) ^ key.high);
+    return key;
+}
+
+/* create_lru_cache()
+ * ------------------
+ * Creates an empty cache that holds at most budget bytes of values and
+ * entry overhead.
+ *
+ * budget: memory budget in bytes
+ *
+ * Returns: pointer to the new cache, or NULL if budget is 0 (caching
+ *          disabled) or memory could not be allocated
+ */
+LruCache* create_lru_cache(size_t budget)
+{
+    if (budget == 0) {
+        return NULL;
+    }
+    LruCache* cache = calloc(1, sizeof(LruCache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->buckets = calloc(INITIAL_BUCKETS, sizeof(CacheEntry*));
+    if (!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+    cache->bucketCount = INITIAL_BUCKETS;
+    cache->budget = budget;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/* release_cache_entry()
+ * ---------------------
+ * Drops a reference to an entry, freeing it once neither the cache nor any
+ * reader holds it.
+ *
+ * entry: entry returned by lru_cache_get() (may be NULL)
+ *
+ * Returns: void
+ */
+void release_cache_entry(CacheEntry* entry)
+{
+    if (entry
+            && __atomic_sub_fetch(&entry->refCount, 1, __ATOMIC_ACQ_REL)
+                    == 0) {
+        if (entry->release) {
+            entry->release(entry->owner);
+        } else {
+            free(entry->data);
+        }
+        free(entry);
+    }
+}
+
+/* free_lru_cache()
+ * ----------------
+ * Releases every entry and frees the cache.
+ *
+ * cache: cache to free (may be NULL)
+ *
+ * Returns: void
+ */
+void free_lru_cache(LruCache* cache)
+{
+    if (!cache) {
+        return;
+    }
+    CacheEntry* entry = cache->newest;
+    while (entry) {
+        CacheEntry* older = entry->older;
+        release_cache_entry(entry);
+        entry = older;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+/* bucket_for()
+ * ------------
+ * Finds the hash chain holding a key. Must be called with the lock held.
+ *
+ * cache: cache to search
+ * key: key to look up
+ *
+ * Returns: pointer to the head pointer of the key's chain
+ */
+static CacheEntry** bucket_for(LruCache* cache, CacheKey key)
+{
+    return &cache->buckets[key.low & (cache->bucketCount - 1)];
+}
+
+/* unlink_lru()
+ * ------------
+ * Removes an entry from the recency list. Must be called with the lock held.
+ *
+ * cache: cache holding the entry
+ * entry: entry to unlink
+ *
+ * Returns: void
+ */
+static void unlink_lru(LruCache* cache, CacheEntry* entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+/* push_newest()
+ * -------------
+ * Makes an entry the most recently used. Must be called with the lock held.
+ *
+ * cache: cache holding the entry
+ * entry: entry not currently on the recency list
+ *
+ * Returns: void
+ */
+static void push_newest(LruCache* cache, CacheEntry* entry)
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/* remove_entry()
+ * --------------
+ * Removes an entry from the cache. Readers holding a reference keep it alive
+ * until they release it. Must be called with the lock held.
+ *
+ * cache: cache holding the entry
+ * victim: entry to remove
+ *
+ * Returns: void
+ */
+static void remove_entry(LruCache* cache, CacheEntry* victim)
+{
+    CacheEntry** link = bucket_for(cache, victim->key);
+    while (*link != victim) {
+        link = &(*link)->hashNext;
+    }
+    *link = victim->hashNext;
+    unlink_lru(cache, victim);
+    cache->bytesUsed -= victim->size + sizeof(CacheEntry);
+    cache->entryCount--;
+    release_cache_entry(victim);
+}
+
+/* grow_buckets()
+ * --------------
+ * Doubles the hash table once it holds more entries than buckets. Failure to
+ * allocate leaves the table as it is. Must be called with the lock held.
+ *
+ * cache: cache to grow
+ *
+ * Returns: void
+ */
+static void grow_buckets(LruCache* cache)
+{
+    size_t count = cache->bucketCount * 2;
+    CacheEntry** buckets = calloc(count, sizeof(CacheEntry*));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i < cache->bucketCount; i++) {
+        CacheEntry* entry = cache->buckets[i];
+        while (entry) {
+            CacheEntry* next = entry->hashNext;
+            CacheEntry** head = &buckets[entry->key.low & (count - 1)];
+            entry->hashNext = *head;
+            *head = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucketCount = count;
+}
+
+/* lru_cache_get()
+ * ---------------
+ * Looks up a key and marks its entry as the most recently used.
+ *
+ * cache: cache to search (NULL if caching is disabled)
+ * key: key to look up
+ *
+ * Returns: referenced entry which must be passed to release_cache_entry(),
+ *          or NULL if the key is not cached
+ */
+CacheEntry* lru_cache_get(LruCache* cache, CacheKey key)
+{
+    if (!cache) {
+        return NULL;
+    }
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry* entry = *bucket_for(cache, key);
+    while (entry
+            && (entry->key.high != key.high || entry->key.low != key.low)) {
+        entry = entry->hashNext;
+    }
+    if (entry) {
+        unlink_lru(cache, entry);
+        push_newest(cache, entry);
+        __atomic_add_fetch(&entry->refCount, 1, __ATOMIC_RELAXED);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/* lru_cache_put()
+ * ---------------
+ * Stores a copy of a value, replacing any value already cached under the
+ * key and evicting least recently used entries until it fits in the budget.
+ * Values larger than the whole budget are ignored.
+ *
+ * cache: cache to store into (NULL if caching is disabled)
+ * key: key identifying the value
+ * data: value bytes
+ * size: number of bytes
+ *
+ * Returns: void
+ */
+void lru_cache_put(LruCache* cache, CacheKey key, const void* data, size_t size)
+{
+    if (!cache || size + sizeof(CacheEntry) > cache->budget) {
+        return;
+    }
+    uint8_t* copy = malloc(size ? size : 1);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, data, size);
+    CacheEntry* entry = lru_cache_put_owned(cache, key, copy, size, NULL, NULL);
+    if (!entry) {
+        free(copy);
+    }
+    release_cache_entry(entry);
+}
+
+/* lru_cache_put_owned()
+ * ---------------------
+ * Stores a value without copying it: the entry takes over the bytes, which
+ * are freed with release(owner), or with free(data) if release is NULL, once
+ * neither the cache nor any reader holds the entry. Any value already cached
+ * under the key is replaced and least recently used entries are evicted
+ * until the value fits in the budget. A value larger than the whole budget,
+ * or given to a disabled cache, is not stored but is still wrapped in an
+ * entry for the caller.
+ *
+ * cache: cache to store into (NULL if caching is disabled)
+ * key: key identifying the value
+ * data: value bytes
+ * size: number of bytes
+ * release: function freeing the bytes, or NULL to free() them
+ * owner: argument to pass to release
+ *
+ * Returns: referenced entry holding the value, which must be passed to
+ *          release_cache_entry(), or NULL if memory could not be allocated
+ *          (the value is then left with the caller)
+ */
+CacheEntry* lru_cache_put_owned(LruCache* cache, CacheKey key, void* data,
+        size_t size, CacheRelease release, void* owner)
+{
+    CacheEntry* entry = calloc(1, sizeof(CacheEntry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->key = key;
+    entry->data = data;
+    entry->size = size;
+    entry->release = release;
+    entry->owner = owner;
+    entry->refCount = 1; // The caller's reference
+    if (!cache || size + sizeof(CacheEntry) > cache->budget) {
+        return entry;
+    }
+    entry->refCount++; // The cache's own reference
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry* old = *bucket_for(cache, key);
+    while (old && (old->key.high != key.high || old->key.low != key.low)) {
+        old = old->hashNext;
+    }
+    if (old) {
+        remove_entry(cache, old);
+    }
+    while (cache->bytesUsed + size + sizeof(CacheEntry) > cache->budget) {
+        remove_entry(cache, cache->oldest);
+        cache->evictions++;
+    }
+    if (cache->entryCount >= cache->bucketCount) {
+        grow_buckets(cache);
+    }
+    CacheEntry** head = bucket_for(cache, key);
+    entry->hashNext = *head;
+    *head = entry;
+    push_newest(cache, entry);
+    cache->bytesUsed += size + sizeof(CacheEntry);
+    cache->entryCount++;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/* write_cache_stats()
+ * -------------------
+ * Writes a cache's size and hit counters as "cache name field value" lines.
+ *
+ * stream: stream to write to
+ * cache: cache to report (NULL if caching is disabled)
+ * name: name identifying the cache in the output
+ *
+ * Returns: void
+ */
+void write_cache_stats(FILE* stream, LruCache* cache, const char* name)
+{
+    if (!cache) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    fprintf(stream,
+            "cache %s entries %lu bytes %lu budget %lu hits %lu misses %lu"
+            " evictions %lu\n",
+            name, (unsigned long)cache->entryCount,
+            (unsigned long)cache->bytesUsed, (unsigned long)cache->budget,
+            (unsigned long)cache->hits, (unsigned long)cache->misses,
+            (unsigned long)cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,65 @@
+/* CSSE2310 2025 Assignment Four
+ * cache.h
+ *
+ * Written by William White
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// 128-bit content hash identifying a cached value
+typedef struct {
+    uint64_t high;
+    uint64_t low;
+} CacheKey;
+
+// Frees the value bytes an entry was given by lru_cache_put_owned()
+typedef void (*CacheRelease)(void* owner);
+
+// A cached value. Entries are reference counted so that readers can keep
+// using the bytes after the entry has been evicted. The bytes are freed with
+// release(owner), or with free() if release is NULL.
+typedef struct CacheEntry {
+    CacheKey key;
+    uint8_t* data;
+    size_t size;
+    CacheRelease release;
+    void* owner;
+    int refCount;
+    struct CacheEntry* hashNext;
+    struct CacheEntry* newer;
+    struct CacheEntry* older;
+} CacheEntry;
+
+// Thread-safe least recently used cache with a memory budget in bytes
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry** buckets;
+    size_t bucketCount;
+    size_t entryCount;
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    size_t bytesUsed;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} LruCache;
+
+// Function Prototypes
+CacheKey hash_bytes(const void* data, size_t size);
+CacheKey combine_cache_key(CacheKey key, uint64_t value);
+LruCache* create_lru_cache(size_t budget);
+void free_lru_cache(LruCache* cache);
+CacheEntry* lru_cache_get(LruCache* cache, CacheKey key);
+void lru_cache_put(
+        LruCache* cache, CacheKey key, const void* data, size_t size);
+CacheEntry* lru_cache_put_owned(LruCache* cache, CacheKey key, void* data,
+        size_t size, CacheRelease release, void* owner);
+void release_cache_entry(CacheEntry* entry);
+void write_cache_stats(FILE* stream, LruCache* cache, const char* name);
+#endif
@@ -0,0 +1,485 @@
+/* CSSE2310 2025 Assignment Four
+ * facebench.c
+ *
+ * Written by William White
+ */
+
+#include "pipeline.h"
+#include "protocol.h"
+#include "stats.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+/* -------------------------------------------------------------------------- */
+// Constants
+
+// Exit Messages
+const char* const usageErrorMessage
+        = "Usage: ./facebench [decode|greyscale|face_detect|eye_search|draw|"
+          "paste|encode ...]\n";
+const char* const cascadeWarningMessage
+        = "facebench: cannot load the %s cascade, skipping %s\n";
+
+// Stage names, indexed by BenchStage
+static const char* const stageNames[] = {"decode", "greyscale", "face_detect",
+        "eye_search", "draw", "paste", "encode"};
+
+// Synthetic corpus: an image of every size with every number of faces
+static const CvSize corpusSizes[]
+        = {{320, 240}, {640, 480}, {1280, 720}, {1920, 1080}};
+static const int corpusFaceCounts[] = {1, 4, 16};
+
+/* -------------------------------------------------------------------------- */
+// Enum Definitions
+
+// Program exit codes
+typedef enum {
+    EXIT_USAGE_STATUS = 10,
+    EXIT_MEMORY_STATUS = 13
+} ExitStatus;
+
+// Pipeline stages that can be benchmarked
+typedef enum {
+    BENCH_DECODE,
+    BENCH_GREYSCALE,
+    BENCH_FACE_DETECT,
+    BENCH_EYE_SEARCH,
+    BENCH_DRAW,
+    BENCH_PASTE,
+    BENCH_ENCODE,
+    BENCH_STAGE_COUNT
+} BenchStage;
+
+typedef enum {
+    DETECT_SIZE = 0, // uqfacedetect's default --detectsize (full size)
+    MIN_BENCH_MS = 200,
+    MIN_ITERATIONS = 3,
+    NS_PER_MS = 1000000,
+    NS_PER_SECOND = 1000000000,
+    FACE_SOURCE_SIZE = 256,
+    EYES_PER_FACE = 2,
+    TEXTURE_X = 7,
+    TEXTURE_Y = 13,
+    TEXTURE_MOD = 31,
+    CHANNEL_STEP = 85,
+    CHANNELS = 3,
+    BYTE_MASK = 0xFF,
+    SKIN_BLUE = 140,
+    SKIN_GREEN = 170,
+    SKIN_RED = 220,
+    FEATURE_SHADE = 40,
+    DEGREES_IN_CIRCLE = 360,
+    LINE_TYPE = 8,
+    FILLED = -1
+} MagicNumbers;
+
+/* -------------------------------------------------------------------------- */
+// Struct Definitions
+
+// Classifiers and scratch storage the detection stages run with. A cascade
+// is NULL if its stage is not being run
+typedef struct {
+    CvHaarClassifierCascade* faceCascade;
+    CvHaarClassifierCascade* eyeCascade;
+    CvMemStorage* storage;
+} BenchTools;
+
+// A synthetic corpus image with the inputs of every stage prepared, so that
+// each stage can be timed on its own. Stages that draw on the image are run
+// on a copy, so every stage sees the image as generated
+typedef struct {
+    IplImage* img;
+    CvMat* encoded;
+    IplImage* grey;
+    Detections* detections;
+    IplImage** faces;
+} CorpusImage;
+
+/* -------------------------------------------------------------------------- */
+// Function Prototypes
+void parse_stages(int argc, char* argv[], bool* stages);
+CvHaarClassifierCascade* load_stage_cascade(
+        const char* path, const char* name, BenchStage stage, bool* stages);
+CorpusImage* create_corpus(int* count);
+IplImage* synthetic_image(CvSize size, int faceCount, Detections** detections);
+void draw_face(IplImage* img, CvRect face, CvRect* eyes);
+void free_corpus(CorpusImage* corpus, int count);
+void bench_stage(BenchStage stage, CorpusImage* image, BenchTools* tools);
+uint64_t time_stage(BenchStage stage, CorpusImage* image, BenchTools* tools);
+void run_stage(BenchStage stage, CorpusImage* image, IplImage* target,
+        BenchTools* tools);
+
+// Default encoding options of uqfacedetect
+static const EncodeOptions defaultEncoding
+        = {FORMAT_JPEG, ENCODING_DEFAULT_LEVEL};
+
+int main(int argc, char* argv[])
+{
+    bool stages[BENCH_STAGE_COUNT];
+    parse_stages(argc, argv, stages);
+    BenchTools tools;
+    tools.faceCascade = load_stage_cascade(
+            FACE_CASCADE, "face", BENCH_FACE_DETECT, stages);
+    tools.eyeCascade = load_stage_cascade(
+            EYE_CASCADE, "eye", BENCH_EYE_SEARCH, stages);
+    tools.storage = cvCreateMemStorage(0);
+    int count;
+    CorpusImage* corpus = create_corpus(&count);
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        for (int i = 0; stages[stage] && i < count; i++) {
+            bench_stage((BenchStage)stage, &corpus[i], &tools);
+        }
+    }
+    free_corpus(corpus, count);
+    cvReleaseMemStorage(&tools.storage);
+    if (tools.faceCascade) {
+        cvRelease((void**)&tools.faceCascade);
+    }
+    if (tools.eyeCascade) {
+        cvRelease((void**)&tools.eyeCascade);
+    }
+    return 0;
+}
+
+/* parse_stages()
+ * --------------
+ * Works out which stages to run from the command line: those named, or all
+ * of them if none are.
+ *
+ * argc: number of command line arguments
+ * argv: array of command line argument strings
+ * stages: set to whether each stage, indexed by BenchStage, should run
+ *
+ * Returns: void
+ * Errors: exits with code 10 if an argument is not a stage name
+ */
+void parse_stages(int argc, char* argv[], bool* stages)
+{
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        stages[stage] = argc < 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        int stage = 0;
+        while (stage < BENCH_STAGE_COUNT
+                && strcmp(argv[i], stageNames[stage]) != 0) {
+            stage++;
+        }
+        if (stage == BENCH_STAGE_COUNT) {
+            fprintf(stderr, usageErrorMessage);
+            exit(EXIT_USAGE_STATUS);
+        }
+        stages[stage] = true;
+    }
+}
+
+/* load_stage_cascade()
+ * --------------------
+ * Loads the cascade a stage needs if that stage is to be run. If it cannot
+ * be loaded, a warning is printed and the stage is skipped.
+ *
+ * path: cascade file to load
+ * name: name of the cascade for the warning
+ * stage: stage that uses the cascade
+ * stages: whether each stage should run; the stage is cleared on failure
+ *
+ * Returns: loaded cascade, or NULL if the stage is not being run
+ */
+CvHaarClassifierCascade* load_stage_cascade(
+        const char* path, const char* name, BenchStage stage, bool* stages)
+{
+    if (!stages[stage]) {
+        return NULL;
+    }
+    CvHaarClassifierCascade* cascade
+            = (CvHaarClassifierCascade*)cvLoad(path, 0, 0, 0);
+    if (!cascade) {
+        fprintf(stderr, cascadeWarningMessage, name, stageNames[stage]);
+        stages[stage] = false;
+    }
+    return cascade;
+}
+
+/* create_corpus()
+ * ---------------
+ * Generates the synthetic corpus and prepares each image's stage inputs:
+ * its JPEG encoding, its greyscale image, the faces drawn into it, and a
+ * replacement face scaled to each of them.
+ *
+ * count: set to the number of corpus images
+ *
+ * Returns: newly allocated corpus (free with free_corpus())
+ * Errors: exits with code 13 if memory cannot be allocated
+ */
+CorpusImage* create_corpus(int* count)
+{
+    int sizeCount = sizeof(corpusSizes) / sizeof(corpusSizes[0]);
+    int faceCountCount = sizeof(corpusFaceCounts) / sizeof(corpusFaceCounts[0]);
+    *count = sizeCount * faceCountCount;
+    CorpusImage* corpus = calloc(*count, sizeof(CorpusImage));
+    if (!corpus) {
+        exit(EXIT_MEMORY_STATUS);
+    }
+    Detections* sourceDetections;
+    IplImage* source = synthetic_image(
+            cvSize(FACE_SOURCE_SIZE, FACE_SOURCE_SIZE), 1, &sourceDetections);
+    free(sourceDetections);
+    for (int i = 0; i < *count; i++) {
+        CorpusImage* image = &corpus[i];
+        image->img = synthetic_image(corpusSizes[i / faceCountCount],
+                corpusFaceCounts[i % faceCountCount], &image->detections);
+        image->encoded = encode_image(image->img, &defaultEncoding);
+        double scale;
+        image->grey = make_greyscale(image->img, DETECT_SIZE, &scale);
+        int faceCount = image->detections->faceCount;
+        image->faces = malloc(faceCount * sizeof(IplImage*));
+        if (!image->encoded || !image->faces) {
+            exit(EXIT_MEMORY_STATUS);
+        }
+        for (int j = 0; j < faceCount; j++) {
+            CvRect rect = detection_faces(image->detections)[j];
+            image->faces[j] = cvCreateImage(cvSize(rect.width, rect.height),
+                    source->depth, source->nChannels);
+            cvResize(source, image->faces[j], CV_INTER_LINEAR);
+        }
+    }
+    cvReleaseImage(&source);
+    return corpus;
+}
+
+/* synthetic_image()
+ * -----------------
+ * Creates a textured colour image with simple faces laid out on a grid,
+ * one face centred in each cell.
+ *
+ * size: image size
+ * faceCount: number of faces to draw
+ * detections: set to the rectangles of the faces and their eyes (free with
+ *             free())
+ *
+ * Returns: newly allocated image
+ * Errors: exits with code 13 if memory cannot be allocated
+ */
+IplImage* synthetic_image(CvSize size, int faceCount, Detections** detections)
+{
+    IplImage* img = cvCreateImage(size, IPL_DEPTH_8U, CHANNELS);
+    for (int y = 0; y < size.height; y++) {
+        unsigned char* row
+                = (unsigned char*)img->imageData + y * img->widthStep;
+        for (int x = 0; x < size.width; x++) {
+            int base = x * TEXTURE_X + y * TEXTURE_Y + (x * y) % TEXTURE_MOD;
+            for (int c = 0; c < CHANNELS; c++) {
+                row[x * CHANNELS + c] = (base + c * CHANNEL_STEP) & BYTE_MASK;
+            }
+        }
+    }
+    int eyeCount = faceCount * EYES_PER_FACE;
+    *detections = malloc(detections_size(faceCount, eyeCount));
+    if (!*detections) {
+        exit(EXIT_MEMORY_STATUS);
+    }
+    (*detections)->faceCount = faceCount;
+    (*detections)->eyeCount = eyeCount;
+    (*detections)->eyesSearched = true;
+    int columns = 1;
+    while (columns * columns < faceCount) {
+        columns++;
+    }
+    int rows = (faceCount + columns - 1) / columns;
+    int cellWidth = size.width / columns;
+    int cellHeight = size.height / rows;
+    int side = (cellWidth < cellHeight ? cellWidth : cellHeight) * 3 / 4;
+    for (int i = 0; i < faceCount; i++) {
+        CvRect face = cvRect((i % columns) * cellWidth + (cellWidth - side) / 2,
+                (i / columns) * cellHeight + (cellHeight - side) / 2, side,
+                side);
+        detection_faces(*detections)[i] = face;
+        detection_eye_ends(*detections)[i] = (i + 1) * EYES_PER_FACE;
+        draw_face(img, face, detection_eyes(*detections) + i * EYES_PER_FACE);
+    }
+    return img;
+}
+
+/* draw_face()
+ * -----------
+ * Draws a simple face: a skin coloured oval with two dark eyes and a mouth.
+ *
+ * img: image to draw on
+ * face: rectangle the face fills
+ * eyes: set to the rectangles of the two eyes
+ *
+ * Returns: void
+ */
+void draw_face(IplImage* img, CvRect face, CvRect* eyes)
+{
+    CvScalar skin = cvScalar(SKIN_BLUE, SKIN_GREEN, SKIN_RED, 0);
+    CvScalar shade = cvScalar(FEATURE_SHADE, FEATURE_SHADE, FEATURE_SHADE, 0);
+    CvPoint centre = cvPoint(
+            face.x + face.width / 2, face.y + face.height / 2);
+    cvEllipse(img, centre, cvSize(face.width / 2, face.height / 2), 0, 0,
+            DEGREES_IN_CIRCLE, skin, FILLED, LINE_TYPE, 0);
+    int eye = face.width / 5;
+    for (int i = 0; i < EYES_PER_FACE; i++) {
+        eyes[i] = cvRect(face.x + face.width * (1 + 2 * i) / 4 - eye / 2,
+                face.y + face.height / 3 - eye / 2, eye, eye);
+        cvCircle(img,
+                cvPoint(eyes[i].x + eye / 2, eyes[i].y + eye / 2), eye / 2,
+                shade, FILLED, LINE_TYPE, 0);
+    }
+    cvRectangle(img,
+            cvPoint(face.x + face.width / 3, face.y + face.height * 2 / 3),
+            cvPoint(face.x + face.width * 2 / 3,
+                    face.y + face.height * 3 / 4),
+            shade, FILLED, LINE_TYPE, 0);
+}
+
+/* free_corpus()
+ * -------------
+ * Frees the corpus and every stage input prepared for it.
+ *
+ * corpus: corpus to free
+ * count: number of corpus images
+ *
+ * Returns: void
+ */
+void free_corpus(CorpusImage* corpus, int count)
+{
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < corpus[i].detections->faceCount; j++) {
+            cvReleaseImage(&corpus[i].faces[j]);
+        }
+        free(corpus[i].faces);
+        free(corpus[i].detections);
+        cvReleaseImage(&corpus[i].grey);
+        cvReleaseMat(&corpus[i].encoded);
+        cvReleaseImage(&corpus[i].img);
+    }
+    free(corpus);
+}
+
+/* bench_stage()
+ * -------------
+ * Times one stage on one corpus image, repeating it for at least
+ * MIN_BENCH_MS (and MIN_ITERATIONS times) after an untimed warm up run,
+ * then reports the time per pixel of the full size image and the number of
+ * images the stage could process per second. Only the stage itself is
+ * timed, but the repeats stop on total time so that a fast stage's untimed
+ * setup cannot keep it running for long.
+ *
+ * stage: stage to time
+ * image: corpus image to run it on
+ * tools: cascades and storage for the detection stages
+ *
+ * Returns: void
+ */
+void bench_stage(BenchStage stage, CorpusImage* image, BenchTools* tools)
+{
+    time_stage(stage, image, tools);
+    uint64_t start = monotonic_ns();
+    uint64_t elapsed = 0;
+    int iterations = 0;
+    do {
+        elapsed += time_stage(stage, image, tools);
+        iterations++;
+    } while (iterations < MIN_ITERATIONS
+            || monotonic_ns() - start < (uint64_t)MIN_BENCH_MS * NS_PER_MS);
+    double pixels = (double)image->img->width * image->img->height;
+    printf("stage %s size %dx%d faces %d ns_per_pixel %.3f images_per_sec "
+           "%.1f\n",
+            stageNames[stage], image->img->width, image->img->height,
+            image->detections->faceCount, elapsed / pixels / iterations,
+            (double)iterations * NS_PER_SECOND / elapsed);
+    fflush(stdout);
+}
+
+/* time_stage()
+ * ------------
+ * Runs one stage once on a corpus image and times it. The draw and paste
+ * stages draw on a copy of the image, made and freed outside the timed
+ * region, so the corpus image is never changed.
+ *
+ * stage: stage to run
+ * image: corpus image to run it on
+ * tools: cascades and storage for the detection stages
+ *
+ * Returns: time taken by the stage in nanoseconds
+ */
+uint64_t time_stage(BenchStage stage, CorpusImage* image, BenchTools* tools)
+{
+    IplImage* target = NULL;
+    if (stage == BENCH_DRAW || stage == BENCH_PASTE) {
+        target = cvCloneImage(image->img);
+    }
+    uint64_t start = monotonic_ns();
+    run_stage(stage, image, target, tools);
+    uint64_t elapsed = monotonic_ns() - start;
+    if (target) {
+        cvReleaseImage(&target);
+    }
+    return elapsed;
+}
+
+/* run_stage()
+ * -----------
+ * Runs one stage once on a corpus image, calling the same pipeline
+ * function uqfacedetect does. The eye search stage searches each face in
+ * turn, as a request does when no other worker is free to help. The paste
+ * stage pastes a face already scaled to each face rectangle, as when the
+ * scaled face is in the face cache.
+ *
+ * stage: stage to run
+ * image: corpus image to run it on
+ * target: copy of the image for the draw and paste stages to draw on
+ *         (NULL for other stages)
+ * tools: cascades and storage for the detection stages
+ *
+ * Returns: void
+ */
+void run_stage(BenchStage stage, CorpusImage* image, IplImage* target,
+        BenchTools* tools)
+{
+    IplImage* output = NULL;
+    CvMat* encoded = NULL;
+    CvRect* eyes;
+    double scale;
+    switch (stage) {
+    case BENCH_DECODE:
+        output = decode_image(image->encoded->data.ptr, image->encoded->cols);
+        break;
+    case BENCH_GREYSCALE:
+        output = make_greyscale(image->img, DETECT_SIZE, &scale);
+        break;
+    case BENCH_FACE_DETECT:
+        detect_faces(image->grey, tools->faceCascade, tools->storage);
+        cvClearMemStorage(tools->storage);
+        break;
+    case BENCH_EYE_SEARCH:
+        for (int i = 0; i < image->detections->faceCount; i++) {
+            search_eyes(image->grey, detection_faces(image->detections)[i],
+                    tools->eyeCascade, &eyes);
+            free(eyes);
+        }
+        break;
+    case BENCH_DRAW:
+        draw_detections(target, image->detections);
+        break;
+    case BENCH_PASTE:
+        for (int i = 0; i < image->detections->faceCount; i++) {
+            paste_face(target, detection_faces(image->detections)[i],
+                    image->faces[i]);
+        }
+        break;
+    case BENCH_ENCODE:
+        encoded = encode_image(image->img, &defaultEncoding);
+        break;
+    default:
+        break;
+    }
+    if (output) {
+        cvReleaseImage(&output);
+    }
+    if (encoded) {
+        cvReleaseMat(&encoded);
+    }
+}
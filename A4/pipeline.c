@@ -0,0 +1,295 @@
+/* CSSE2310 2025 Assignment Four
+ * pipeline.c
+ *
+ * Written by William White
+ */
+
+#include "pipeline.h"
+#include "protocol.h"
+#include "stats.h"
+#include "util.h"
+#include <stdlib.h>
+
+#define HALF 0.5
+#define SCALE_FACTOR 1.1
+#define EYE_RADIUS_FACTOR 0.25
+#define NO_SCALE 1.0
+
+typedef enum {
+    DEGREES_IN_CIRCLE = 360,
+    COLOUR_MAX = 255,
+    LINE_THICKNESS = 3,
+    MIN_NEIGHBOURS = 3,
+    LINE_TYPE = 8,
+    EYE_MIN_SIZE = 15,
+    FACE_MIN_SIZE = 30
+} PipelineConstants;
+
+// Output encoders, indexed by OutputFormat: file extension and the encoder
+// parameter set by an encoding level
+static const char* const encodingExtensions[] = {".jpg", ".png", ".webp"};
+static const int encodingParams[] = {CV_IMWRITE_JPEG_QUALITY,
+        CV_IMWRITE_PNG_COMPRESSION, CV_IMWRITE_WEBP_QUALITY};
+
+/* decode_image()
+ * --------------
+ * Decodes an encoded image (JPEG, PNG, etc.) straight from a memory buffer.
+ *
+ * data: encoded image bytes
+ * size: number of encoded bytes
+ *
+ * Returns: newly allocated colour image, or NULL if the data is not a valid
+ *          image
+ */
+IplImage* decode_image(const uint8_t* data, uint32_t size)
+{
+    uint64_t start = monotonic_ns();
+    CvMat buf = cvMat(1, (int)size, CV_8UC1, (void*)data);
+    IplImage* img = cvDecodeImage(&buf, CV_LOAD_IMAGE_COLOR);
+    record_stage_time(STAGE_DECODE, start);
+    return img;
+}
+
+/* make_greyscale()
+ * ----------------
+ * Converts a color image to greyscale for feature detection, shrinking it so
+ * that its longer side is at most maxDimension, and applies histogram
+ * equalization to improve contrast. Searching the smaller image is much
+ * faster and still finds faces well above FACE_MIN_SIZE.
+ *
+ * img: pointer to source color image
+ * maxDimension: longest side of the greyscale image, or 0 for full size
+ * scale: set to the factor mapping greyscale coordinates back to img
+ *
+ * Returns: pointer to newly created greyscale image
+ */
+IplImage* make_greyscale(
+        IplImage* img, unsigned int maxDimension, double* scale)
+{
+    uint64_t start = monotonic_ns();
+    IplImage* grey = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, 1);
+    cvCvtColor(img, grey, CV_BGR2GRAY);
+    unsigned int longest
+            = (unsigned int)(img->width > img->height ? img->width
+                                                      : img->height);
+    *scale = NO_SCALE;
+    if (maxDimension != 0 && longest > maxDimension) {
+        *scale = (double)longest / maxDimension;
+        CvSize size = cvSize(cvRound(img->width / *scale),
+                cvRound(img->height / *scale));
+        size.width = size.width > 0 ? size.width : 1;
+        size.height = size.height > 0 ? size.height : 1;
+        IplImage* small = cvCreateImage(size, IPL_DEPTH_8U, 1);
+        cvResize(grey, small, CV_INTER_AREA);
+        cvReleaseImage(&grey);
+        grey = small;
+    }
+    cvEqualizeHist(grey, grey);
+    record_stage_time(STAGE_GREYSCALE, start);
+    return grey;
+}
+
+/* scale_rect()
+ * ------------
+ * Maps a rectangle found in a downscaled greyscale image back onto the
+ * full size image, clipped to the image bounds.
+ *
+ * rect: rectangle in greyscale image coordinates
+ * scale: factor from make_greyscale()
+ * img: full size image
+ *
+ * Returns: rectangle in img coordinates
+ */
+CvRect scale_rect(CvRect rect, double scale, const IplImage* img)
+{
+    if (scale == NO_SCALE) {
+        return rect;
+    }
+    CvRect scaled = cvRect(cvRound(rect.x * scale), cvRound(rect.y * scale),
+            cvRound(rect.width * scale), cvRound(rect.height * scale));
+    if (scaled.x + scaled.width > img->width) {
+        scaled.width = img->width - scaled.x;
+    }
+    if (scaled.y + scaled.height > img->height) {
+        scaled.height = img->height - scaled.y;
+    }
+    return scaled;
+}
+
+/* detect_faces()
+ * --------------
+ * Runs the face cascade over a greyscale image.
+ *
+ * grey: equalised greyscale image to search
+ * faceCascade: face cascade classifier
+ * storage: memory storage for the detected rectangles
+ *
+ * Returns: sequence of face rectangles (may be NULL or empty)
+ */
+CvSeq* detect_faces(IplImage* grey, CvHaarClassifierCascade* faceCascade,
+        CvMemStorage* storage)
+{
+    uint64_t start = monotonic_ns();
+    CvSeq* faces = cvHaarDetectObjects(grey, faceCascade, storage,
+            SCALE_FACTOR, MIN_NEIGHBOURS, 0,
+            cvSize(FACE_MIN_SIZE, FACE_MIN_SIZE), cvSize(0, 0));
+    record_stage_time(STAGE_FACE_DETECT, start);
+    return faces;
+}
+
+/* search_eyes()
+ * -------------
+ * Runs the eye cascade inside one face. The search uses its own image
+ * header (sharing the greyscale pixels) and memory storage, so searches of
+ * different faces in the same image can run at the same time.
+ *
+ * grey: equalised greyscale image the face was found in (not modified)
+ * face: face rectangle in greyscale coordinates
+ * eyeCascade: eye cascade classifier, used by this thread only
+ * eyes: set to a newly allocated array of the eyes found, in greyscale
+ *       coordinates (NULL if there are none)
+ *
+ * Returns: number of eyes found, or -1 if memory could not be allocated
+ */
+int search_eyes(IplImage* grey, CvRect face,
+        CvHaarClassifierCascade* eyeCascade, CvRect** eyes)
+{
+    uint64_t start = monotonic_ns();
+    IplImage* view = cvCreateImageHeader(
+            cvGetSize(grey), grey->depth, grey->nChannels);
+    CvMemStorage* storage = cvCreateMemStorage(0);
+    cvSetData(view, grey->imageData, grey->widthStep);
+    cvSetImageROI(view, face);
+    CvSeq* found = cvHaarDetectObjects(view, eyeCascade, storage,
+            SCALE_FACTOR, LINE_THICKNESS, 0,
+            cvSize(EYE_MIN_SIZE, EYE_MIN_SIZE), cvSize(0, 0));
+    record_stage_time(STAGE_EYE_DETECT, start);
+    int total = found ? found->total : 0;
+    *eyes = total ? malloc(total * sizeof(CvRect)) : NULL;
+    if (total && !*eyes) {
+        total = -1;
+    }
+    for (int j = 0; j < total; ++j) {
+        CvRect eye = *(CvRect*)cvGetSeqElem(found, j);
+        eye.x += face.x;
+        eye.y += face.y;
+        (*eyes)[j] = eye;
+    }
+    cvReleaseImageHeader(&view);
+    cvReleaseMemStorage(&storage);
+    return total;
+}
+
+/* detection_faces()
+ * -----------------
+ * Returns: the face rectangles stored after a Detections header
+ */
+CvRect* detection_faces(Detections* detections)
+{
+    return (CvRect*)(detections + 1);
+}
+
+/* detection_eye_ends()
+ * --------------------
+ * Returns: the per-face eye end indexes stored after the face rectangles.
+ *          The eyes of face i are eyes[ends[i - 1]] up to eyes[ends[i]].
+ */
+int* detection_eye_ends(Detections* detections)
+{
+    return (int*)(detection_faces(detections) + detections->faceCount);
+}
+
+/* detection_eyes()
+ * ----------------
+ * Returns: the eye rectangles stored after the eye end indexes
+ */
+CvRect* detection_eyes(Detections* detections)
+{
+    return (CvRect*)(detection_eye_ends(detections) + detections->faceCount);
+}
+
+/* detections_size()
+ * -----------------
+ * Returns: the number of bytes needed to hold a Detections block with the
+ *          given number of faces and eyes
+ */
+size_t detections_size(int faceCount, int eyeCount)
+{
+    return sizeof(Detections) + faceCount * (sizeof(CvRect) + sizeof(int))
+            + eyeCount * sizeof(CvRect);
+}
+
+/* draw_detections()
+ * -----------------
+ * Draws detection markers on an image for detected faces and eyes.
+ * Draws magenta ellipses around faces and green circles around eyes.
+ *
+ * img: image to draw on
+ * detections: face and eye rectangles in img coordinates
+ *
+ * Returns: void
+ */
+void draw_detections(IplImage* img, Detections* detections)
+{
+    CvRect* faces = detection_faces(detections);
+    int* eyeEnds = detection_eye_ends(detections);
+    CvRect* eyes = detection_eyes(detections);
+    int eye = 0;
+    for (int i = 0; i < detections->faceCount; ++i) {
+        CvRect* r = &faces[i];
+        CvPoint center = {cvRound(r->x + r->width * HALF),
+                cvRound(r->y + r->height * HALF)};
+        cvEllipse(img, center, cvSize(r->width / 2, r->height / 2), 0, 0,
+                DEGREES_IN_CIRCLE, cvScalar(COLOUR_MAX, 0, COLOUR_MAX, 0),
+                LINE_THICKNESS, LINE_TYPE, 0);
+        for (; eye < eyeEnds[i]; ++eye) {
+            CvRect* er = &eyes[eye];
+            // Integer halves, as eyes have always been drawn; only
+            // coordinates scale_rect() has scaled are rounded
+            CvPoint eyeCentre
+                    = {er->x + er->width / 2, er->y + er->height / 2};
+            int radius = cvRound((er->width + er->height) * EYE_RADIUS_FACTOR);
+            cvCircle(img, eyeCentre, radius, cvScalar(0, COLOUR_MAX, 0, 0),
+                    LINE_THICKNESS, LINE_TYPE, 0);
+        }
+    }
+}
+
+/* paste_face()
+ * ------------
+ * Copies a replacement face, already scaled to the size of a face
+ * rectangle, over that rectangle of an image.
+ *
+ * img: image to paste into
+ * rect: face rectangle in img coordinates
+ * face: replacement face the same size as rect
+ *
+ * Returns: void
+ */
+void paste_face(IplImage* img, CvRect rect, const IplImage* face)
+{
+    cvSetImageROI(img, rect);
+    cvCopy(face, img, NULL);
+    cvResetImageROI(img);
+}
+
+/* encode_image()
+ * --------------
+ * Encodes an image into a memory buffer ready to send to a client, in the
+ * format and at the level the client asked for.
+ *
+ * img: image to encode
+ * options: output format and level
+ *
+ * Returns: single row matrix holding the encoded bytes (release with
+ *          cvReleaseMat()), or NULL on failure
+ */
+CvMat* encode_image(const IplImage* img, const EncodeOptions* options)
+{
+    uint64_t start = monotonic_ns();
+    int params[] = {encodingParams[options->format], options->level, 0};
+    CvMat* encoded = cvEncodeImage(encodingExtensions[options->format], img,
+            options->level == ENCODING_DEFAULT_LEVEL ? NULL : params);
+    record_stage_time(STAGE_ENCODE, start);
+    return encoded;
+}
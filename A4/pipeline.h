@@ -0,0 +1,52 @@
+/* CSSE2310 2025 Assignment Four
+ * pipeline.h
+ *
+ * Written by William White
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <opencv2/imgcodecs/imgcodecs_c.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+#include <opencv2/core/core_c.h>
+
+#define FACE_CASCADE                                                           \
+    "/local/courses/csse2310/resources/a4/haarcascade_frontalface_alt2.xml"
+#define EYE_CASCADE                                                            \
+    "/local/courses/csse2310/resources/a4/haarcascade_eye_tree_eyeglasses.xml"
+
+// Output image encoding requested by a client (see OP_FLAG_ENCODING)
+typedef struct {
+    unsigned char format;
+    unsigned char level;
+} EncodeOptions;
+
+// Face and eye rectangles found in an image, in full image coordinates.
+// Allocated as one block (so it can be cached as plain bytes) followed by
+// CvRect faces[faceCount], int eyeEnds[faceCount] and CvRect eyes[eyeCount]
+typedef struct {
+    int faceCount;
+    int eyeCount;
+    int eyesSearched;
+} Detections;
+
+// Function Prototypes
+IplImage* decode_image(const uint8_t* data, uint32_t size);
+IplImage* make_greyscale(
+        IplImage* img, unsigned int maxDimension, double* scale);
+CvRect scale_rect(CvRect rect, double scale, const IplImage* img);
+CvSeq* detect_faces(IplImage* grey, CvHaarClassifierCascade* faceCascade,
+        CvMemStorage* storage);
+int search_eyes(IplImage* grey, CvRect face,
+        CvHaarClassifierCascade* eyeCascade, CvRect** eyes);
+CvRect* detection_faces(Detections* detections);
+int* detection_eye_ends(Detections* detections);
+CvRect* detection_eyes(Detections* detections);
+size_t detections_size(int faceCount, int eyeCount);
+void draw_detections(IplImage* img, Detections* detections);
+void paste_face(IplImage* img, CvRect rect, const IplImage* face);
+CvMat* encode_image(const IplImage* img, const EncodeOptions* options);
+#endif
@@ -100,6 +100,40 @@ static int read_all(FILE* stream, void* buffer, size_t size)
     return 0;
 }
 
+/* encode_uint32_le()
+ * ------------------
+ * Stores a 32-bit unsigned integer into a byte buffer in little-endian byte
+ * order, as used for all integers in the protocol.
+ *
+ * value: 32-bit unsigned integer to encode
+ * bytes: buffer of at least 4 bytes to store the encoded value in
+ *
+ * Returns: void
+ */
+void encode_uint32_le(uint32_t value, unsigned char* bytes)
+{
+    bytes[BYTE_0] = (unsigned char)(value & BYTE_MASK);
+    bytes[BYTE_1] = (unsigned char)((value >> BYTE_SHIFT_1) & BYTE_MASK);
+    bytes[BYTE_2] = (unsigned char)((value >> BYTE_SHIFT_2) & BYTE_MASK);
+    bytes[BYTE_3] = (unsigned char)((value >> BYTE_SHIFT_3) & BYTE_MASK);
+}
+
+/* decode_uint32_le()
+ * ------------------
+ * Converts 4 little-endian bytes into a 32-bit unsigned integer in host byte
+ * order.
+ *
+ * bytes: buffer holding at least 4 encoded bytes
+ *
+ * Returns: the decoded value
+ */
+uint32_t decode_uint32_le(const unsigned char* bytes)
+{
+    return ((uint32_t)bytes[BYTE_0]) | ((uint32_t)bytes[BYTE_1] << BYTE_SHIFT_1)
+            | ((uint32_t)bytes[BYTE_2] << BYTE_SHIFT_2)
+            | ((uint32_t)bytes[BYTE_3] << BYTE_SHIFT_3);
+}
+
 /* write_uint32_le()
  * -----------------
  * Writes a 32-bit unsigned integer to a stream in little-endian byte order
@@ -113,10 +147,7 @@ static int read_all(FILE* stream, void* buffer, size_t size)
 static int write_uint32_le(FILE* stream, uint32_t value)
 {
     unsigned char bytes[BYTE_4];
-    bytes[BYTE_0] = (unsigned char)(value & BYTE_MASK);
-    bytes[BYTE_1] = (unsigned char)((value >> BYTE_SHIFT_1) & BYTE_MASK);
-    bytes[BYTE_2] = (unsigned char)((value >> BYTE_SHIFT_2) & BYTE_MASK);
-    bytes[BYTE_3] = (unsigned char)((value >> BYTE_SHIFT_3) & BYTE_MASK);
+    encode_uint32_le(value, bytes);
     return fwrite(bytes, 1, UINT32_NUM_BYTES, stream) == UINT32_NUM_BYTES ? 0
                                                                           : -1;
 }
@@ -137,9 +168,7 @@ int read_uint32_le(FILE* stream, uint32_t* outvalue)
     if (read_all(stream, bytes, UINT32_NUM_BYTES) != 0) {
         return -1;
     }
-    *outvalue = ((uint32_t)bytes[0]) | ((uint32_t)bytes[1] << BYTE_SHIFT_1)
-            | ((uint32_t)bytes[2] << BYTE_SHIFT_2)
-            | ((uint32_t)bytes[BYTE_3] << BYTE_SHIFT_3);
+    *outvalue = decode_uint32_le(bytes);
     return 0;
 }
 
@@ -161,46 +190,65 @@ int read_uint32_le(FILE* stream, uint32_t* outvalue)
 int send_request(FILE* to, const unsigned char* detectData, size_t detectSize,
         const unsigned char* replaceData, size_t replaceSize)
 {
-    if (!to || !detectData || detectSize == 0) {
-        communication_error(); // Cannot send a request without detect image
-    }
-
-    if (write_uint32_le(to, PROTOCOL_PREFIX) != 0) { // Write prefix
+    if (write_request(to, detectData, detectSize, replaceData, replaceSize)
+            != 0) {
         communication_error();
     }
+    return 0; // success
+}
 
+/* write_request()
+ * ---------------
+ * Writes and flushes a face detection request, or a face replacement request
+ * if a replacement image is given, without exiting on failure.
+ *
+ * to: FILE stream to write request to
+ * detectData: buffer containing image data for face detection
+ * detectSize: size of detection image data
+ * replaceData: buffer containing replacement face image (may be NULL)
+ * replaceSize: size of replacement image data (0 if replaceData is NULL)
+ *
+ * Returns: 0 on success, -1 if there is no detect image or a write fails
+ */
+int write_request(FILE* to, const unsigned char* detectData,
+        size_t detectSize, const unsigned char* replaceData,
+        size_t replaceSize)
+{
+    if (!to || !detectData || detectSize == 0) {
+        return -1; // Cannot send a request without detect image
+    }
     // Determine operation type
     unsigned char opType = (replaceData && replaceSize > 0) ? OP_FACE_REPLACE
                                                             : OP_FACE_DETECT;
-
-    if (fputc(opType, to) == EOF) { // Write operation type
-        communication_error();
-    }
-
-    // Write detect image size
-    if (write_uint32_le(to, (uint32_t)detectSize) != 0) {
-        communication_error();
-    }
-
-    // Write detect image data
-    if (write_all(to, detectData, detectSize) != 0) {
-        communication_error();
+    if (write_uint32_le(to, PROTOCOL_PREFIX) != 0 // Write prefix
+            || fputc(opType, to) == EOF // Write operation type
+            || write_uint32_le(to, (uint32_t)detectSize) != 0
+            || write_all(to, detectData, detectSize) != 0) {
+        return -1;
     }
-
-    if (opType == OP_FACE_REPLACE) {
-        // Write replace image size (4 bytes LE)
-        if (write_uint32_le(to, (uint32_t)replaceSize) != 0) {
-            communication_error();
-        }
-
-        // Write replace image data
-        if (write_all(to, replaceData, replaceSize) != 0) {
-            communication_error();
-        }
+    if (opType == OP_FACE_REPLACE
+            && (write_uint32_le(to, (uint32_t)replaceSize) != 0
+                    || write_all(to, replaceData, replaceSize) != 0)) {
+        return -1;
     }
-
     // Flush to ensure all data sent
-    if (fflush(to) != 0) {
+    return fflush(to) == 0 ? 0 : -1;
+}
+
+/* send_stats_request()
+ * --------------------
+ * Sends a statistics request to the server: the protocol prefix followed by
+ * the OP_STATS operation type, with no payload.
+ *
+ * to: FILE stream to write request to
+ *
+ * Returns: 0 on success
+ * Errors: exits with code 13 on communication error
+ */
+int send_stats_request(FILE* to)
+{
+    if (!to || write_uint32_le(to, PROTOCOL_PREFIX) != 0
+            || fputc(OP_STATS, to) == EOF || fflush(to) != 0) {
         communication_error();
     }
     return 0; // success
@@ -223,32 +271,14 @@ int receive_request(FILE* from, FILE* outputFile)
     if (!from || !outputFile) {
         communication_error();
     }
-    uint32_t prefix = 0; // Read and verify prefix
-    if (read_uint32_le(from, &prefix) != 0 || prefix != PROTOCOL_PREFIX) {
-        // Invalid prefix -> communication error
-        communication_error();
-    }
-    int opTypeInt = fgetc(from); // Read operation type
-    if (opTypeInt == EOF) {
-        communication_error();
-    }
-    unsigned char opType = (unsigned char)opTypeInt;
-    uint32_t dataSize = 0;
-    if (read_uint32_le(from, &dataSize) != 0) { // Read message size
-        communication_error();
-    }
-    if (dataSize == 0) { // 0 length response is invalid communication error
-        communication_error();
-    }
-    unsigned char* buffer = malloc(dataSize); // Allocate buffer
-    if (!buffer) {
-        communication_error();
-    }
-    if (read_all(from, buffer, dataSize) != 0) { // Read the data
-        free(buffer);
+    unsigned char opType;
+    unsigned char* buffer;
+    uint32_t dataSize;
+    if (read_response(from, &opType, &buffer, &dataSize) != 0) {
         communication_error();
     }
-    if (opType == OP_OUTPUT_IMAGE) { // Write image data to output file
+    // Write image data or statistics text to output file
+    if (opType == OP_OUTPUT_IMAGE || opType == OP_STATS) {
         if (write_all(outputFile, buffer, dataSize) != 0) {
             free(buffer);
             communication_error();
@@ -270,6 +300,51 @@ int receive_request(FILE* from, FILE* outputFile)
     return -1;
 }
 
+/* read_response()
+ * ---------------
+ * Reads one complete response message from the server without exiting on
+ * failure. The payload is followed by a terminating null byte (not counted in
+ * its size) so that error messages can be used as strings.
+ *
+ * from: FILE stream to read response from
+ * opType: set to the operation type of the response
+ * data: set to the allocated payload, which the caller must free
+ * size: set to the payload size in bytes
+ *
+ * Returns: 0 on success, -1 if the prefix is wrong, the payload is empty,
+ *          memory cannot be allocated or the stream ends early
+ */
+int read_response(FILE* from, unsigned char* opType, unsigned char** data,
+        uint32_t* size)
+{
+    uint32_t prefix = 0; // Read and verify prefix
+    if (read_uint32_le(from, &prefix) != 0 || prefix != PROTOCOL_PREFIX) {
+        return -1;
+    }
+    int opTypeInt = fgetc(from); // Read operation type
+    if (opTypeInt == EOF) {
+        return -1;
+    }
+    uint32_t dataSize = 0;
+    // A 0 length response is invalid
+    if (read_uint32_le(from, &dataSize) != 0 || dataSize == 0) {
+        return -1;
+    }
+    unsigned char* buffer = malloc((size_t)dataSize + 1);
+    if (!buffer) {
+        return -1;
+    }
+    if (read_all(from, buffer, dataSize) != 0) { // Read the data
+        free(buffer);
+        return -1;
+    }
+    buffer[dataSize] = '\0';
+    *opType = (unsigned char)opTypeInt;
+    *data = buffer;
+    *size = dataSize;
+    return 0;
+}
+
 /* validate_prefix()
  * -----------------
  * Reads and validates the protocol prefix from a stream to ensure the
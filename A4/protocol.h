@@ -12,14 +12,37 @@
 #include <unistd.h>
 
 #define PROTOCOL_PREFIX 0x23107231
+#define PROTOCOL_PREFIX_V2 0x23107232
+
+// Set in a request's operation type when encoding options (an OutputFormat
+// byte then a level byte) follow it
+#define OP_FLAG_ENCODING 0x80
+// Set in a request's operation type when a deadline follows it (after any
+// encoding options): the number of milliseconds, from when the server began
+// receiving the request, after which the client no longer wants the result.
+// A deadline of 0 means the request has none
+#define OP_FLAG_DEADLINE 0x40
+#define ENCODING_DEFAULT_LEVEL 255
 
 typedef enum {
     OP_FACE_DETECT = 0,
     OP_FACE_REPLACE = 1,
     OP_OUTPUT_IMAGE = 2,
-    OP_ERROR_MSG = 3
+    OP_ERROR_MSG = 3,
+    OP_STATS = 4,
+    OP_BATCH = 5,
+    OP_UPLOAD_FACE = 6,
+    OP_FACE_HANDLE = 7,
+    OP_REPLACE_BY_HANDLE = 8
 } OperationType;
 
+typedef enum {
+    FORMAT_JPEG = 0,
+    FORMAT_PNG = 1,
+    FORMAT_WEBP = 2,
+    FORMAT_COUNT
+} OutputFormat;
+
 typedef struct {
     unsigned char opType;
     unsigned char* detectImage;
@@ -29,10 +52,18 @@ typedef struct {
 } ServerRequest;
 
 // Function Prototypes
+void encode_uint32_le(uint32_t value, unsigned char* bytes);
+uint32_t decode_uint32_le(const unsigned char* bytes);
 int read_uint32_le(FILE* stream, uint32_t* outValue);
 int send_request(FILE* to, const unsigned char* detectData, size_t detectSize,
         const unsigned char* replaceData, size_t replaceSize);
+int write_request(FILE* to, const unsigned char* detectData,
+        size_t detectSize, const unsigned char* replaceData,
+        size_t replaceSize);
+int send_stats_request(FILE* to);
 int receive_request(FILE* from, FILE* outputFile);
+int read_response(FILE* from, unsigned char* opType, unsigned char** data,
+        uint32_t* size);
 void communication_error(void);
 int validate_prefix(FILE* from);
 int send_protocol_error(int fd, const char* errmsg);
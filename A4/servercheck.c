@@ -0,0 +1,759 @@
+/* CSSE2310 2025 Assignment Four
+ * servercheck.c
+ *
+ * Written by William White
+ *
+ * Starts uqfacedetect on an ephemeral port and checks its responses to
+ * requests that the client programs never send: statistics, bad batch sizes,
+ * face handles, deadlines, admission control, reloading and draining. None of
+ * the checks need a decodable image, so they run without a test corpus.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include "protocol.h"
+/* -------------------------------------------------------------------------- */
+// Constants
+
+// Bytes sent as an image that the server will fail to decode
+const char* const junkImage = "this is not an image";
+
+// Error messages the server is expected to send
+const char* const invalidImageError = "invalid image";
+const char* const batchSizeError = "invalid batch size";
+const char* const faceHandleError = "unknown face handle";
+const char* const busyError = "server busy";
+const char* const deadlineError = "deadline exceeded";
+
+const char* const usageErrorMessage = "Usage: ./servercheck serverpath\n";
+
+/* -------------------------------------------------------------------------- */
+// Enum Definitions
+
+// Program exit codes
+typedef enum {
+    EXIT_SUCCESS_STATUS = 0,
+    EXIT_FAILED_STATUS = 1,
+    EXIT_USAGE_STATUS = 2,
+} ExitStatus;
+
+// Magic Numbers
+typedef enum {
+    PORT_LINE_LENGTH = 32,
+    RESPONSE_TIMEOUT_SECONDS = 5,
+    POLL_INTERVAL_MS = 10,
+    POLL_LIMIT = 500, // Polls before giving up (5 seconds)
+    NS_PER_MS = 1000000,
+    MAX_BATCH_ITEMS = 4096,
+    MAX_SESSION_FACES = 16,
+    UINT32_NUM_BYTES = 4,
+    DEADLINE_MS = 1,
+    DEADLINE_WAIT_MS = 50,
+} MagicNumbers;
+
+/* -------------------------------------------------------------------------- */
+// Struct Definitions
+
+// A uqfacedetect process started for a group of checks. errors is the read
+// end of the pipe carrying the server's standard error; it stays open so the
+// server never writes to a closed pipe.
+typedef struct {
+    pid_t pid;
+    FILE* errors;
+    char port[PORT_LINE_LENGTH];
+} Server;
+
+// A connection to the server. Requests are written to fd and responses are
+// read through from, which wraps the same socket.
+typedef struct {
+    int fd;
+    FILE* from;
+} Client;
+
+// One response read from the server. data is null terminated.
+typedef struct {
+    unsigned char opType;
+    unsigned char* data;
+    uint32_t size;
+} Response;
+
+/* -------------------------------------------------------------------------- */
+// Function Prototypes
+bool start_server(Server* server, const char* path, const char* maxQueued);
+bool stop_server(Server* server, int signum);
+bool wait_for_exit(Server* server, int* status);
+bool open_client(Client* client, const char* port);
+void close_client(Client* client);
+void send_bytes(Client* client, const void* data, size_t size);
+void send_uint32(Client* client, uint32_t value);
+void send_op(Client* client, unsigned char opType);
+void send_junk_image(Client* client);
+bool read_reply(Client* client, Response* response);
+bool expect_error(Client* client, const char* message);
+bool expect_closed(Client* client);
+bool expect_stat(const char* port, const char* line);
+bool upload_face(Client* client, uint32_t* handle);
+void sleep_ms(long ms);
+bool report(const char* name, bool passed);
+bool check_stats(const char* port);
+bool check_batch_size(const char* port, uint32_t batchSize);
+bool check_face_handles(const char* port);
+bool check_deadlines(const char* port);
+bool check_busy(const char* path);
+bool check_reload(Server* server);
+bool check_drain(Server* server);
+
+/* -------------------------------------------------------------------------- */
+// Main Functions
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fputs(usageErrorMessage, stderr);
+        exit(EXIT_USAGE_STATUS);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    Server server;
+    if (!start_server(&server, argv[1], NULL)) {
+        fprintf(stderr, "servercheck: unable to start \"%s\"\n", argv[1]);
+        exit(EXIT_FAILED_STATUS);
+    }
+    bool passed = true;
+    passed &= report("stats", check_stats(server.port));
+    passed &= report("batch size 0", check_batch_size(server.port, 0));
+    passed &= report("batch size too large",
+            check_batch_size(server.port, MAX_BATCH_ITEMS + 1));
+    passed &= report("face handles", check_face_handles(server.port));
+    passed &= report("deadlines", check_deadlines(server.port));
+    passed &= report("reload", check_reload(&server));
+    passed &= report("drain", check_drain(&server));
+    passed &= report("busy", check_busy(argv[1]));
+    exit(passed ? EXIT_SUCCESS_STATUS : EXIT_FAILED_STATUS);
+}
+
+/* start_server()
+ * --------------
+ * Runs uqfacedetect on an ephemeral port and reads the port number it prints
+ * to standard error.
+ *
+ * server: set to describe the running server
+ * path: path of the uqfacedetect executable
+ * maxQueued: value for --maxqueued, or NULL to use the default
+ *
+ * Returns: true if the server started and printed its port, false otherwise
+ */
+bool start_server(Server* server, const char* path, const char* maxQueued)
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return false;
+    }
+    server->pid = fork();
+    if (server->pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (server->pid == 0) {
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (maxQueued) {
+            execl(path, path, "10", "0", "--maxqueued", maxQueued, NULL);
+        } else {
+            execl(path, path, "10", "0", NULL);
+        }
+        _exit(EXIT_FAILED_STATUS);
+    }
+    close(fds[1]);
+    server->errors = fdopen(fds[0], "r");
+    if (!server->errors
+            || !fgets(server->port, PORT_LINE_LENGTH, server->errors)) {
+        stop_server(server, SIGKILL);
+        return false;
+    }
+    server->port[strcspn(server->port, "\n")] = '\0';
+    return true;
+}
+
+/* stop_server()
+ * -------------
+ * Sends a signal to a server and waits for it to exit.
+ *
+ * server: server to stop
+ * signum: signal to send
+ *
+ * Returns: true if the server exited normally with status 0
+ */
+bool stop_server(Server* server, int signum)
+{
+    int status = 0;
+    kill(server->pid, signum);
+    bool exited = wait_for_exit(server, &status);
+    if (!exited) {
+        kill(server->pid, SIGKILL);
+        waitpid(server->pid, &status, 0);
+    }
+    if (server->errors) {
+        fclose(server->errors);
+        server->errors = NULL;
+    }
+    return exited && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* wait_for_exit()
+ * ---------------
+ * Waits a bounded time for a server process to exit.
+ *
+ * server: server to wait for
+ * status: set to the wait status if the server exits
+ *
+ * Returns: true if the server exited, false if it is still running
+ */
+bool wait_for_exit(Server* server, int* status)
+{
+    for (int i = 0; i < POLL_LIMIT; i++) {
+        if (waitpid(server->pid, status, WNOHANG) == server->pid) {
+            return true;
+        }
+        sleep_ms(POLL_INTERVAL_MS);
+    }
+    return false;
+}
+
+/* open_client()
+ * -------------
+ * Connects to the server on localhost. Reads time out so that a server that
+ * never replies fails a check rather than hanging it.
+ *
+ * client: set to describe the connection
+ * port: port the server is listening on
+ *
+ * Returns: true if connected, false otherwise
+ */
+bool open_client(Client* client, const char* port)
+{
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("localhost", port, &hints, &ai)) {
+        return false;
+    }
+    client->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (client->fd < 0) {
+        freeaddrinfo(ai);
+        return false;
+    }
+    if (connect(client->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        close(client->fd);
+        freeaddrinfo(ai);
+        return false;
+    }
+    freeaddrinfo(ai);
+    struct timeval timeout = {RESPONSE_TIMEOUT_SECONDS, 0};
+    setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    client->from = fdopen(client->fd, "r");
+    if (!client->from) {
+        close(client->fd);
+        return false;
+    }
+    return true;
+}
+
+/* close_client()
+ * --------------
+ * Closes a connection to the server.
+ *
+ * client: connection to close
+ *
+ * Returns: void
+ */
+void close_client(Client* client)
+{
+    fclose(client->from); // Also closes fd
+}
+
+/* send_bytes()
+ * ------------
+ * Writes bytes to the server. Failures are not reported here: they show up
+ * as a missing or unexpected reply.
+ *
+ * client: connection to write to
+ * data: bytes to write
+ * size: number of bytes to write
+ *
+ * Returns: void
+ */
+void send_bytes(Client* client, const void* data, size_t size)
+{
+    const unsigned char* bytes = data;
+    while (size > 0) {
+        ssize_t written = write(client->fd, bytes, size);
+        if (written <= 0) {
+            return;
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+/* send_uint32()
+ * -------------
+ * Writes a little-endian 32-bit integer to the server.
+ *
+ * client: connection to write to
+ * value: integer to write
+ *
+ * Returns: void
+ */
+void send_uint32(Client* client, uint32_t value)
+{
+    unsigned char bytes[UINT32_NUM_BYTES];
+    encode_uint32_le(value, bytes);
+    send_bytes(client, bytes, UINT32_NUM_BYTES);
+}
+
+/* send_op()
+ * ---------
+ * Writes the start of an untagged request: the protocol prefix and the
+ * operation type byte, including any flags.
+ *
+ * client: connection to write to
+ * opType: operation type and flags
+ *
+ * Returns: void
+ */
+void send_op(Client* client, unsigned char opType)
+{
+    send_uint32(client, PROTOCOL_PREFIX);
+    send_bytes(client, &opType, 1);
+}
+
+/* send_junk_image()
+ * -----------------
+ * Writes an image size and image bytes that do not decode as an image.
+ *
+ * client: connection to write to
+ *
+ * Returns: void
+ */
+void send_junk_image(Client* client)
+{
+    send_uint32(client, strlen(junkImage));
+    send_bytes(client, junkImage, strlen(junkImage));
+}
+
+/* read_reply()
+ * ------------
+ * Reads one response from the server.
+ *
+ * client: connection to read from
+ * response: set to the response; the caller must free its data
+ *
+ * Returns: true if a complete response was read, false otherwise
+ */
+bool read_reply(Client* client, Response* response)
+{
+    return read_response(client->from, &response->opType, &response->data,
+                   &response->size)
+            == 0;
+}
+
+/* expect_error()
+ * --------------
+ * Reads one response and checks that it is a particular error message.
+ *
+ * client: connection to read from
+ * message: error message expected
+ *
+ * Returns: true if the response is the expected error, false otherwise
+ */
+bool expect_error(Client* client, const char* message)
+{
+    Response response;
+    if (!read_reply(client, &response)) {
+        fprintf(stderr, "servercheck: expected \"%s\", got no reply\n",
+                message);
+        return false;
+    }
+    bool matched = response.opType == OP_ERROR_MSG
+            && strcmp((char*)response.data, message) == 0;
+    if (!matched) {
+        fprintf(stderr, "servercheck: expected \"%s\", got op %d \"%.40s\"\n",
+                message, response.opType, (char*)response.data);
+    }
+    free(response.data);
+    return matched;
+}
+
+/* expect_closed()
+ * ---------------
+ * Checks that the server has closed a connection without sending anything
+ * more.
+ *
+ * client: connection to read from
+ *
+ * Returns: true if the connection ended, false otherwise
+ */
+bool expect_closed(Client* client)
+{
+    return fgetc(client->from) == EOF && !ferror(client->from);
+}
+
+/* expect_stat()
+ * -------------
+ * Polls the server's statistics until they contain a given line. Used to
+ * wait for the server to act on a request whose reply is still pending.
+ *
+ * port: port the server is listening on
+ * line: complete statistics line to wait for, without its newline
+ *
+ * Returns: true if the line appeared in time, false otherwise
+ */
+bool expect_stat(const char* port, const char* line)
+{
+    Client client;
+    if (!open_client(&client, port)) {
+        return false;
+    }
+    size_t length = strlen(line);
+    bool found = false;
+    for (int i = 0; i < POLL_LIMIT && !found; i++) {
+        Response response;
+        send_op(&client, OP_STATS);
+        if (!read_reply(&client, &response)) {
+            break;
+        }
+        for (char* text = (char*)response.data; text && !found;
+                text = strchr(text, '\n')) {
+            text += *text == '\n';
+            found = strncmp(text, line, length) == 0
+                    && (text[length] == '\n' || text[length] == '\0');
+        }
+        free(response.data);
+        if (!found) {
+            sleep_ms(POLL_INTERVAL_MS);
+        }
+    }
+    close_client(&client);
+    return found;
+}
+
+/* upload_face()
+ * -------------
+ * Uploads a face and reads back its handle.
+ *
+ * client: connection to upload on
+ * handle: set to the handle the server gives the face
+ *
+ * Returns: true if a handle was received, false otherwise
+ */
+bool upload_face(Client* client, uint32_t* handle)
+{
+    Response response;
+    send_op(client, OP_UPLOAD_FACE);
+    send_junk_image(client);
+    if (!read_reply(client, &response)) {
+        return false;
+    }
+    bool received = response.opType == OP_FACE_HANDLE
+            && response.size == UINT32_NUM_BYTES;
+    if (received) {
+        *handle = decode_uint32_le(response.data);
+    }
+    free(response.data);
+    return received;
+}
+
+/* sleep_ms()
+ * ----------
+ * Sleeps for a number of milliseconds.
+ *
+ * ms: milliseconds to sleep
+ *
+ * Returns: void
+ */
+void sleep_ms(long ms)
+{
+    struct timespec delay = {ms / 1000, (ms % 1000) * NS_PER_MS};
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+    }
+}
+
+/* report()
+ * --------
+ * Prints the outcome of a check.
+ *
+ * name: name of the check
+ * passed: whether the check passed
+ *
+ * Returns: passed
+ */
+bool report(const char* name, bool passed)
+{
+    printf("%s %s\n", passed ? "ok" : "FAIL", name);
+    fflush(stdout);
+    return passed;
+}
+
+/* -------------------------------------------------------------------------- */
+// Checks
+
+/* check_stats()
+ * -------------
+ * OP_STATS is answered with a text report that counts this connection and
+ * the OP_STATS request itself, and the connection stays open for another.
+ *
+ * port: port the server is listening on
+ *
+ * Returns: true if the check passed
+ */
+bool check_stats(const char* port)
+{
+    Client client;
+    if (!open_client(&client, port)) {
+        return false;
+    }
+    bool passed = true;
+    for (int i = 0; i < 2 && passed; i++) {
+        Response response;
+        send_op(&client, OP_STATS);
+        passed = read_reply(&client, &response);
+        if (passed) {
+            char* text = (char*)response.data;
+            passed = response.opType == OP_STATS
+                    && strlen(text) == response.size
+                    && strstr(text, "connections_active ")
+                    && strstr(text, "requests op_4 ")
+                    && strstr(text, "cache output entries ");
+            free(response.data);
+        }
+    }
+    close_client(&client);
+    return passed;
+}
+
+/* check_batch_size()
+ * ------------------
+ * An OP_BATCH size of 0 or more than MAX_BATCH_ITEMS is refused. The batch's
+ * body cannot be skipped, so the server then closes the connection.
+ *
+ * port: port the server is listening on
+ * batchSize: invalid batch size to send
+ *
+ * Returns: true if the check passed
+ */
+bool check_batch_size(const char* port, uint32_t batchSize)
+{
+    Client client;
+    if (!open_client(&client, port)) {
+        return false;
+    }
+    send_op(&client, OP_BATCH);
+    send_uint32(&client, batchSize);
+    bool passed = expect_error(&client, batchSizeError)
+            && expect_closed(&client);
+    close_client(&client);
+    return passed;
+}
+
+/* check_face_handles()
+ * --------------------
+ * Face handles are numbered from 1, are private to the connection that
+ * uploaded them and stop being valid once MAX_SESSION_FACES newer faces have
+ * been uploaded. A valid handle is accepted, so the junk image sent with it
+ * is what gets rejected.
+ *
+ * port: port the server is listening on
+ *
+ * Returns: true if the check passed
+ */
+bool check_face_handles(const char* port)
+{
+    Client owner;
+    Client other;
+    if (!open_client(&owner, port)) {
+        return false;
+    }
+    if (!open_client(&other, port)) {
+        close_client(&owner);
+        return false;
+    }
+    uint32_t first = 0;
+    bool passed = upload_face(&owner, &first) && first == 1;
+
+    send_op(&other, OP_REPLACE_BY_HANDLE);
+    send_junk_image(&other);
+    send_uint32(&other, first);
+    passed = passed && expect_error(&other, faceHandleError);
+
+    send_op(&owner, OP_REPLACE_BY_HANDLE);
+    send_junk_image(&owner);
+    send_uint32(&owner, first);
+    passed = passed && expect_error(&owner, invalidImageError);
+
+    uint32_t last = first;
+    for (int i = 0; i < MAX_SESSION_FACES && passed; i++) {
+        passed = upload_face(&owner, &last);
+    }
+    passed = passed && last == first + MAX_SESSION_FACES;
+
+    send_op(&owner, OP_REPLACE_BY_HANDLE);
+    send_junk_image(&owner);
+    send_uint32(&owner, first);
+    passed = passed && expect_error(&owner, faceHandleError);
+
+    send_op(&owner, OP_REPLACE_BY_HANDLE);
+    send_junk_image(&owner);
+    send_uint32(&owner, last);
+    passed = passed && expect_error(&owner, invalidImageError);
+
+    close_client(&other);
+    close_client(&owner);
+    return passed;
+}
+
+/* check_deadlines()
+ * -----------------
+ * A deadline of 0 means the request has none, so it is processed however
+ * long it takes to arrive. A request whose deadline passes before it has
+ * been received is refused without being processed.
+ *
+ * port: port the server is listening on
+ *
+ * Returns: true if the check passed
+ */
+bool check_deadlines(const char* port)
+{
+    Client client;
+    if (!open_client(&client, port)) {
+        return false;
+    }
+    send_op(&client, OP_FACE_DETECT | OP_FLAG_DEADLINE);
+    send_uint32(&client, 0);
+    sleep_ms(DEADLINE_WAIT_MS);
+    send_junk_image(&client);
+    bool passed = expect_error(&client, invalidImageError);
+
+    send_op(&client, OP_FACE_DETECT | OP_FLAG_DEADLINE);
+    send_uint32(&client, DEADLINE_MS);
+    sleep_ms(DEADLINE_WAIT_MS);
+    send_junk_image(&client);
+    passed = passed && expect_error(&client, deadlineError);
+    close_client(&client);
+    return passed;
+}
+
+/* check_busy()
+ * ------------
+ * With --maxqueued 1, a request is refused as busy while another is still
+ * being received, and the held request completes once it arrives in full.
+ * Runs its own server since it needs a non-default limit.
+ *
+ * path: path of the uqfacedetect executable
+ *
+ * Returns: true if the check passed
+ */
+bool check_busy(const char* path)
+{
+    Server server;
+    if (!start_server(&server, path, "1")) {
+        return false;
+    }
+    Client holder;
+    Client refused;
+    bool passed = false;
+    if (open_client(&holder, server.port)) {
+        size_t size = strlen(junkImage);
+        send_op(&holder, OP_FACE_DETECT);
+        send_uint32(&holder, size);
+        send_bytes(&holder, junkImage, size / 2);
+        if (expect_stat(server.port, "requests_queued 1")
+                && open_client(&refused, server.port)) {
+            send_op(&refused, OP_FACE_DETECT);
+            send_junk_image(&refused);
+            passed = expect_error(&refused, busyError);
+            close_client(&refused);
+        }
+        send_bytes(&holder, junkImage + size / 2, size - size / 2);
+        passed = passed && expect_error(&holder, invalidImageError);
+        close_client(&holder);
+    }
+    return stop_server(&server, SIGTERM) && passed;
+}
+
+/* check_reload()
+ * --------------
+ * SIGHUP reloads the server's response file and cascades without dropping
+ * connections: one opened before the signal keeps working after it.
+ *
+ * server: running server
+ *
+ * Returns: true if the check passed
+ */
+bool check_reload(Server* server)
+{
+    Client client;
+    if (!open_client(&client, server->port)) {
+        return false;
+    }
+    kill(server->pid, SIGHUP);
+    send_op(&client, OP_FACE_DETECT);
+    send_junk_image(&client);
+    bool passed = expect_error(&client, invalidImageError);
+    close_client(&client);
+    return passed && expect_stat(server->port, "connections_active 1");
+}
+
+/* check_drain()
+ * -------------
+ * SIGTERM stops the server accepting connections, lets a request that is
+ * part-way through arriving complete, then closes the connection and exits
+ * with status 0.
+ *
+ * server: running server, which is stopped by this check
+ *
+ * Returns: true if the check passed
+ */
+bool check_drain(Server* server)
+{
+    Client client;
+    if (!open_client(&client, server->port)) {
+        stop_server(server, SIGKILL);
+        return false;
+    }
+    size_t size = strlen(junkImage);
+    send_op(&client, OP_FACE_DETECT);
+    send_uint32(&client, size);
+    send_bytes(&client, junkImage, size / 2);
+    bool passed = expect_stat(server->port, "requests_queued 1");
+    kill(server->pid, SIGTERM);
+
+    bool refused = false;
+    for (int i = 0; i < POLL_LIMIT && !refused; i++) {
+        Client late;
+        refused = !open_client(&late, server->port);
+        if (!refused) {
+            close_client(&late);
+            sleep_ms(POLL_INTERVAL_MS);
+        }
+    }
+    send_bytes(&client, junkImage + size / 2, size - size / 2);
+    passed = passed && refused && expect_error(&client, invalidImageError)
+            && expect_closed(&client);
+    close_client(&client);
+    return stop_server(server, SIGTERM) && passed;
+}
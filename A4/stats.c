@@ -0,0 +1,257 @@
+/* CSSE2310 2025 Assignment Four
+ * stats.c
+ *
+ * Written by William White
+ */
+
+#include "stats.h"
+#include "util.h"
+#include <time.h>
+#include <pthread.h>
+
+#define NS_PER_SECOND 1e9
+
+typedef enum {
+    NS_PER_US = 1000,
+    HISTOGRAM_BUCKETS = 32,
+    OP_TYPE_SLOTS = 16,
+    PERCENT = 100,
+    P50 = 50,
+    P90 = 90,
+    P99 = 99,
+    BITS_PER_WORD = 64
+} StatsConstants;
+
+// Latency histogram with power of two microsecond buckets. Bucket i counts
+// latencies of less than 2^i microseconds that did not fit in bucket i - 1.
+typedef struct {
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} LatencyHistogram;
+
+// Process wide statistics. Every field is only accessed atomically so that
+// recording never takes a lock.
+typedef struct {
+    uint64_t startNs;
+    LatencyHistogram stages[STAGE_COUNT];
+    uint64_t requests[OP_TYPE_SLOTS];
+    uint64_t errors[ERROR_KIND_COUNT];
+} ServerStats;
+
+static ServerStats serverStats;
+
+static const char* const stageNames[STAGE_COUNT] = {"receive", "decode",
+        "greyscale", "face_detect", "eye_detect", "encode", "send"};
+static const char* const errorNames[ERROR_KIND_COUNT]
+        = {"invalid_operation_type", "invalid_message", "image_zero_bytes",
+                "image_too_large", "invalid_image", "no_faces",
+                "invalid_batch_size", "unknown_face_handle",
+                "invalid_encoding", "server_busy", "deadline_exceeded"};
+
+/* init_stats()
+ * ------------
+ * Records the server start time used to report uptime.
+ *
+ * Returns: void
+ */
+void init_stats(void)
+{
+    serverStats.startNs = monotonic_ns();
+}
+
+/* bucket_for()
+ * ------------
+ * Finds the histogram bucket for a latency.
+ *
+ * ns: latency in nanoseconds
+ *
+ * Returns: bucket index
+ */
+static int bucket_for(uint64_t ns)
+{
+    uint64_t us = ns / NS_PER_US;
+    if (us == 0) {
+        return 0;
+    }
+    int bucket = BITS_PER_WORD - __builtin_clzll(us);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/* record_stage_time()
+ * -------------------
+ * Adds the time elapsed since startNs to a stage's latency histogram.
+ *
+ * stage: stage being timed
+ * startNs: monotonic_ns() value taken when the stage started
+ *
+ * Returns: void
+ */
+void record_stage_time(Stage stage, uint64_t startNs)
+{
+    uint64_t ns = monotonic_ns() - startNs;
+    LatencyHistogram* histogram = &serverStats.stages[stage];
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->totalNs, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(
+            &histogram->buckets[bucket_for(ns)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED);
+    while (ns > max
+            && !__atomic_compare_exchange_n(&histogram->maxNs, &max, ns, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // max now holds the current value; retry while ours is larger
+    }
+}
+
+/* record_request()
+ * ----------------
+ * Counts a request with a valid operation type.
+ *
+ * opType: operation type of the request
+ *
+ * Returns: void
+ */
+void record_request(unsigned char opType)
+{
+    if (opType < OP_TYPE_SLOTS) {
+        __atomic_add_fetch(&serverStats.requests[opType], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* record_error()
+ * --------------
+ * Counts an error message sent to a client.
+ *
+ * kind: kind of error that was reported
+ *
+ * Returns: void
+ */
+void record_error(ErrorKind kind)
+{
+    __atomic_add_fetch(&serverStats.errors[kind], 1, __ATOMIC_RELAXED);
+}
+
+/* histogram_percentile()
+ * ----------------------
+ * Estimates a percentile from a snapshot of a histogram's buckets.
+ *
+ * buckets: bucket counts
+ * count: total number of samples in the buckets
+ * percent: percentile to find (0-100)
+ *
+ * Returns: upper bound in microseconds of the bucket holding the percentile,
+ *          or 0 if the histogram is empty
+ */
+static uint64_t histogram_percentile(
+        const uint64_t* buckets, uint64_t count, int percent)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t target = (count * percent + PERCENT - 1) / PERCENT;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return (uint64_t)1 << i;
+        }
+    }
+    return (uint64_t)1 << (HISTOGRAM_BUCKETS - 1);
+}
+
+/* write_stage_stats()
+ * -------------------
+ * Writes the summary and non-empty histogram buckets for one stage. Each
+ * bucket is written as upper_bound_us:count.
+ *
+ * stream: stream to write to
+ * stage: stage to report
+ *
+ * Returns: void
+ */
+static void write_stage_stats(FILE* stream, Stage stage)
+{
+    LatencyHistogram* histogram = &serverStats.stages[stage];
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        count += buckets[i];
+    }
+    uint64_t totalNs = __atomic_load_n(&histogram->totalNs, __ATOMIC_RELAXED);
+    uint64_t maxNs = __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED);
+    fprintf(stream,
+            "stage %s count %lu mean_us %lu p50_us %lu p90_us %lu p99_us %lu"
+            " max_us %lu\n",
+            stageNames[stage], (unsigned long)count,
+            (unsigned long)(count ? totalNs / count / NS_PER_US : 0),
+            (unsigned long)histogram_percentile(buckets, count, P50),
+            (unsigned long)histogram_percentile(buckets, count, P90),
+            (unsigned long)histogram_percentile(buckets, count, P99),
+            (unsigned long)(maxNs / NS_PER_US));
+    fprintf(stream, "histogram %s", stageNames[stage]);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (buckets[i]) {
+            fprintf(stream, " %lu:%lu", 1UL << i, (unsigned long)buckets[i]);
+        }
+    }
+    fprintf(stream, "\n");
+}
+
+/* write_worker_cpu_times()
+ * ------------------------
+ * Writes the CPU time consumed so far by each compute worker thread.
+ *
+ * stream: stream to write to
+ * computePool: pool whose workers should be reported
+ *
+ * Returns: void
+ */
+static void write_worker_cpu_times(FILE* stream, WorkPool* computePool)
+{
+    for (int i = 0; i < computePool->threadCount; i++) {
+        clockid_t clock;
+        struct timespec cpu;
+        if (pthread_getcpuclockid(computePool->threads[i], &clock) != 0
+                || clock_gettime(clock, &cpu) != 0) {
+            continue;
+        }
+        fprintf(stream, "worker %d cpu_seconds %.3f\n", i,
+                cpu.tv_sec + cpu.tv_nsec / NS_PER_SECOND);
+    }
+}
+
+/* write_stats()
+ * -------------
+ * Writes a text snapshot of the server statistics, one "name value" record
+ * per line: uptime, compute queue depth, request and error counts, per-stage
+ * latency histograms and per-worker CPU time.
+ *
+ * stream: stream to write the snapshot to
+ * computePool: compute pool to report queue depth and worker CPU time for
+ *
+ * Returns: void
+ */
+void write_stats(FILE* stream, WorkPool* computePool)
+{
+    fprintf(stream, "uptime_seconds %.3f\n",
+            (monotonic_ns() - serverStats.startNs) / NS_PER_SECOND);
+    fprintf(stream, "queue_depth %d\n", work_pool_queue_depth(computePool));
+    for (int i = 0; i < OP_TYPE_SLOTS; i++) {
+        uint64_t count
+                = __atomic_load_n(&serverStats.requests[i], __ATOMIC_RELAXED);
+        if (count) {
+            fprintf(stream, "requests op_%d %lu\n", i, (unsigned long)count);
+        }
+    }
+    for (int i = 0; i < ERROR_KIND_COUNT; i++) {
+        fprintf(stream, "errors %s %lu\n", errorNames[i],
+                (unsigned long)__atomic_load_n(
+                        &serverStats.errors[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        write_stage_stats(stream, (Stage)i);
+    }
+    write_worker_cpu_times(stream, computePool);
+}
@@ -0,0 +1,47 @@
+/* CSSE2310 2025 Assignment Four
+ * stats.h
+ *
+ * Written by William White
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "workpool.h"
+
+// Stages of request handling with their own latency histogram
+typedef enum {
+    STAGE_RECEIVE,
+    STAGE_DECODE,
+    STAGE_GREYSCALE,
+    STAGE_FACE_DETECT,
+    STAGE_EYE_DETECT,
+    STAGE_ENCODE,
+    STAGE_SEND,
+    STAGE_COUNT
+} Stage;
+
+// Kinds of error message the server sends to clients
+typedef enum {
+    ERROR_INVALID_OP_TYPE,
+    ERROR_INVALID_MESSAGE,
+    ERROR_IMAGE_ZERO_BYTES,
+    ERROR_IMAGE_TOO_LARGE,
+    ERROR_INVALID_IMAGE,
+    ERROR_NO_FACES,
+    ERROR_INVALID_BATCH_SIZE,
+    ERROR_UNKNOWN_FACE_HANDLE,
+    ERROR_INVALID_ENCODING,
+    ERROR_SERVER_BUSY,
+    ERROR_DEADLINE_EXCEEDED,
+    ERROR_KIND_COUNT
+} ErrorKind;
+
+// Function Prototypes
+void init_stats(void);
+void record_stage_time(Stage stage, uint64_t startNs);
+void record_request(unsigned char opType);
+void record_error(ErrorKind kind);
+void write_stats(FILE* stream, WorkPool* computePool);
+#endif
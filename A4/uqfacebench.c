@@ -0,0 +1,1126 @@
+/* CSSE2310 2025 Assignment Four
+ * uqfacebench.c
+ *
+ * Written by William White
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "protocol.h"
+#include "util.h"
+/* -------------------------------------------------------------------------- */
+// Constants
+
+// Exit Messages
+const char* const usageErrorMessage
+        = "Usage: ./uqfacebench port [--connections count] [--duration "
+          "seconds] [--requests count] [--rate persecond] [--slowclients "
+          "count] [--replaceimage filename] [--json filename] image ...\n";
+const char* const fileReadErrorMessage
+        = "uqfacebench: unable to open the input file \"%s\" for reading\n";
+const char* const fileWriteErrorMessage
+        = "uqfacebench: unable to open the output file \"%s\" for writing\n";
+const char* const portErrorMessage
+        = "uqfacebench: cannot connect to the server on port \"%s\"\n";
+
+// Command Line Arguments
+const char* const replaceImage = "--replaceimage";
+const char* const jsonOutput = "--json";
+
+// Numeric options, in the order of NumericOption, and their maximum values
+static const char* const optionNames[] = {"--connections", "--duration",
+        "--requests", "--rate", "--slowclients"};
+static const char* const optionMaxValues[]
+        = {"1024", "86400", "1000000000", "1000000", "1024"};
+
+/* -------------------------------------------------------------------------- */
+// Enum Definitions
+
+// Program exit codes (shared with uqfaceclient where they overlap)
+typedef enum {
+    EXIT_USAGE_STATUS = 10,
+    EXIT_FILEREAD_STATUS = 7,
+    EXIT_FILEWRITE_STATUS = 19,
+    EXIT_SERVERPORT_STATUS = 3,
+    EXIT_COMMERR_STATUS = 13,
+} ExitStatus;
+
+// Numeric command line options
+typedef enum {
+    OPT_CONNECTIONS,
+    OPT_DURATION,
+    OPT_REQUESTS,
+    OPT_RATE,
+    OPT_SLOW_CLIENTS,
+    OPTION_COUNT
+} NumericOption;
+
+typedef enum {
+    DECIMAL_BASE = 10,
+    DEFAULT_DURATION = 10,
+    MAX_ERROR_MESSAGES = 16,
+    INITIAL_LATENCY_CAPACITY = 1024,
+    RECONNECT_DELAY_MS = 100,
+    TRICKLE_BYTES = 16,
+    TRICKLE_INTERVAL_MS = 10,
+    NS_PER_US = 1000,
+    NS_PER_MS = 1000000,
+    NS_PER_SECOND = 1000000000,
+    PERMILLE = 1000,
+    P50 = 500,
+    P90 = 900,
+    P99 = 990,
+    P999 = 999
+} MagicNumbers;
+
+/* -------------------------------------------------------------------------- */
+// Struct Definitions
+
+// Struct to hold parameters parsed from the command line. duration and
+// requests are 0 when not limited, and rate is 0 to send as fast as possible
+typedef struct {
+    const char* port;
+    unsigned long connections;
+    unsigned long duration;
+    unsigned long requests;
+    unsigned long rate;
+    unsigned long slowclients;
+    const char* replaceFilename;
+    const char* jsonFilename;
+    char** imageFilenames;
+    int imageCount;
+} CmdLineParams;
+
+// Contents of an image file
+typedef struct {
+    unsigned char* data;
+    size_t size;
+} ImageData;
+
+// Connection to the server, with separate buffered streams for each
+// direction
+typedef struct {
+    int fd;
+    FILE* to;
+    FILE* from;
+} ServerConnection;
+
+// Workload shared by every client thread. Only remaining and stopping change
+// once the clients have started, and they are only accessed atomically
+typedef struct {
+    const CmdLineParams* params;
+    ImageData* corpus;
+    int corpusSize;
+    ImageData replace;
+    uint64_t startNs;
+    uint64_t stopNs;
+    uint64_t remaining;
+    bool stopping;
+} Workload;
+
+// An error message received from the server and how many times it was sent
+typedef struct {
+    char* message;
+    uint64_t count;
+} ErrorCount;
+
+// Results gathered by one client. Those of slow clients (completed and
+// communicationErrors only) are read while they run, so are only accessed
+// atomically
+typedef struct {
+    Workload* workload;
+    int index;
+    uint64_t* latencies;
+    size_t latencyCount;
+    size_t latencyCapacity;
+    uint64_t completed;
+    uint64_t communicationErrors;
+    uint64_t errorResponses;
+    ErrorCount errors[MAX_ERROR_MESSAGES];
+    int errorKinds;
+} ClientResults;
+
+// Results of every client combined
+typedef struct {
+    double elapsedSeconds;
+    uint64_t* latencies;
+    size_t latencyCount;
+    uint64_t meanUs;
+    uint64_t completed;
+    uint64_t communicationErrors;
+    uint64_t errorResponses;
+    ErrorCount errors[MAX_ERROR_MESSAGES];
+    int errorKinds;
+    uint64_t slowCompleted;
+    uint64_t slowErrors;
+} BenchResults;
+
+/* -------------------------------------------------------------------------- */
+// Function Prototypes
+CmdLineParams cmd_line_parser(int argc, char* argv[]);
+bool parse_string_option(CmdLineParams* params, int* argc, char*** argv);
+void parse_numeric_option(
+        CmdLineParams* params, bool* seen, int* argc, char*** argv);
+ImageData read_file(const char* filename);
+Workload create_workload(const CmdLineParams* params);
+ClientResults* start_clients(Workload* workload, pthread_t* threads);
+void start_slow_clients(Workload* workload, ClientResults* slowClients);
+void* client_thread(void* arg);
+void* slow_client_thread(void* arg);
+bool claim_request(ClientResults* client, uint64_t sequence, uint64_t* sendNs);
+const ImageData* pick_image(const ClientResults* client, uint64_t sequence);
+bool open_connection(const char* port, ServerConnection* conn);
+void close_connection(ServerConnection* conn);
+int trickle_request(int fd, const Workload* workload, const ImageData* image);
+int write_fully(int fd, const unsigned char* data, size_t size);
+void record_latency(ClientResults* client, uint64_t ns);
+void record_error_message(ErrorCount* errors, int* errorKinds,
+        const char* message, uint64_t count);
+BenchResults combine_results(const Workload* workload, ClientResults* clients,
+        ClientResults* slowClients);
+int compare_latencies(const void* a, const void* b);
+uint64_t latency_percentile(const BenchResults* results, int permille);
+void write_text_report(FILE* stream, const CmdLineParams* params,
+        const BenchResults* results);
+void write_json_report(FILE* stream, const CmdLineParams* params,
+        const BenchResults* results);
+void write_json_string(FILE* stream, const char* str);
+void sleep_until(uint64_t ns);
+void usage_error(void);
+void file_error(const char* filename, bool writing);
+void port_error(const char* port);
+
+int main(int argc, char* argv[])
+{
+    CmdLineParams params = cmd_line_parser(argc, argv);
+    Workload workload = create_workload(&params);
+    FILE* json = NULL;
+    if (params.jsonFilename) {
+        json = fopen(params.jsonFilename, "w");
+        if (!json) {
+            file_error(params.jsonFilename, true);
+        }
+    }
+    // Check the server is there before starting any clients
+    ServerConnection probe;
+    if (!open_connection(params.port, &probe)) {
+        port_error(params.port);
+    }
+    close_connection(&probe);
+    signal(SIGPIPE, SIG_IGN); // The server may close connections mid-write
+
+    ClientResults* slowClients
+            = calloc(params.slowclients + 1, sizeof(ClientResults));
+    pthread_t* threads = calloc(params.connections, sizeof(pthread_t));
+    if (!slowClients || !threads) {
+        perror("calloc");
+        exit(EXIT_COMMERR_STATUS);
+    }
+    start_slow_clients(&workload, slowClients);
+    ClientResults* clients = start_clients(&workload, threads);
+    for (unsigned long i = 0; i < params.connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    BenchResults results = combine_results(&workload, clients, slowClients);
+    __atomic_store_n(&workload.stopping, true, __ATOMIC_RELEASE);
+
+    write_text_report(stdout, &params, &results);
+    if (json) {
+        write_json_report(json, &params, &results);
+        fclose(json);
+    }
+    // Slow clients are not joined: they may be part way through a trickled
+    // request, and exiting closes their connections
+    exit(0);
+}
+
+/* cmd_line_parser()
+ * -----------------
+ * Parses the port, then any options, then the image files making up the
+ * corpus. Runs for DEFAULT_DURATION seconds when neither a duration nor a
+ * request count is given.
+ *
+ * argc: number of command line arguments
+ * argv: array of command line argument strings
+ *
+ * Returns: CmdLineParams structure containing parsed parameters
+ * Errors: exits with code 10 if invalid arguments provided
+ */
+CmdLineParams cmd_line_parser(int argc, char* argv[])
+{
+    CmdLineParams params = {0};
+    // Skip program name
+    argv++;
+    argc--;
+
+    if (argc < 2) {
+        usage_error();
+    }
+    // Reject empty-string args or cmds
+    for (int i = 0; i < argc; i++) {
+        if (argv[i][0] == '\0') {
+            usage_error();
+        }
+    }
+    params.port = argv[0];
+    argv++;
+    argc--;
+    params.connections = 1;
+
+    // Options come first; the remaining arguments are images
+    bool seen[OPTION_COUNT] = {false};
+    while (argc > 0 && strncmp(argv[0], "--", 2) == 0) {
+        if (!parse_string_option(&params, &argc, &argv)) {
+            parse_numeric_option(&params, seen, &argc, &argv);
+        }
+    }
+    if (argc == 0 || params.connections == 0) {
+        usage_error();
+    }
+    if (!params.duration && !params.requests) {
+        params.duration = DEFAULT_DURATION;
+    }
+    params.imageFilenames = argv;
+    params.imageCount = argc;
+    return params;
+}
+
+/* parse_string_option()
+ * ---------------------
+ * Parses a --replaceimage or --json option and its filename.
+ *
+ * params: pointer to parameters structure to update
+ * argc: pointer to remaining argument count (modified)
+ * argv: pointer to remaining argument array (modified)
+ *
+ * Returns: true if the option was parsed, false if it is not one of these
+ * Errors: exits with code 10 if the option is repeated or has no filename
+ */
+bool parse_string_option(CmdLineParams* params, int* argc, char*** argv)
+{
+    char** args = *argv;
+    const char** filename;
+    if (strcmp(args[0], replaceImage) == 0) {
+        filename = &params->replaceFilename;
+    } else if (strcmp(args[0], jsonOutput) == 0) {
+        filename = &params->jsonFilename;
+    } else {
+        return false;
+    }
+    if (*filename || *argc < 2) {
+        usage_error();
+    }
+    *filename = args[1];
+    *argv += 2;
+    *argc -= 2;
+    return true;
+}
+
+/* parse_numeric_option()
+ * ----------------------
+ * Parses one of the numeric options and its non-negative integer value.
+ *
+ * params: pointer to parameters structure to update
+ * seen: flags for the options already given, indexed by NumericOption
+ * argc: pointer to remaining argument count (modified)
+ * argv: pointer to remaining argument array (modified)
+ *
+ * Returns: void
+ * Errors: exits with code 10 on an unknown, repeated, incomplete or out of
+ *         range option
+ */
+void parse_numeric_option(
+        CmdLineParams* params, bool* seen, int* argc, char*** argv)
+{
+    char** args = *argv;
+    int option = 0;
+    while (option < OPTION_COUNT && strcmp(args[0], optionNames[option]) != 0) {
+        option++;
+    }
+    if (option == OPTION_COUNT || seen[option] || *argc < 2
+            || !is_number(args[1])) {
+        usage_error();
+    }
+    const char* value = args[1][0] == '+' ? args[1] + 1 : args[1];
+    if (!valid_range(value, optionMaxValues[option])) {
+        usage_error();
+    }
+    seen[option] = true;
+    unsigned long number = strtoul(value, NULL, DECIMAL_BASE);
+    switch ((NumericOption)option) {
+    case OPT_CONNECTIONS:
+        params->connections = number;
+        break;
+    case OPT_DURATION:
+        params->duration = number;
+        break;
+    case OPT_REQUESTS:
+        params->requests = number;
+        break;
+    case OPT_RATE:
+        params->rate = number;
+        break;
+    case OPT_SLOW_CLIENTS:
+        params->slowclients = number;
+        break;
+    default:
+        break;
+    }
+    *argv += 2;
+    *argc -= 2;
+}
+
+/* read_file()
+ * -----------
+ * Reads the entire contents of a file into memory.
+ *
+ * filename: path to file to read
+ *
+ * Returns: file contents (data must be freed by the caller)
+ * Errors: exits with code 7 if the file cannot be opened or read, code 13 on
+ *         memory allocation failure
+ */
+ImageData read_file(const char* filename)
+{
+    ImageData image = {NULL, 0};
+    FILE* file = fopen(filename, "rb");
+    if (!file || fseek(file, 0, SEEK_END) != 0) {
+        file_error(filename, false);
+    }
+    long fileSize = ftell(file);
+    if (fileSize < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        file_error(filename, false);
+    }
+    image.data = malloc(fileSize ? fileSize : 1);
+    if (!image.data) {
+        perror("malloc");
+        exit(EXIT_COMMERR_STATUS);
+    }
+    image.size = fread(image.data, 1, fileSize, file);
+    fclose(file);
+    if (image.size != (size_t)fileSize) {
+        file_error(filename, false);
+    }
+    return image;
+}
+
+/* create_workload()
+ * -----------------
+ * Loads the image corpus, and the replacement image if one was given, into
+ * memory so that file I/O is not part of any measurement.
+ *
+ * params: parsed command line parameters
+ *
+ * Returns: workload for the client threads to share
+ * Errors: exits with code 7 if an image cannot be read, code 13 on memory
+ *         allocation failure
+ */
+Workload create_workload(const CmdLineParams* params)
+{
+    Workload workload = {0};
+    workload.params = params;
+    workload.corpusSize = params->imageCount;
+    workload.corpus = calloc(params->imageCount, sizeof(ImageData));
+    if (!workload.corpus) {
+        perror("calloc");
+        exit(EXIT_COMMERR_STATUS);
+    }
+    for (int i = 0; i < params->imageCount; i++) {
+        workload.corpus[i] = read_file(params->imageFilenames[i]);
+    }
+    if (params->replaceFilename) {
+        workload.replace = read_file(params->replaceFilename);
+    }
+    workload.remaining = params->requests;
+    return workload;
+}
+
+/* start_clients()
+ * ---------------
+ * Starts the measured client threads, one per connection, and the run's
+ * clock.
+ *
+ * workload: workload the clients share
+ * threads: array to store the thread of each client in
+ *
+ * Returns: results of each client, filled in as they run
+ * Errors: exits with code 13 if memory cannot be allocated or a thread
+ *         cannot be created
+ */
+ClientResults* start_clients(Workload* workload, pthread_t* threads)
+{
+    const CmdLineParams* params = workload->params;
+    ClientResults* clients = calloc(params->connections, sizeof(ClientResults));
+    if (!clients) {
+        perror("calloc");
+        exit(EXIT_COMMERR_STATUS);
+    }
+    workload->startNs = monotonic_ns();
+    if (params->duration) {
+        workload->stopNs = workload->startNs
+                + (uint64_t)params->duration * NS_PER_SECOND;
+    }
+    for (unsigned long i = 0; i < params->connections; i++) {
+        clients[i].workload = workload;
+        clients[i].index = i;
+        if (pthread_create(&threads[i], NULL, client_thread, &clients[i])
+                != 0) {
+            perror("pthread_create");
+            exit(EXIT_COMMERR_STATUS);
+        }
+    }
+    return clients;
+}
+
+/* start_slow_clients()
+ * --------------------
+ * Starts the slow client threads. They are detached, as they run until the
+ * program exits.
+ *
+ * workload: workload the clients share
+ * slowClients: array of results, one per slow client
+ *
+ * Returns: void
+ * Errors: exits with code 13 if a thread cannot be created
+ */
+void start_slow_clients(Workload* workload, ClientResults* slowClients)
+{
+    for (unsigned long i = 0; i < workload->params->slowclients; i++) {
+        pthread_t thread;
+        slowClients[i].workload = workload;
+        slowClients[i].index = i;
+        if (pthread_create(&thread, NULL, slow_client_thread, &slowClients[i])
+                != 0) {
+            perror("pthread_create");
+            exit(EXIT_COMMERR_STATUS);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* client_thread()
+ * ---------------
+ * Thread start routine for a measured client. Sends one request at a time
+ * on its connection and waits for the response, reconnecting if the
+ * connection fails. Only successful responses contribute latencies; error
+ * messages and communication errors are counted instead.
+ *
+ * arg: pointer to the ClientResults to fill in
+ *
+ * Returns: NULL once the run is over
+ */
+void* client_thread(void* arg)
+{
+    ClientResults* client = (ClientResults*)arg;
+    Workload* workload = client->workload;
+    ServerConnection conn = {-1, NULL, NULL};
+    uint64_t sendNs;
+    for (uint64_t sequence = 0; claim_request(client, sequence, &sendNs);
+            sequence++) {
+        if (conn.fd == -1 && !open_connection(workload->params->port, &conn)) {
+            client->communicationErrors++;
+            sleep_until(monotonic_ns() + RECONNECT_DELAY_MS * NS_PER_MS);
+            continue;
+        }
+        const ImageData* image = pick_image(client, sequence);
+        unsigned char opType;
+        unsigned char* data;
+        uint32_t size;
+        if (write_request(conn.to, image->data, image->size,
+                    workload->replace.data, workload->replace.size)
+                        != 0
+                || read_response(conn.from, &opType, &data, &size) != 0) {
+            client->communicationErrors++;
+            close_connection(&conn);
+            continue;
+        }
+        if (opType == OP_OUTPUT_IMAGE) {
+            record_latency(client, monotonic_ns() - sendNs);
+        } else if (opType == OP_ERROR_MSG) {
+            client->errorResponses++;
+            record_error_message(client->errors, &client->errorKinds,
+                    (char*)data, 1);
+        } else {
+            client->communicationErrors++;
+        }
+        free(data);
+    }
+    close_connection(&conn);
+    return NULL;
+}
+
+/* slow_client_thread()
+ * --------------------
+ * Thread start routine for a slow client, which trickles each request to
+ * the server TRICKLE_BYTES at a time every TRICKLE_INTERVAL_MS. Slow clients
+ * keep a connection busy receiving a request for a long time, so they show
+ * how the server's service of the measured clients holds up when some of
+ * its connections are slow.
+ *
+ * arg: pointer to the ClientResults to count completions and errors in
+ *
+ * Returns: NULL once the run is over
+ */
+void* slow_client_thread(void* arg)
+{
+    ClientResults* client = (ClientResults*)arg;
+    Workload* workload = client->workload;
+    ServerConnection conn = {-1, NULL, NULL};
+    for (uint64_t sequence = 0;
+            !__atomic_load_n(&workload->stopping, __ATOMIC_ACQUIRE);
+            sequence++) {
+        if (conn.fd == -1 && !open_connection(workload->params->port, &conn)) {
+            __atomic_add_fetch(
+                    &client->communicationErrors, 1, __ATOMIC_RELAXED);
+            sleep_until(monotonic_ns() + RECONNECT_DELAY_MS * NS_PER_MS);
+            continue;
+        }
+        unsigned char opType;
+        unsigned char* data;
+        uint32_t size;
+        if (trickle_request(conn.fd, workload, pick_image(client, sequence))
+                        != 0
+                || read_response(conn.from, &opType, &data, &size) != 0) {
+            __atomic_add_fetch(
+                    &client->communicationErrors, 1, __ATOMIC_RELAXED);
+            close_connection(&conn);
+            continue;
+        }
+        __atomic_add_fetch(&client->completed, 1, __ATOMIC_RELAXED);
+        free(data);
+    }
+    close_connection(&conn);
+    return NULL;
+}
+
+/* claim_request()
+ * ---------------
+ * Decides whether a measured client sends another request and when. As
+ * fast as possible (closed loop), a request is sent as soon as the last one
+ * completes. At a fixed rate (open loop), request sequence of client i is
+ * scheduled for (sequence * connections + i) / rate seconds into the run,
+ * and its latency is measured from that time rather than from when it was
+ * actually sent, so that a slow server cannot hide its queueing delay by
+ * holding back the clients.
+ *
+ * client: client wanting to send a request
+ * sequence: number of requests the client has already sent
+ * sendNs: set to the time the request's latency is measured from
+ *
+ * Returns: true if the request should be sent, false if the run is over
+ */
+bool claim_request(ClientResults* client, uint64_t sequence, uint64_t* sendNs)
+{
+    Workload* workload = client->workload;
+    const CmdLineParams* params = workload->params;
+    uint64_t now = monotonic_ns();
+    *sendNs = now;
+    if (params->rate) {
+        uint64_t slot = sequence * params->connections + client->index;
+        *sendNs = workload->startNs + slot * NS_PER_SECOND / params->rate;
+    }
+    if (workload->stopNs && *sendNs >= workload->stopNs) {
+        return false;
+    }
+    if (params->requests) {
+        uint64_t remaining
+                = __atomic_load_n(&workload->remaining, __ATOMIC_RELAXED);
+        do {
+            if (remaining == 0) {
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(&workload->remaining,
+                &remaining, remaining - 1, true, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED));
+    }
+    if (*sendNs > now) {
+        sleep_until(*sendNs);
+    }
+    return true;
+}
+
+/* pick_image()
+ * ------------
+ * Chooses the corpus image for a client's next request. Clients start at
+ * different images and step through the corpus in turn.
+ *
+ * client: client sending the request
+ * sequence: number of requests the client has already sent
+ *
+ * Returns: image to send
+ */
+const ImageData* pick_image(const ClientResults* client, uint64_t sequence)
+{
+    const Workload* workload = client->workload;
+    return &workload->corpus[(client->index + sequence) % workload->corpusSize];
+}
+
+/* open_connection()
+ * -----------------
+ * Connects to the server on localhost and creates buffered streams for
+ * writing requests and reading responses.
+ *
+ * port: port the server is listening on
+ * conn: connection to fill in
+ *
+ * Returns: true on success, false if the connection could not be made (conn
+ *          is left closed)
+ */
+bool open_connection(const char* port, ServerConnection* conn)
+{
+    struct addrinfo* ai = NULL;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    conn->fd = -1;
+    conn->to = NULL;
+    conn->from = NULL;
+    if (getaddrinfo("localhost", port, &hints, &ai) != 0) {
+        return false;
+    }
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(ai);
+        return false;
+    }
+    freeaddrinfo(ai);
+    int readFd = dup(fd);
+    conn->fd = fd;
+    conn->to = fdopen(fd, "w");
+    conn->from = readFd < 0 ? NULL : fdopen(readFd, "r");
+    if (!conn->to || !conn->from) {
+        if (!conn->from && readFd >= 0) {
+            close(readFd);
+        }
+        close_connection(conn);
+        return false;
+    }
+    return true;
+}
+
+/* close_connection()
+ * ------------------
+ * Closes a connection's streams, if it is open, and marks it closed.
+ *
+ * conn: connection to close
+ *
+ * Returns: void
+ */
+void close_connection(ServerConnection* conn)
+{
+    if (conn->from) {
+        fclose(conn->from);
+    }
+    if (conn->to) {
+        fclose(conn->to);
+    } else if (conn->fd != -1) {
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->to = NULL;
+    conn->from = NULL;
+}
+
+/* trickle_request()
+ * -----------------
+ * Frames a request with write_request() into memory, then sends it
+ * TRICKLE_BYTES at a time, pausing TRICKLE_INTERVAL_MS between writes.
+ * Stops early once the run is over.
+ *
+ * fd: socket to write the request to
+ * workload: workload holding any replacement image
+ * image: image to detect faces in
+ *
+ * Returns: 0 once the whole request has been sent, -1 on error or if the
+ *          run ended first
+ */
+int trickle_request(int fd, const Workload* workload, const ImageData* image)
+{
+    char* request = NULL;
+    size_t size = 0;
+    FILE* stream = open_memstream(&request, &size);
+    if (!stream) {
+        return -1;
+    }
+    int result = write_request(stream, image->data, image->size,
+            workload->replace.data, workload->replace.size);
+    fclose(stream);
+    for (size_t sent = 0; result == 0 && sent < size; sent += TRICKLE_BYTES) {
+        if (__atomic_load_n(&workload->stopping, __ATOMIC_ACQUIRE)) {
+            result = -1;
+            break;
+        }
+        size_t chunk = size - sent < (size_t)TRICKLE_BYTES ? size - sent
+                                                           : TRICKLE_BYTES;
+        result = write_fully(fd, (unsigned char*)request + sent, chunk);
+        sleep_until(monotonic_ns() + TRICKLE_INTERVAL_MS * NS_PER_MS);
+    }
+    free(request);
+    return result;
+}
+
+/* write_fully()
+ * -------------
+ * Writes a whole buffer to a file descriptor, handling partial writes.
+ *
+ * fd: file descriptor to write to
+ * data: bytes to write
+ * size: number of bytes to write
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int write_fully(int fd, const unsigned char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* record_latency()
+ * ----------------
+ * Records the latency of a successful request.
+ *
+ * client: client that sent the request
+ * ns: latency in nanoseconds
+ *
+ * Returns: void
+ * Errors: exits with code 13 if memory cannot be allocated
+ */
+void record_latency(ClientResults* client, uint64_t ns)
+{
+    if (client->latencyCount == client->latencyCapacity) {
+        size_t capacity = client->latencyCapacity
+                ? client->latencyCapacity * 2
+                : INITIAL_LATENCY_CAPACITY;
+        uint64_t* latencies
+                = realloc(client->latencies, capacity * sizeof(uint64_t));
+        if (!latencies) {
+            perror("realloc");
+            exit(EXIT_COMMERR_STATUS);
+        }
+        client->latencies = latencies;
+        client->latencyCapacity = capacity;
+    }
+    client->latencies[client->latencyCount++] = ns;
+    client->completed++;
+}
+
+/* record_error_message()
+ * ----------------------
+ * Adds to the count of an error message. Messages beyond the first
+ * MAX_ERROR_MESSAGES distinct ones are only counted in the total of error
+ * responses.
+ *
+ * errors: table of distinct messages and their counts
+ * errorKinds: number of entries in use in errors (updated)
+ * message: error message received
+ * count: number of times it was received
+ *
+ * Returns: void
+ */
+void record_error_message(ErrorCount* errors, int* errorKinds,
+        const char* message, uint64_t count)
+{
+    for (int i = 0; i < *errorKinds; i++) {
+        if (strcmp(errors[i].message, message) == 0) {
+            errors[i].count += count;
+            return;
+        }
+    }
+    if (*errorKinds == MAX_ERROR_MESSAGES) {
+        return;
+    }
+    errors[*errorKinds].message = strdup(message);
+    if (!errors[*errorKinds].message) {
+        return;
+    }
+    errors[(*errorKinds)++].count = count;
+}
+
+/* combine_results()
+ * -----------------
+ * Combines the results of the measured clients, which have all finished,
+ * with a snapshot of the slow clients' counts. Frees the measured clients'
+ * results.
+ *
+ * workload: workload that was run
+ * clients: results of each measured client
+ * slowClients: results of each slow client
+ *
+ * Returns: combined results, with latencies sorted in ascending order
+ * Errors: exits with code 13 if memory cannot be allocated
+ */
+BenchResults combine_results(const Workload* workload, ClientResults* clients,
+        ClientResults* slowClients)
+{
+    const CmdLineParams* params = workload->params;
+    BenchResults results = {0};
+    results.elapsedSeconds
+            = (double)(monotonic_ns() - workload->startNs) / NS_PER_SECOND;
+    for (unsigned long i = 0; i < params->connections; i++) {
+        results.latencyCount += clients[i].latencyCount;
+    }
+    results.latencies = malloc((results.latencyCount + 1) * sizeof(uint64_t));
+    if (!results.latencies) {
+        perror("malloc");
+        exit(EXIT_COMMERR_STATUS);
+    }
+    size_t filled = 0;
+    uint64_t totalNs = 0;
+    for (unsigned long i = 0; i < params->connections; i++) {
+        ClientResults* client = &clients[i];
+        memcpy(results.latencies + filled, client->latencies,
+                client->latencyCount * sizeof(uint64_t));
+        filled += client->latencyCount;
+        for (size_t j = 0; j < client->latencyCount; j++) {
+            totalNs += client->latencies[j];
+        }
+        results.completed += client->completed;
+        results.communicationErrors += client->communicationErrors;
+        results.errorResponses += client->errorResponses;
+        for (int j = 0; j < client->errorKinds; j++) {
+            record_error_message(results.errors, &results.errorKinds,
+                    client->errors[j].message, client->errors[j].count);
+            free(client->errors[j].message);
+        }
+        free(client->latencies);
+    }
+    free(clients);
+    if (results.latencyCount) {
+        results.meanUs = totalNs / results.latencyCount / NS_PER_US;
+    }
+    qsort(results.latencies, results.latencyCount, sizeof(uint64_t),
+            compare_latencies);
+    for (unsigned long i = 0; i < params->slowclients; i++) {
+        results.slowCompleted
+                += __atomic_load_n(&slowClients[i].completed, __ATOMIC_RELAXED);
+        results.slowErrors += __atomic_load_n(
+                &slowClients[i].communicationErrors, __ATOMIC_RELAXED);
+    }
+    return results;
+}
+
+/* compare_latencies()
+ * -------------------
+ * qsort() comparison function for latencies.
+ *
+ * a: pointer to the first latency
+ * b: pointer to the second latency
+ *
+ * Returns: negative, zero or positive as a is less than, equal to or greater
+ *          than b
+ */
+int compare_latencies(const void* a, const void* b)
+{
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+    return (first > second) - (first < second);
+}
+
+/* latency_percentile()
+ * --------------------
+ * Finds a latency percentile using the nearest rank method.
+ *
+ * results: combined results with sorted latencies
+ * permille: percentile to find, in tenths of a percent (0-1000)
+ *
+ * Returns: the percentile latency in microseconds, or 0 if no requests
+ *          succeeded
+ */
+uint64_t latency_percentile(const BenchResults* results, int permille)
+{
+    if (results->latencyCount == 0) {
+        return 0;
+    }
+    size_t rank = (results->latencyCount * permille + PERMILLE - 1) / PERMILLE;
+    return results->latencies[rank ? rank - 1 : 0] / NS_PER_US;
+}
+
+/* write_text_report()
+ * -------------------
+ * Writes the results as "name value" lines, like the server's statistics.
+ *
+ * stream: stream to write to
+ * params: parameters of the run
+ * results: combined results
+ *
+ * Returns: void
+ */
+void write_text_report(FILE* stream, const CmdLineParams* params,
+        const BenchResults* results)
+{
+    fprintf(stream, "connections %lu\n", params->connections);
+    fprintf(stream, "rate %lu\n", params->rate);
+    fprintf(stream, "elapsed_seconds %.3f\n", results->elapsedSeconds);
+    fprintf(stream, "completed %lu\n", (unsigned long)results->completed);
+    fprintf(stream, "throughput_rps %.1f\n",
+            results->completed / results->elapsedSeconds);
+    fprintf(stream,
+            "latency_us mean %lu p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n",
+            (unsigned long)results->meanUs,
+            (unsigned long)latency_percentile(results, P50),
+            (unsigned long)latency_percentile(results, P90),
+            (unsigned long)latency_percentile(results, P99),
+            (unsigned long)latency_percentile(results, P999),
+            (unsigned long)latency_percentile(results, PERMILLE));
+    fprintf(stream, "errors communication %lu\n",
+            (unsigned long)results->communicationErrors);
+    fprintf(stream, "errors responses %lu\n",
+            (unsigned long)results->errorResponses);
+    for (int i = 0; i < results->errorKinds; i++) {
+        fprintf(stream, "error \"%s\" %lu\n", results->errors[i].message,
+                (unsigned long)results->errors[i].count);
+    }
+    fprintf(stream, "slow_clients %lu completed %lu errors %lu\n",
+            params->slowclients, (unsigned long)results->slowCompleted,
+            (unsigned long)results->slowErrors);
+}
+
+/* write_json_report()
+ * -------------------
+ * Writes the results as a single JSON object for scripts to compare runs.
+ *
+ * stream: stream to write to
+ * params: parameters of the run
+ * results: combined results
+ *
+ * Returns: void
+ */
+void write_json_report(FILE* stream, const CmdLineParams* params,
+        const BenchResults* results)
+{
+    static const char* const names[] = {"p50", "p90", "p99", "p999", "max"};
+    static const int permilles[] = {P50, P90, P99, P999, PERMILLE};
+    fprintf(stream,
+            "{\"connections\": %lu, \"rate\": %lu, \"elapsed_seconds\": "
+            "%.3f, \"completed\": %lu, \"throughput_rps\": %.1f, "
+            "\"latency_us\": {\"mean\": %lu",
+            params->connections, params->rate, results->elapsedSeconds,
+            (unsigned long)results->completed,
+            results->completed / results->elapsedSeconds,
+            (unsigned long)results->meanUs);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        fprintf(stream, ", \"%s\": %lu", names[i],
+                (unsigned long)latency_percentile(results, permilles[i]));
+    }
+    fprintf(stream,
+            "}, \"errors\": {\"communication\": %lu, \"responses\": %lu, "
+            "\"messages\": {",
+            (unsigned long)results->communicationErrors,
+            (unsigned long)results->errorResponses);
+    for (int i = 0; i < results->errorKinds; i++) {
+        fprintf(stream, "%s", i ? ", " : "");
+        write_json_string(stream, results->errors[i].message);
+        fprintf(stream, ": %lu", (unsigned long)results->errors[i].count);
+    }
+    fprintf(stream,
+            "}}, \"slow_clients\": {\"count\": %lu, \"completed\": %lu, "
+            "\"errors\": %lu}}\n",
+            params->slowclients, (unsigned long)results->slowCompleted,
+            (unsigned long)results->slowErrors);
+}
+
+/* write_json_string()
+ * -------------------
+ * Writes a string as a quoted JSON string, escaping characters as needed.
+ *
+ * stream: stream to write to
+ * str: string to write
+ *
+ * Returns: void
+ */
+void write_json_string(FILE* stream, const char* str)
+{
+    fputc('"', stream);
+    for (; *str; str++) {
+        unsigned char chr = (unsigned char)*str;
+        if (chr == '"' || chr == '\\') {
+            fprintf(stream, "\\%c", chr);
+        } else if (chr < ' ') {
+            fprintf(stream, "\\u%04x", chr);
+        } else {
+            fputc(chr, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+/* sleep_until()
+ * -------------
+ * Sleeps until the monotonic clock reaches a given time.
+ *
+ * ns: monotonic time in nanoseconds to wake at
+ *
+ * Returns: void
+ */
+void sleep_until(uint64_t ns)
+{
+    struct timespec wake = {ns / NS_PER_SECOND, ns % NS_PER_SECOND};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0) {
+        // Interrupted by a signal; sleep for the rest of the time
+    }
+}
+
+/* usage_error()
+ * -------------
+ * Prints the usage message and exits with the usage error status code.
+ *
+ * Returns: does not return (exits program)
+ */
+void usage_error(void)
+{
+    fprintf(stderr, usageErrorMessage);
+    exit(EXIT_USAGE_STATUS);
+}
+
+/* file_error()
+ * ------------
+ * Prints an error message for a file that cannot be read or written and
+ * exits with the matching status code.
+ *
+ * filename: name of the file
+ * writing: true if the file was being opened for writing
+ *
+ * Returns: does not return (exits program)
+ */
+void file_error(const char* filename, bool writing)
+{
+    fprintf(stderr, writing ? fileWriteErrorMessage : fileReadErrorMessage,
+            filename);
+    exit(writing ? EXIT_FILEWRITE_STATUS : EXIT_FILEREAD_STATUS);
+}
+
+/* port_error()
+ * ------------
+ * Prints an error message for a server that cannot be connected to and
+ * exits with the port error status code.
+ *
+ * port: port that was being connected to
+ *
+ * Returns: does not return (exits program)
+ */
+void port_error(const char* port)
+{
+    fprintf(stderr, portErrorMessage, port);
+    exit(EXIT_SERVERPORT_STATUS);
+}
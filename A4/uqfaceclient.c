@@ -37,6 +37,7 @@ const char* const communicationErrorMessage
 const char* const replaceImage = "--replaceimage";
 const char* const outputImage = "--outputimage";
 const char* const detectImage = "--detect";
+const char* const statsRequest = "--stats";
 
 /* -------------------------------------------------------------------------- */
 // Enum Definitions
@@ -58,6 +59,7 @@ typedef struct {
     char* detectFilename;
     char* replaceFilename;
     char* outputFilename;
+    bool stats;
 } CmdLineParams;
 
 typedef struct {
@@ -86,9 +88,10 @@ int main(int argc, char* argv[])
     // Parse command line parameters
     CmdLineParams params = cmd_line_parser(argc, argv);
 
-    // Read image data
+    // Read image data (a statistics request carries none)
     size_t detectSize = 0;
-    unsigned char* detectData = detect_image(&params, &detectSize);
+    unsigned char* detectData
+            = params.stats ? NULL : detect_image(&params, &detectSize);
 
     size_t replaceSize = 0;
     unsigned char* replaceData = replace_image(&params, &replaceSize);
@@ -101,7 +104,12 @@ int main(int argc, char* argv[])
     SocketStreams streams = create_socket_streams(sockfd);
 
     // Communication Protocol
-    send_request(streams.to, detectData, detectSize, replaceData, replaceSize);
+    if (params.stats) {
+        send_stats_request(streams.to);
+    } else {
+        send_request(
+                streams.to, detectData, detectSize, replaceData, replaceSize);
+    }
     receive_request(streams.from, outputFile);
 
     // Cleanup
@@ -283,6 +291,10 @@ CmdLineParams cmd_line_parser(int argc, char* argv[])
             usage_error();
         }
     }
+    // Statistics requests do not take images
+    if (params.stats && (params.detectFilename || params.replaceFilename)) {
+        usage_error();
+    }
 
     return params;
 }
@@ -290,7 +302,7 @@ CmdLineParams cmd_line_parser(int argc, char* argv[])
 /* parse_optional_args()
  * ---------------------
  * Parses optional command line arguments (--detect, --replaceimage,
- * --outputimage) and updates the parameters structure accordingly.
+ * --outputimage, --stats) and updates the parameters structure accordingly.
  *
  * params: pointer to parameters structure to update
  * argc: pointer to remaining argument count (modified)
@@ -335,6 +347,13 @@ bool parse_optional_args(CmdLineParams* params, int* argc, char*** argv)
         params->outputFilename = args[1];
         args += 2;
         count -= 2;
+    } else if (strcmp(args[0], statsRequest) == 0) { // Check for --stats
+        if (params->stats) {
+            usage_error();
+        }
+        params->stats = true;
+        args++;
+        count--;
     } else {
         // Not one of our options
         return false;
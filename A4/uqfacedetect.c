@@ -5,13 +5,13 @@
  */
 
 #include "protocol.h"
+#include "workpool.h"
+#include "stats.h"
+#include "util.h"
+#include "cache.h"
+#include "pipeline.h"
 #include <stdio.h>
 #include <string.h>
-#include <opencv2/imgcodecs/imgcodecs_c.h>
-#include <opencv2/imgproc/imgproc_c.h>
-#include <opencv2/objdetect/objdetect_c.h>
-#include <opencv2/core/core_c.h>
-#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -21,21 +21,22 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <time.h>
 /* -------------------------------------------------------------------------- */
 // Constants
-#define FACE_CASCADE                                                           \
-    "/local/courses/csse2310/resources/a4/haarcascade_frontalface_alt2.xml"
-#define EYE_CASCADE                                                            \
-    "/local/courses/csse2310/resources/a4/haarcascade_eye_tree_eyeglasses.xml"
-#define HALF 0.5
-#define SCALE_FACTOR 1.1
-#define EYE_RADIUS_FACTOR 0.25
-
 // Exit Messages
 const char* const usageErrorMessage
         = "Usage: ./uqfacedetect maxconnections maxsize [portnum]\n";
-const char* const fileWriteErrorMessage
-        = "uqfacedetect: cannot open the image file for writing\n";
 const char* const cascadeErrorMessage
         = "uqfacedetect: cannot load a cascade classifier\n";
 const char* const portErrorMessage
@@ -48,9 +49,13 @@ const char* const imageZeroBytes = "image is 0 bytes";
 const char* const imageTooLarge = "image too large";
 const char* const invalidImage = "invalid image";
 const char* const invalidNoFaces = "no faces detected in image";
+const char* const invalidBatchSize = "invalid batch size";
+const char* const unknownFaceHandle = "unknown face handle";
+const char* const invalidEncoding = "invalid encoding options";
+const char* const serverBusy = "server busy";
+const char* const deadlineExceeded = "deadline exceeded";
 
 // File paths
-const char* const imageFile = "/tmp/imagefile.jpg";
 const char* const responseFile
         = "/local/courses/csse2310/resources/a4/responsefile";
 const char* const totalThreadCountFile = "/tmp/csse2310.totalthreadcount.txt";
@@ -60,6 +65,16 @@ const char* const activeThreadCountFile = "/tmp/csse2310.activethreadcount.txt";
 const char* const maxConnections = "10000";
 const char* const maxSize = "4294967295";
 
+// Largest encoding level allowed by each encoder, indexed by OutputFormat
+const int encodingMaxLevels[] = {100, 9, 100};
+
+// Optional arguments, indexed by ServerOption, and their maximum values
+const char* const optionNames[] = {"--detectsize", "--cachesize",
+        "--maxqueued", "--maxinflight", "--idletimeout", "--readtimeout",
+        "--listeners"};
+const char* const optionMaxValues[] = {"65535", "4294967295", "1000000",
+        "4294967295", "86400", "86400", "64"};
+
 /* -------------------------------------------------------------------------- */
 // Enums
 
@@ -68,19 +83,48 @@ typedef enum {
     DECIMAL_BASE = 10,
     BUFFER_SIZE = 4096,
     UINT32_NUM_BYTES = 4,
-    DEGREES_IN_CIRCLE = 360,
-    COLOUR_MAX = 255,
-    LINE_THICKNESS = 3,
-    MIN_NEIGHBOURS = 3,
-    LINE_TYPE = 8,
-    EYE_MIN_SIZE = 15,
-    FACE_MIN_SIZE = 30
+    COMPUTE_QUEUE_PER_WORKER = 2,
+    MAX_EVENTS = 64,
+    PROTOCOL_HEADER_SIZE = 9,
+    REQUEST_ID_SIZE = 4,
+    MAX_PIPELINED_REQUESTS = 8,
+    MAX_BATCH_ITEMS = 4096,
+    MAX_SESSION_FACES = 16,
+    BATCH_ITEM_HEADER_SIZE = 5,
+    COUNT_FLUSH_INTERVAL_NS = 100000000,
+    DEFAULT_DETECT_SIZE = 0,
+    DEFAULT_CACHE_SIZE = 64 * 1024 * 1024,
+    RECT_CACHE_SIZE = 4 * 1024 * 1024,
+    FACE_CACHE_SIZE = 16 * 1024 * 1024,
+    BUFFER_TRIM_INTERVAL = 16,
+    IDLE_BUFFER_LIMIT = 256 * 1024,
+    BITS_PER_INT = 32,
+    BITS_PER_BYTE = 8,
+    ENCODING_OPTIONS_SIZE = 2,
+    DEFAULT_IDLE_TIMEOUT = 300,
+    DEFAULT_READ_TIMEOUT = 60,
+    TIMEOUT_SWEEP_INTERVAL_MS = 1000,
+    NS_PER_MS = 1000000,
+    NS_PER_SECOND = 1000000000,
+    MAX_IOVECS = 64,
+    PORT_STRING_SIZE = 8
 } MagicNumbers;
 
+// Optional command line arguments
+typedef enum {
+    OPT_DETECT_SIZE,
+    OPT_CACHE_SIZE,
+    OPT_MAX_QUEUED,
+    OPT_MAX_IN_FLIGHT,
+    OPT_IDLE_TIMEOUT,
+    OPT_READ_TIMEOUT,
+    OPT_LISTENERS,
+    OPTION_COUNT
+} ServerOption;
+
 // Program Exit Codes
 typedef enum {
     EXIT_USAGE_STATUS = 11,
-    EXIT_FILEWRITE_STATUS = 1,
     EXIT_CASCADE_STATUS = 18,
     EXIT_SERVERPORT_STATUS = 5
 } ExitStatus;
@@ -90,98 +134,518 @@ typedef struct {
     unsigned int maxconnections;
     uint32_t maxsize;
     const char* portnum;
+    unsigned int detectsize;
+    size_t cachesize;
+    unsigned int maxqueued;
+    uint64_t maxinflight;
+    unsigned int idletimeout;
+    unsigned int readtimeout;
+    unsigned int listeners;
 } CmdLineParams;
 
-// Mutex Struct
+// Cascade classifiers. A registry is only ever used by one thread at a time
+typedef struct {
+    CvHaarClassifierCascade* faceCascade;
+    CvHaarClassifierCascade* eyeCascade;
+} CascadeRegistry;
+
+// Pool of per-worker cascade clones handed out to one request at a time.
+// Reloading the cascades creates a pool with the next generation number;
+// requests and eye searches hold a reference to the pool they started with,
+// and the last of them to finish frees a replaced pool
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    CascadeRegistry* detectors;
+    CascadeRegistry** freeDetectors;
+    int freeCount;
+    int size;
+    unsigned int generation;
+    int refCount;
+} DetectorPool;
+
+// Response file sent to clients whose first message has the wrong prefix,
+// held open so that it can be sent with sendfile(). It is replaced when the
+// server is sent SIGHUP; whichever holder releases the old one last closes
+// it
+typedef struct {
+    int fd;
+    size_t size;
+    int refCount;
+} ResponseFile;
+
+struct EventLoop;
+
+// State shared between threads. The counts are only accessed atomically.
+// queuedRequests and inFlightBytes cover admitted requests whose response has
+// not yet been queued. responseFile is the current response file (NULL if
+// it could not be loaded) and is only accessed with responseLock held, as
+// detectors (the current detector pool) is with detectorLock.
+// cascadeGeneration, reloading and draining are only accessed atomically.
+// workerCount is the number of compute pool workers, which every detector
+// pool is sized for. loops holds every event loop, one per listening socket
 typedef struct {
-    pthread_mutex_t fileAndCascadeMutex;
+    pthread_mutex_t detectorLock;
+    DetectorPool* detectors;
+    unsigned int cascadeGeneration;
+    bool reloading;
+    bool draining;
+    WorkPool* computePool;
+    int workerCount;
+    LruCache* outputCache;
+    LruCache* rectCache;
+    LruCache* faceCache;
     int totalThreadCount;
     int activeThreadCount;
     int activeSocketCount;
+    int queuedRequests;
+    uint64_t inFlightBytes;
+    pthread_mutex_t responseLock;
+    ResponseFile* responseFile;
+    struct EventLoop* loops;
+    int loopCount;
 } SharedState;
 
-// Thread Args
+// Detector pool, caches, compute pool and settings used by the image
+// pipeline for one request. deadlineNs is a monotonic_ns() time, or 0 if
+// the request has no deadline
 typedef struct {
-    int clientFd;
-    uint32_t imgSize;
-    CmdLineParams* params;
-    SharedState* shared;
-    int opType;
-} ClientArgs;
+    DetectorPool* detectors;
+    LruCache* rectCache;
+    LruCache* faceCache;
+    WorkPool* computePool;
+    unsigned int maxDimension;
+    EncodeOptions encoding;
+    uint64_t deadlineNs;
+} PipelineConfig;
+
+// Eye searches over the faces found in one image, shared by the worker that
+// found the faces and any idle workers helping it. Faces are claimed one at
+// a time, so a helper that starts late just finds nothing left to do. The
+// last of the searching threads to let go of it frees it
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    IplImage* grey;
+    CvRect* faces;
+    CvRect** eyes;
+    int* eyeCounts;
+    int faceCount;
+    int nextFace;
+    int doneCount;
+    bool failed;
+    int refCount;
+    DetectorPool* detectors;
+} EyeSearch;
 
-// Protocol Results
+// Decoded pixels kept in the face cache: this header followed by the pixel
+// rows, laid out as in the IplImage they were copied from
+typedef struct {
+    int width;
+    int height;
+    int depth;
+    int channels;
+    int widthStep;
+    int imageSize;
+} PixelBlock;
+
+// Encoded image bytes as received from a client. The allocation is reused
+// for later requests on the same connection; peak and uses track recent
+// demand so that oversized buffers can be trimmed
+typedef struct {
+    uint8_t* data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t peak;
+    unsigned int uses;
+} ImageBuffer;
+
+// Replacement face uploaded with OP_UPLOAD_FACE, referenced by its handle in
+// later OP_REPLACE_BY_HANDLE requests on the same connection. Only used by
+// the event loop; counts the connection's reference and those of the jobs
+// using it
+typedef struct {
+    ImageBuffer image;
+    CacheKey key;
+    uint32_t handle;
+    int refCount;
+} SessionFace;
+
+// Identifies the request a response answers. Version 2 requests carry an
+// ID that is echoed in every response to them
+typedef struct {
+    bool tagged;
+    uint32_t id;
+} RequestTag;
+
+struct Connection;
+
+// Decode/detect/encode work for one request, handed from the event loop to
+// the compute pool. An OP_BATCH request is a parent job whose items are
+// run as separate jobs; the parent completes when its last item does
+typedef struct ComputeJob {
+    struct Connection* conn;
+    RequestTag tag;
+    unsigned char opType;
+    EncodeOptions encoding;
+    uint64_t deadlineNs;
+    ImageBuffer image;
+    ImageBuffer face;
+    CacheKey imageKey;
+    CacheKey faceKey;
+    CacheKey outputKey;
+    SessionFace* sessionFace;
+    uint64_t admittedBytes;
+    CvMat* encoded;
+    CacheEntry* cached;
+    int result;
+    ErrorKind error;
+    struct ComputeJob* batch;
+    struct ComputeJob** items;
+    uint32_t batchSize;
+    uint32_t itemCount;
+    int pending;
+    struct ComputeJob* next;
+} ComputeJob;
+
+// Stages of reading a request from a client
 typedef enum {
-    PROTOCOL_SUCCESS = 1,
-    PROTOCOL_ERROR = 0,
-    COMMUNICATION_ERROR = -1
-} ProtocolResult;
+    READ_PREFIX,
+    READ_REQUEST_ID,
+    READ_OP_TYPE,
+    READ_ENCODING,
+    READ_DEADLINE,
+    READ_IMAGE_SIZE,
+    READ_IMAGE,
+    READ_FACE_SIZE,
+    READ_FACE,
+    READ_FACE_HANDLE,
+    READ_BATCH_SIZE,
+    READ_ITEM_SIZE,
+    READ_ITEM,
+    DISCARD_IMAGE,
+    PROCESSING,
+    CLOSING
+} ConnectionState;
+
+// Part of a response waiting to be written to a client: bytes copied into
+// the connection's output buffer (data and file unset), bytes held
+// elsewhere (an encoded image or output cache entry, released once sent) or
+// the response file. offset locates copied bytes in the output buffer
+typedef struct OutputSegment {
+    const uint8_t* data;
+    ResponseFile* file;
+    size_t offset;
+    size_t size;
+    size_t sent;
+    CvMat* encoded;
+    CacheEntry* entry;
+    struct OutputSegment* next;
+} OutputSegment;
+
+// Output waiting to be written to a client. Small pieces such as headers
+// and error messages are copied into data; large payloads are referenced in
+// place by their segments and written with them by one sendmsg() call
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    OutputSegment* head;
+    OutputSegment* tail;
+    OutputSegment* spareSegments;
+} OutputBuffer;
+
+// Per-client state, owned by the event loop. Version 2 clients may have up
+// to MAX_PIPELINED_REQUESTS jobs running at once; a closed connection is
+// only freed once all of them have finished. Open connections are linked
+// into their loop's list so that timed out clients can be found.
+// parkedJobs counts its jobs waiting on the loop's parked list
+typedef struct Connection {
+    int fd;
+    struct EventLoop* loop;
+    ConnectionState state;
+    bool closed;
+    uint8_t input[BUFFER_SIZE];
+    size_t inputStart;
+    size_t inputEnd;
+    uint8_t field[UINT32_NUM_BYTES];
+    size_t fieldFill;
+    uint32_t imageFill;
+    uint32_t discardLeft;
+    ConnectionState afterDiscard;
+    uint64_t requestStartNs;
+    uint64_t sendStartNs;
+    uint64_t lastActivityNs;
+    RequestTag tag;
+    unsigned char opType;
+    unsigned char opFlags;
+    EncodeOptions encoding;
+    uint64_t deadlineNs;
+    ComputeJob* current;
+    ComputeJob* spareJobs;
+    int inFlight;
+    int parkedJobs;
+    SessionFace* sessionFaces[MAX_SESSION_FACES];
+    uint32_t lastFaceHandle;
+    OutputBuffer output;
+    struct Connection* prevOpen;
+    struct Connection* nextOpen;
+    struct Connection* nextClosed;
+} Connection;
+
+// Epoll event loop servicing a listening socket and its client connections.
+// acceptPaused and acceptResumed are accessed atomically, as other loops
+// resume a paused loop when they free a connection slot. inFlight counts
+// the jobs of all its connections, open or closed, that are still running.
+// Jobs that found the compute pool's queue full wait, oldest first, on the
+// parked list until there is room for them. roomWanted is accessed
+// atomically; a compute worker that makes room in the queue while it is set
+// clears it and wakes the loop
+typedef struct EventLoop {
+    int epollFd;
+    int listenFd;
+    int wakeFd;
+    int signalFd;
+    bool acceptPaused;
+    bool acceptResumed;
+    int inFlight;
+    pthread_mutex_t completedLock;
+    ComputeJob* completed;
+    ComputeJob* parked;
+    ComputeJob* parkedTail;
+    bool roomWanted;
+    Connection* open;
+    Connection* closed;
+    uint64_t nextSweepNs;
+    CmdLineParams* params;
+    SharedState* shared;
+} EventLoop;
 
 // For OpenCV processing results
 typedef enum {
     OPENCV_SUCCESS = 0,
     OPENCV_INVALID_IMAGE = -1,
-    OPENCV_NO_FACES = -2
+    OPENCV_NO_FACES = -2,
+    OPENCV_DEADLINE_EXCEEDED = -3
 } OpenCVResult;
 
 /* -------------------------------------------------------------------------- */
 // Function Prototypes
 
 CmdLineParams cmd_line_parser(int argc, char* argv[]);
-const char* get_port(int argc, char* argv[]);
-bool is_number(const char* str);
-bool valid_range(const char* str, const char* maxValue);
+const char* get_port(int* argc, char*** argv);
+void parse_optional_args(CmdLineParams* params, int argc, char* argv[]);
 void start_server(CmdLineParams* params, SharedState* shared);
-void* client_handler(void* args);
-void send_responsefile(FILE* sockf, int fd);
-ProtocolResult handle_protocol_prefix(FILE* sockf, int fd);
-ProtocolResult handle_protocol_header(FILE* sockf, void* args);
-ProtocolResult handle_protocol_image(FILE* sockf, void* args);
-bool save_image(const char* filename, const uint8_t* data, uint32_t size);
-int detect_and_draw_faces_mutexed(SharedState* shared, const char* filename);
-uint8_t* read_file_to_buffer(const char* filename, long* length);
-bool send_protocol_image(FILE* sockf, long size, uint8_t* data);
+void* event_loop_thread(void* arg);
+void raise_open_file_limit(void);
+bool set_nonblocking(int fd);
+bool init_event_loop(EventLoop* loop, int listenFd, CmdLineParams* params,
+        SharedState* shared, bool handleSignals);
+void run_event_loop(EventLoop* loop);
+bool drain_event_loop(EventLoop* loop);
+bool connection_idle(const Connection* conn);
+void expire_connections(EventLoop* loop);
+void accept_connections(EventLoop* loop);
+bool reserve_socket_slot(EventLoop* loop);
+void release_socket_slot(EventLoop* loop);
+bool create_connection(EventLoop* loop, int clientFd);
+void close_connection(Connection* conn);
+void free_closed_connections(EventLoop* loop);
+void service_connection(Connection* conn);
+ssize_t receive_input(Connection* conn);
+void consume_input(Connection* conn);
+void field_received(Connection* conn);
+void op_type_received(Connection* conn);
+void encoding_received(Connection* conn);
+void next_header_field(Connection* conn);
+bool deadline_passed(uint64_t deadlineNs);
+void face_handle_received(Connection* conn, uint32_t handle);
+void face_uploaded(Connection* conn);
+void release_session_face(SessionFace* face);
+bool admit_request(Connection* conn, uint64_t size);
+bool admit_face(Connection* conn, uint32_t size, ErrorKind* error);
+void retire_request(SharedState* shared, uint64_t size);
+void shed_request(Connection* conn, uint32_t size);
+void refuse_face(Connection* conn, uint32_t size, ErrorKind error);
+void discard_image(Connection* conn, uint32_t size, ConnectionState next);
+void image_discarded(Connection* conn);
+void start_image(Connection* conn, ImageBuffer* image, uint32_t size,
+        ConnectionState state);
+bool reserve_image_buffer(ImageBuffer* image, uint32_t size, uint32_t limit);
+void trim_image_buffer(ImageBuffer* image, bool idle);
+void free_image_buffer(ImageBuffer* image);
+ImageBuffer* current_image(Connection* conn);
+bool receiving_image(const Connection* conn);
+void image_received(Connection* conn);
+void request_received(Connection* conn);
+void start_batch(Connection* conn, uint32_t batchSize);
+void start_batch_item(Connection* conn, uint32_t size);
+void batch_image_received(Connection* conn);
+void next_batch_item(Connection* conn);
+void release_batch_ref(ComputeJob* batch);
+void complete_job(ComputeJob* job);
+CacheKey output_cache_key(const ComputeJob* job, unsigned int generation);
+bool queue_cached_response(Connection* conn, ComputeJob* job);
+void dispatch_job(Connection* conn, ComputeJob* job);
+void submit_job(Connection* conn, ComputeJob* job);
+void submit_parked_jobs(EventLoop* loop);
+void compute_room_freed(void* arg);
+ComputeJob* take_job(Connection* conn);
+void recycle_job(Connection* conn, ComputeJob* job);
+void free_job(ComputeJob* job);
+void handle_client_eof(Connection* conn);
+bool queue_output(Connection* conn, const void* data, size_t size);
+OutputSegment* append_segment(Connection* conn);
+bool queue_encoded_output(Connection* conn, CvMat** encoded);
+bool queue_cached_output(Connection* conn, CacheEntry** entry);
+bool queue_job_output(Connection* conn, ComputeJob* job);
+void release_segment(OutputSegment* segment);
+void free_output(OutputBuffer* out);
+void queue_protocol_message(Connection* conn, const RequestTag* tag,
+        unsigned char opType, const void* data, uint32_t size);
+void queue_protocol_error(
+        Connection* conn, const RequestTag* tag, ErrorKind kind);
+const char* error_message(ErrorKind kind);
+void queue_stats_response(Connection* conn);
+void queue_responsefile(Connection* conn);
+bool flush_output(Connection* conn);
+ssize_t write_output(Connection* conn);
+void output_written(OutputBuffer* out, size_t sent);
+ResponseFile* load_responsefile(void);
+ResponseFile* acquire_responsefile(SharedState* shared);
+void release_responsefile(ResponseFile* file);
+void reload_responsefile(SharedState* shared);
+void server_signals(sigset_t* signals);
+void block_signals(void);
+void handle_signals(EventLoop* loop);
+void start_drain(SharedState* shared);
 void usage_error(void);
-int setup_listen_socket(const char* portnum);
+int setup_listen_socket(const char* portnum, bool reusePort);
+unsigned int listen_port(int listenFd);
 void print_port_number(int listenFd);
 CvHaarClassifierCascade* load_cascade(const char* path);
-IplImage* make_greyscale(IplImage* img);
-void draw_faces_and_eyes(IplImage* img, CvSeq* faces, CvMemStorage* storage,
-        CvHaarClassifierCascade* eyeCascade, IplImage* grey);
-int detect_and_draw_faces(const char* filename);
+Detections* search_faces(IplImage* img, CascadeRegistry* cascades,
+        const PipelineConfig* config, bool withEyes);
+EyeSearch* create_eye_search(
+        IplImage* grey, CvSeq* faces, DetectorPool* detectors);
+void run_eye_search(EyeSearch* search, CvHaarClassifierCascade* eyeCascade,
+        WorkPool* computePool);
+void eye_search_task(void* arg);
+void search_claimed_faces(
+        EyeSearch* search, CvHaarClassifierCascade* eyeCascade);
+void release_eye_search(EyeSearch* search);
+Detections* collect_detections(const EyeSearch* search, double scale,
+        const IplImage* img, bool eyesSearched);
+Detections* find_faces(IplImage* img, CacheKey imageKey,
+        const PipelineConfig* config, bool withEyes);
+int detect_and_draw_faces(const ImageBuffer* image, CacheKey imageKey,
+        const PipelineConfig* config, CvMat** encoded);
 void write_count_to_file(const char* path, int count);
-void decrement_thread_and_socket_counts(SharedState* shared);
-int replace_faces_in_memory(const char* filename);
-int replace_faces_mutexed(SharedState* shared, const char* filename);
-bool read_and_save_image(FILE* sockf, const char* filename, uint32_t size);
-void cascade_check(void);
+void start_count_flusher(SharedState* shared);
+void* count_flusher(void* arg);
+void flush_count(const char* path, int* count, int* lastWritten);
+void increment_thread_counts(SharedState* shared);
+void decrement_thread_counts(SharedState* shared);
+int replace_faces_in_memory(const ImageBuffer* image, const ImageBuffer* face,
+        CacheKey imageKey, CacheKey faceKey, const PipelineConfig* config,
+        CvMat** encoded);
+IplImage* load_replacement_face(const ImageBuffer* face, CacheKey faceKey,
+        LruCache* cache, CacheEntry** entry);
+IplImage* resized_face(const IplImage* faceImg, CacheKey faceKey,
+        CvSize size, LruCache* cache, CacheEntry** entry);
+IplImage* cached_image(LruCache* cache, CacheKey key, CacheEntry** entry);
+void cache_image(LruCache* cache, CacheKey key, const IplImage* img);
+void release_cached_image(IplImage** img, CacheEntry* entry);
+void run_compute_job(void* arg);
+void release_encoded(void* owner);
+void handle_completed_jobs(EventLoop* loop);
+void queue_job_response(Connection* conn, ComputeJob* job);
+void queue_batch_response(Connection* conn, ComputeJob* batch);
+unsigned char job_output(
+        const ComputeJob* job, const void** data, uint32_t* size);
+bool queue_protocol_header(Connection* conn, const RequestTag* tag,
+        unsigned char opType, uint32_t size);
+void release_job(ComputeJob* job, bool idle);
+CascadeRegistry load_cascades(void);
+bool try_load_cascades(CascadeRegistry* cascades);
+void reload_cascades(SharedState* shared);
+void* cascade_reloader(void* arg);
+void free_cascades(CascadeRegistry* cascades);
+bool clone_cascades(const CascadeRegistry* master, CascadeRegistry* clone);
+int online_core_count(void);
+DetectorPool* create_detector_pool(
+        const CascadeRegistry* master, int size, unsigned int generation);
+void free_detector_pool(DetectorPool* pool);
+DetectorPool* acquire_detector_pool(SharedState* shared);
+void release_detector_pool(DetectorPool* pool);
+CascadeRegistry* acquire_detector(DetectorPool* pool);
+CascadeRegistry* try_acquire_detector(DetectorPool* pool);
+void release_detector(DetectorPool* pool, CascadeRegistry* detector);
 
 /* ------------------------------------------------------------------------- */
 
 int main(int argc, char* argv[])
 {
-    cascade_check();
+    block_signals(); // Before any threads are started
+    CascadeRegistry cascades = load_cascades();
     CmdLineParams params = cmd_line_parser(argc, argv);
+    init_stats();
 
     SharedState shared;
-    pthread_mutex_init(&shared.fileAndCascadeMutex, NULL);
+    int cores = online_core_count();
+    shared.computePool
+            = create_work_pool(cores, cores * COMPUTE_QUEUE_PER_WORKER);
+    if (!shared.computePool) {
+        perror("create_work_pool");
+        exit(EXIT_FAILURE);
+    }
+    shared.workerCount = shared.computePool->threadCount;
+    pthread_mutex_init(&shared.detectorLock, NULL);
+    shared.detectors = create_detector_pool(&cascades, shared.workerCount, 0);
+    if (!shared.detectors) {
+        fprintf(stderr, cascadeErrorMessage);
+        exit(EXIT_CASCADE_STATUS);
+    }
+    shared.cascadeGeneration = 0;
+    shared.reloading = false;
+    shared.draining = false;
+    shared.outputCache = create_lru_cache(params.cachesize);
+    shared.rectCache = create_lru_cache(RECT_CACHE_SIZE);
+    shared.faceCache = create_lru_cache(FACE_CACHE_SIZE);
+    if ((params.cachesize && !shared.outputCache) || !shared.rectCache
+            || !shared.faceCache) {
+        perror("create_lru_cache");
+        exit(EXIT_FAILURE);
+    }
 
     shared.totalThreadCount = 0;
     shared.activeThreadCount = 0;
     shared.activeSocketCount = 0;
+    shared.queuedRequests = 0;
+    shared.inFlightBytes = 0;
+    pthread_mutex_init(&shared.responseLock, NULL);
+    shared.responseFile = load_responsefile();
     write_count_to_file(totalThreadCountFile, 0);
     write_count_to_file(activeThreadCountFile, 0);
     write_count_to_file(activeSocketCountFile, 0);
+    start_count_flusher(&shared);
 
     start_server(&params, &shared);
-    pthread_mutex_destroy(&shared.fileAndCascadeMutex);
+    free_work_pool(shared.computePool);
+    free_lru_cache(shared.outputCache);
+    free_lru_cache(shared.rectCache);
+    free_lru_cache(shared.faceCache);
+    release_detector_pool(shared.detectors);
+    free_cascades(&cascades);
+    release_responsefile(shared.responseFile);
     return 0;
 }
 
 /* cmd_line_parser()
  * -----------------
  * Parses and validates command line arguments for maxconnections, maxsize,
- * and optional port number. Validates that numeric arguments are within
- * acceptable ranges.
+ * the optional port number and any optional arguments. Validates that
+ * numeric arguments are within acceptable ranges.
  *
  * argc: number of command line arguments
  * argv: array of command line argument strings
@@ -227,810 +691,3447 @@ CmdLineParams cmd_line_parser(int argc, char* argv[])
     // Add to MaxValues
     params.maxsize = strtoul(maxSizeStr, NULL, DECIMAL_BASE);
 
-    // Get the port
-    params.portnum = get_port(argc - 2, argv + 2);
+    // Get the port, then any optional arguments
+    argc -= 2;
+    argv += 2;
+    params.portnum = get_port(&argc, &argv);
+    params.detectsize = DEFAULT_DETECT_SIZE;
+    params.cachesize = DEFAULT_CACHE_SIZE;
+    params.idletimeout = DEFAULT_IDLE_TIMEOUT;
+    params.readtimeout = DEFAULT_READ_TIMEOUT;
+    params.listeners = 1;
+    parse_optional_args(&params, argc, argv);
     return params;
 }
 
 /* get_port()
  * ----------
- * Extracts the optional port number from the remaining command line arguments.
- * Validates that exactly zero or one additional argument is provided.
+ * Extracts the optional port number from the remaining command line
+ * arguments. The port is the first remaining argument unless that argument
+ * is an option.
  *
- * argc: number of remaining arguments after maxconnections and maxsize
- * argv: array of remaining argument strings
+ * argc: pointer to number of arguments after maxconnections and maxsize
+ *       (decremented if a port is taken)
+ * argv: pointer to the remaining argument strings (advanced if a port is
+ *       taken)
  *
  * Returns: port number string if provided, NULL if no port specified
- * Errors: exits with code 11 if more than one extra argument given
  */
-const char* get_port(int argc, char* argv[])
+const char* get_port(int* argc, char*** argv)
 {
-    if (argc == 0) { // No port number given
+    if (*argc == 0 || strncmp((*argv)[0], "--", 2) == 0) { // No port given
         return NULL;
     }
-    if (argc == 1) {
-        if (argv[0][0] == '\0') { // Check if empty string
-            usage_error();
-        }
-        return argv[0];
-    }
-    usage_error(); // More than one extra arg given; invalid
-    return NULL;
+    const char* port = (*argv)[0];
+    (*argc)--;
+    (*argv)++;
+    return port;
 }
 
-/* is_number()
- * -----------
- * Checks if a string represents a valid positive integer, optionally
- * with a leading '+' sign.
+/* parse_optional_args()
+ * ---------------------
+ * Parses "--option value" pairs following the port number. Each option may
+ * be given at most once and takes a non-negative integer value.
  *
- * str: string to validate as a number
+ * params: parameters structure to update
+ * argc: number of remaining arguments
+ * argv: remaining argument strings
  *
- * Returns: true if string is a valid positive integer, false otherwise
+ * Returns: void
+ * Errors: exits with code 11 on an unknown, repeated, incomplete or out of
+ *         range option
  */
-bool is_number(const char* str)
+void parse_optional_args(CmdLineParams* params, int argc, char* argv[])
 {
-    if (!str || *str == '\0') { // Check if empty
-        return false;
-    }
-
-    // Check if negative number
-    if (*str == '+') {
-        str++;
-        if (*str == '\0') {
-            return false; // Only '+' was given
+    bool seen[OPTION_COUNT] = {false};
+    for (; argc > 0; argc -= 2, argv += 2) {
+        int option = 0;
+        while (option < OPTION_COUNT
+                && strcmp(argv[0], optionNames[option]) != 0) {
+            option++;
         }
-    }
-
-    while (*str) {
-        if (!isdigit((unsigned char)*str)) {
-            return false;
+        if (option == OPTION_COUNT || seen[option] || argc < 2
+                || !is_number(argv[1])) {
+            usage_error();
+        }
+        const char* value = argv[1][0] == '+' ? argv[1] + 1 : argv[1];
+        if (!valid_range(value, optionMaxValues[option])) {
+            usage_error();
+        }
+        seen[option] = true;
+        unsigned long number = strtoul(value, NULL, DECIMAL_BASE);
+        switch ((ServerOption)option) {
+        case OPT_DETECT_SIZE:
+            params->detectsize = number;
+            break;
+        case OPT_CACHE_SIZE:
+            params->cachesize = number;
+            break;
+        case OPT_MAX_QUEUED:
+            params->maxqueued = number;
+            break;
+        case OPT_MAX_IN_FLIGHT:
+            params->maxinflight = number;
+            break;
+        case OPT_IDLE_TIMEOUT:
+            params->idletimeout = number;
+            break;
+        case OPT_READ_TIMEOUT:
+            params->readtimeout = number;
+            break;
+        case OPT_LISTENERS:
+            if (number == 0) {
+                usage_error();
+            }
+            params->listeners = number;
+            break;
+        default:
+            break;
         }
-        str++;
-    }
-    return true;
-}
-
-/* valid_range()
- * -------------
- * Checks if a numeric string is within the valid range by comparing
- * string length and lexicographic order against maximum value.
- *
- * str: string representation of number to check
- * maxValue: string representation of maximum allowed value
- *
- * Returns: true if str represents a number <= maxValue, false otherwise
- */
-bool valid_range(const char* str, const char* maxValue)
-{
-    size_t strLength = strlen(str);
-    size_t maxLength = strlen(maxValue);
-    if (strLength < maxLength) {
-        return true;
-    }
-    if (strLength > maxLength) {
-        return false;
     }
-    return strcmp(str, maxValue) <= 0;
 }
 
 /* start_server()
  * --------------
- * Initializes and runs the main server loop. Sets up listening socket,
- * accepts client connections, and spawns detached threads to handle
- * each client connection.
+ * Initializes and runs the server. Sets up --listeners non-blocking
+ * listening sockets on the same port (sharing it with SO_REUSEPORT when
+ * there is more than one, so that the kernel spreads new connections across
+ * them), each serviced by its own epoll event loop that hands complete
+ * requests to the shared compute pool. The first loop runs on the calling
+ * thread and the rest on threads of their own. Once maxconnections clients
+ * are connected, new connections wait in the listen backlog until a client
+ * disconnects.
  *
  * params: pointer to command line parameters containing server configuration
  * shared: pointer to shared state structure for thread synchronization
  *
- * Returns: does not return (runs indefinitely)
+ * Returns: once every event loop has drained after SIGTERM
  * Errors: exits with code 5 if unable to set up listening socket
  */
 void start_server(CmdLineParams* params, SharedState* shared)
 {
-    // Set up socket
-    int listenFd = setup_listen_socket(params->portnum);
-    if (listenFd == -1) {
-        fprintf(stderr, portErrorMessage,
-                params->portnum ? params->portnum : "0");
-        exit(EXIT_SERVERPORT_STATUS);
+    int count = params->listeners;
+    EventLoop* loops = calloc(count, sizeof(EventLoop));
+    if (!loops) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
     }
-    print_port_number(listenFd); // Print port to stderr
-
-    while (1) {
-        int clientFd = accept(listenFd, NULL, NULL);
-        if (clientFd < 0) {
-            continue;
+    const char* portnum = params->portnum;
+    char port[PORT_STRING_SIZE];
+    for (int i = 0; i < count; i++) {
+        // Set up socket
+        int listenFd = setup_listen_socket(portnum, count > 1);
+        if (listenFd == -1) {
+            fprintf(stderr, portErrorMessage,
+                    params->portnum ? params->portnum : "0");
+            exit(EXIT_SERVERPORT_STATUS);
         }
-        pthread_mutex_lock(&shared->fileAndCascadeMutex);
-        shared->activeSocketCount++;
-        write_count_to_file(activeSocketCountFile, shared->activeSocketCount);
-        pthread_mutex_unlock(&shared->fileAndCascadeMutex);
-
-        // Prep thread arguments
-        ClientArgs* clientArgs = malloc(sizeof(ClientArgs));
-        if (!clientArgs) {
-            close(clientFd);
-            continue;
+        if (i == 0) { // Later sockets join the port the first one got
+            snprintf(port, sizeof(port), "%u", listen_port(listenFd));
+            portnum = port;
         }
-        clientArgs->clientFd = clientFd;
-        clientArgs->params = params;
-        clientArgs->shared = shared;
+        if (!init_event_loop(&loops[i], listenFd, params, shared, i == 0)) {
+            perror("init_event_loop");
+            exit(EXIT_FAILURE);
+        }
+    }
+    shared->loops = loops;
+    shared->loopCount = count;
+    set_work_pool_room_hook(shared->computePool, compute_room_freed, shared);
+    print_port_number(loops[0].listenFd); // Print port to stderr
+    raise_open_file_limit();
+    signal(SIGPIPE, SIG_IGN); // sendfile() has no MSG_NOSIGNAL
 
-        // Spawn detached thread to handle client
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_handler, clientArgs) != 0) {
-            close(clientFd);
-            free(clientArgs);
-            continue;
+    pthread_t* threads = calloc(count, sizeof(pthread_t));
+    if (!threads) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, event_loop_thread, &loops[i])
+                != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
         }
-        pthread_detach(tid);
     }
+    run_event_loop(&loops[0]);
+    for (int i = 1; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    set_work_pool_room_hook(shared->computePool, NULL, NULL);
+    for (int i = 0; i < count; i++) {
+        close(loops[i].epollFd);
+        close(loops[i].wakeFd);
+        if (loops[i].signalFd != -1) {
+            close(loops[i].signalFd);
+        }
+    }
+    shared->loops = NULL;
+    shared->loopCount = 0;
+    free(loops);
 }
 
-/* client_handler()
- * ----------------
- * Thread function that handles communication with a single client.
- * Processes protocol messages, performs face detection/replacement,
- * and sends responses back to client.
+/* event_loop_thread()
+ * -------------------
+ * Thread start routine running an additional event loop.
  *
- * args: pointer to ClientArgs structure containing client information
+ * arg: pointer to the EventLoop to run
  *
- * Returns: NULL when client session ends
- * Global variables modified: updates thread and socket counts in shared state
+ * Returns: NULL once the loop has drained
  */
-void* client_handler(void* args)
+void* event_loop_thread(void* arg)
 {
-    ClientArgs* clientArgs = (ClientArgs*)args;
-    SharedState* shared = clientArgs->shared;
-    int fd = clientArgs->clientFd;
-    // Open a FILE* for buffered reading/writing
-    FILE* sockf = fdopen(fd, "r+b");
-    if (!sockf) {
-        close(fd);
-        free(args);
-        return NULL;
-    }
-
-    // Mutex
-    pthread_mutex_lock(&shared->fileAndCascadeMutex);
-    shared->totalThreadCount++;
-    shared->activeThreadCount++;
-    write_count_to_file(totalThreadCountFile, shared->totalThreadCount);
-    write_count_to_file(activeThreadCountFile, shared->activeThreadCount);
-    pthread_mutex_unlock(&shared->fileAndCascadeMutex);
-
-    while (true) {
-        ProtocolResult prefixResult = handle_protocol_prefix(sockf, fd);
-        if (prefixResult == COMMUNICATION_ERROR) { // Communication error
-            break;
-        }
-        if (prefixResult == PROTOCOL_ERROR) { // Protocol error
-            continue; // Continue to next request
-        }
-        ProtocolResult headerResult = handle_protocol_header(sockf, args);
-        if (headerResult == COMMUNICATION_ERROR) { // Communication error
-            break;
-        }
-        if (headerResult == PROTOCOL_ERROR) { // Protocol error
-            continue;
-        }
-        ProtocolResult imageResult = handle_protocol_image(sockf, args);
-        if (imageResult == COMMUNICATION_ERROR) { // Communication error
-            break;
-        }
-        if (imageResult == PROTOCOL_SUCCESS) { // Success!
-            continue;
-        }
-    }
-
-    fclose(sockf);
-    free(args);
-    decrement_thread_and_socket_counts(shared);
+    run_event_loop((EventLoop*)arg);
     return NULL;
 }
 
-/* decrement_thread_and_socket_counts()
- * ------------------------------------
- * Decrements both active thread count and active socket count in shared
- * state and updates corresponding files. Used during client cleanup.
- *
- * shared: pointer to shared state structure
+/* raise_open_file_limit()
+ * -----------------------
+ * Raises the soft limit on open file descriptors to the hard limit so the
+ * event loop can hold as many client connections as maxconnections allows.
  *
  * Returns: void
- * Global variables modified: decrements activeThreadCount and activeSocketCount
  */
-void decrement_thread_and_socket_counts(SharedState* shared)
+void raise_open_file_limit(void)
 {
-    pthread_mutex_lock(&shared->fileAndCascadeMutex);
-    shared->activeThreadCount--;
-    write_count_to_file(activeThreadCountFile, shared->activeThreadCount);
-    shared->activeSocketCount--;
-    write_count_to_file(activeSocketCountFile, shared->activeSocketCount);
-    pthread_mutex_unlock(&shared->fileAndCascadeMutex);
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+            && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 }
 
-/* send_responsefile()
- * -------------------
- * Sends the contents of the response file to the client when an invalid
- * protocol prefix is received. Used for HTTP requests to the server.
+/* set_nonblocking()
+ * -----------------
+ * Puts a file descriptor into non-blocking mode.
  *
- * sockf: FILE stream for client communication
- * fd: socket file descriptor for shutdown operations
+ * fd: file descriptor to modify
  *
- * Returns: void
+ * Returns: true on success, false on failure
  */
-void send_responsefile(FILE* sockf, int fd)
+bool set_nonblocking(int fd)
 {
-    FILE* resp = fopen(responseFile, "rb");
-    if (resp) {
-        char buf[BUFFER_SIZE];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), resp)) > 0) {
-            fwrite(buf, 1, n, sockf);
-        }
-        fclose(resp);
-        fflush(sockf);
-        shutdown(fd, SHUT_WR);
-    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
 }
 
-/* handle_protocol_prefix()
- * ------------------------
- * Reads and validates the protocol prefix from client. If prefix is invalid,
- * sends the response file and closes connection.
+/* init_event_loop()
+ * -----------------
+ * Creates the epoll instance for an event loop and registers the listening
+ * socket, the eventfd used by compute workers and other loops to wake it
+ * and, for the loop that handles signals, a signalfd for the signals
+ * blocked by block_signals(). All are edge-triggered, like every client
+ * connection.
  *
- * sockf: FILE stream for client communication
- * fd: socket file descriptor for shutdown operations
+ * loop: event loop to initialise
+ * listenFd: listening socket to accept clients from
+ * params: pointer to command line parameters containing server configuration
+ * shared: pointer to shared state structure
+ * handleSignals: whether this loop handles signals (only one loop may)
  *
- * Returns: PROTOCOL_SUCCESS if valid prefix, PROTOCOL_ERROR for protocol
- *          error, COMMUNICATION_ERROR for connection termination
+ * Returns: true on success, false on failure
  */
-ProtocolResult handle_protocol_prefix(FILE* sockf, int fd)
+bool init_event_loop(EventLoop* loop, int listenFd, CmdLineParams* params,
+        SharedState* shared, bool handleSignals)
 {
-    uint32_t prefix = 0;
-    if (read_uint32_le(sockf, &prefix) != 0) {
-        send_protocol_error_file(sockf, invalidMessage);
-        fflush(sockf);
-        return COMMUNICATION_ERROR;
+    memset(loop, 0, sizeof(EventLoop));
+    loop->listenFd = listenFd;
+    loop->params = params;
+    loop->shared = shared;
+    pthread_mutex_init(&loop->completedLock, NULL);
+    sigset_t signals;
+    server_signals(&signals);
+    loop->epollFd = epoll_create1(0);
+    loop->wakeFd = eventfd(0, EFD_NONBLOCK);
+    loop->signalFd = handleSignals ? signalfd(-1, &signals, SFD_NONBLOCK) : -1;
+    if (loop->epollFd == -1 || loop->wakeFd == -1
+            || (handleSignals && loop->signalFd == -1)
+            || !set_nonblocking(listenFd)) {
+        return false;
     }
-
-    if (prefix != PROTOCOL_PREFIX) {
-        send_responsefile(sockf, fd);
-        return COMMUNICATION_ERROR;
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &loop->listenFd;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, listenFd, &event) == -1) {
+        return false;
+    }
+    event.data.ptr = &loop->signalFd;
+    if (handleSignals
+            && epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->signalFd, &event)
+                    == -1) {
+        return false;
     }
-    return PROTOCOL_SUCCESS;
+    event.data.ptr = &loop->wakeFd;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) != -1;
 }
 
-/* handle_protocol_header()
- * ------------------------
- * Reads and validates the protocol header containing operation type and
- * image size. Checks operation type and image size constraints.
+/* run_event_loop()
+ * ----------------
+ * Waits for socket readiness and job completion events and dispatches them.
+ * Connections closed while handling a batch of events are only freed once
+ * the whole batch has been handled, as later events may still refer to them.
+ * While either timeout is enabled, the loop wakes at least once per
+ * TIMEOUT_SWEEP_INTERVAL_MS to close connections that have timed out.
+ * Parked jobs are retried after every wakeup; while any are parked, a
+ * compute worker wakes the loop once there is room for them.
  *
- * sockf: FILE stream for client communication
- * args: pointer to ClientArgs structure to store parsed header information
+ * loop: event loop to run
  *
- * Returns: PROTOCOL_SUCCESS if valid header, PROTOCOL_ERROR for protocol
- *          error, COMMUNICATION_ERROR for connection failure
+ * Returns: once the server is draining and the loop has no connections or
+ *          running jobs left
  */
-ProtocolResult handle_protocol_header(FILE* sockf, void* args)
+void run_event_loop(EventLoop* loop)
 {
-    ClientArgs* clientArgs = (ClientArgs*)args;
-    int opType = fgetc(sockf);
-    if (opType == EOF) {
-        send_protocol_error_file(sockf, invalidMessage);
-        return COMMUNICATION_ERROR;
-    }
-    unsigned char opTypeByte = (unsigned char)opType;
-    if (opTypeByte != OP_FACE_DETECT && opTypeByte != OP_FACE_REPLACE) {
-        send_protocol_error_file(sockf, invalidOpType);
-        fflush(sockf);
-        return PROTOCOL_ERROR;
-    }
-    uint32_t imgSize;
-    if (read_uint32_le(sockf, &imgSize) != 0) {
-        send_protocol_error_file(sockf, invalidMessage);
-        return COMMUNICATION_ERROR;
-    }
-    if (imgSize == 0) {
-        send_protocol_error_file(sockf, imageZeroBytes);
-        fflush(sockf);
-        return PROTOCOL_ERROR;
-    }
-    uint32_t maxImageSize = clientArgs->params->maxsize;
-    if (maxImageSize != 0 && imgSize > maxImageSize) {
-        send_protocol_error_file(sockf, imageTooLarge);
-        fflush(sockf);
-        return PROTOCOL_ERROR;
+    struct epoll_event events[MAX_EVENTS];
+    bool timeouts = loop->params->idletimeout || loop->params->readtimeout;
+    int waitMs = timeouts ? TIMEOUT_SWEEP_INTERVAL_MS : -1;
+    while (1) {
+        int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, waitMs);
+        for (int i = 0; i < count; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &loop->listenFd) {
+                accept_connections(loop);
+            } else if (source == &loop->wakeFd) {
+                handle_completed_jobs(loop);
+                if (__atomic_exchange_n(
+                            &loop->acceptResumed, false, __ATOMIC_ACQ_REL)) {
+                    accept_connections(loop);
+                }
+            } else if (source == &loop->signalFd) {
+                handle_signals(loop);
+            } else {
+                Connection* conn = (Connection*)source;
+                if (!conn->closed) {
+                    service_connection(conn);
+                }
+            }
+        }
+        submit_parked_jobs(loop);
+        if (timeouts && monotonic_ns() >= loop->nextSweepNs) {
+            expire_connections(loop);
+        }
+        bool drained = __atomic_load_n(&loop->shared->draining,
+                               __ATOMIC_ACQUIRE)
+                && drain_event_loop(loop);
+        free_closed_connections(loop);
+        if (drained) {
+            return;
+        }
     }
-    clientArgs->opType = opTypeByte;
-    clientArgs->imgSize = imgSize;
-    return PROTOCOL_SUCCESS;
 }
 
-/* handle_protocol_image()
- * -----------------------
- * Reads image data from client, performs face detection or replacement
- * operation, and sends the processed image back to client.
+/* drain_event_loop()
+ * ------------------
+ * Winds an event loop down after SIGTERM. The listening socket is closed
+ * so that no more clients are accepted, and each connection is closed once
+ * it is idle: requests already being received are completed and their
+ * responses sent first.
  *
- * sockf: FILE stream for client communication
- * args: pointer to ClientArgs structure containing operation parameters
+ * loop: event loop to drain
  *
- * Returns: PROTOCOL_SUCCESS if operation completed successfully,
- *          PROTOCOL_ERROR for processing errors, COMMUNICATION_ERROR
- *          for connection failures
+ * Returns: true once the loop has no connections or running jobs left
  */
-ProtocolResult handle_protocol_image(FILE* sockf, void* args)
+bool drain_event_loop(EventLoop* loop)
 {
-    ClientArgs* clientArgs = (ClientArgs*)args;
-    SharedState* shared = clientArgs->shared;
-    if (!read_and_save_image(sockf, imageFile, clientArgs->imgSize)) {
-        return COMMUNICATION_ERROR;
+    if (loop->listenFd != -1) {
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, loop->listenFd, NULL);
+        close(loop->listenFd);
+        loop->listenFd = -1;
     }
-    OpenCVResult opencvResult;
-    if (clientArgs->opType == OP_FACE_REPLACE) {
-        uint32_t faceSize;
-        if (read_uint32_le(sockf, &faceSize) != 0) {
-            return COMMUNICATION_ERROR;
-        }
-        // Save face image to the same file (overwriting)
-        if (!read_and_save_image(sockf, imageFile, faceSize)) {
-            return COMMUNICATION_ERROR;
+    Connection* conn = loop->open;
+    while (conn) {
+        Connection* next = conn->nextOpen;
+        if (connection_idle(conn)) {
+            close_connection(conn);
         }
-        opencvResult = (OpenCVResult)replace_faces_mutexed(shared, imageFile);
-    } else {
-        opencvResult = (OpenCVResult)detect_and_draw_faces_mutexed(
-                shared, imageFile);
-    }
-    switch (opencvResult) { // Handle OpenCV results
-    case OPENCV_INVALID_IMAGE:
-        send_protocol_error_file(sockf, invalidImage);
-        fflush(sockf);
-        return PROTOCOL_ERROR;
-    case OPENCV_NO_FACES:
-        send_protocol_error_file(sockf, invalidNoFaces);
-        fflush(sockf);
-        return PROTOCOL_ERROR;
-    case OPENCV_SUCCESS:
-        break; // Continue to send image
-    default: // Unexpected result, treat as invalid image
-        send_protocol_error_file(sockf, invalidImage);
-        fflush(sockf);
-        return PROTOCOL_ERROR;
-    }
-    long outSize = 0;
-    uint8_t* outBuf = read_file_to_buffer(imageFile, &outSize);
-    if (!outBuf) {
-        return COMMUNICATION_ERROR;
-    }
-    if (!send_protocol_image(sockf, outSize, outBuf)) {
-        free(outBuf);
-        return COMMUNICATION_ERROR;
-    }
-    free(outBuf);
-    return PROTOCOL_SUCCESS;
-}
-
-/* read_and_save_image()
- * ---------------------
- * Reads a specified amount of image data from a socket stream and saves
- * it to a file. Used to receive image data from clients.
+        conn = next;
+    }
+    return !loop->open && loop->inFlight == 0;
+}
+
+/* connection_idle()
+ * -----------------
+ * Checks whether a connection is between requests with nothing left to
+ * do: no request partly received, no jobs running and no output pending.
  *
- * sockf: FILE stream to read image data from
- * filename: path to file where image data should be saved
- * size: number of bytes to read and save
+ * conn: connection to check
  *
- * Returns: true on success, false on read or write failure
+ * Returns: true if the connection is idle
  */
-bool read_and_save_image(FILE* sockf, const char* filename, uint32_t size)
+bool connection_idle(const Connection* conn)
 {
-    uint8_t* buf = malloc(size);
-    if (!buf || fread(buf, 1, size, sockf) != size) {
-        free(buf);
-        return false;
-    }
-    bool ok = save_image(filename, buf, size);
-    free(buf);
-    return ok;
+    return conn->state == READ_PREFIX && conn->fieldFill == 0
+            && conn->inputStart == conn->inputEnd && conn->inFlight == 0
+            && !conn->output.head;
 }
 
-/* save_image()
- * ------------
- * Writes image data from a buffer to a file. Used to store received
- * image data for processing.
+/* expire_connections()
+ * --------------------
+ * Closes connections that have timed out. A connection with no jobs running
+ * times out once no bytes have been read from or written to it for
+ * --idletimeout seconds, and a request that is still being received times
+ * out --readtimeout seconds after its first byte arrived, however steadily
+ * its bytes are trickling in. A timeout of 0 is never reached.
  *
- * filename: path to file where image should be saved
- * data: buffer containing image data
- * size: number of bytes to write
+ * loop: event loop whose connections should be checked
  *
- * Returns: true if all data written successfully, false otherwise
+ * Returns: void
  */
-bool save_image(const char* filename, const uint8_t* data, uint32_t size)
+void expire_connections(EventLoop* loop)
 {
-    FILE* f = fopen(filename, "wb");
-    if (!f) {
-        return false;
+    uint64_t now = monotonic_ns();
+    uint64_t idleNs = (uint64_t)loop->params->idletimeout * NS_PER_SECOND;
+    uint64_t readNs = (uint64_t)loop->params->readtimeout * NS_PER_SECOND;
+    loop->nextSweepNs = now + (uint64_t)TIMEOUT_SWEEP_INTERVAL_MS * NS_PER_MS;
+    Connection* conn = loop->open;
+    while (conn) {
+        Connection* next = conn->nextOpen;
+        bool reading = conn->state != PROCESSING && conn->state != CLOSING
+                && (conn->state != READ_PREFIX || conn->fieldFill > 0)
+                && conn->parkedJobs == 0;
+        if ((idleNs && conn->inFlight == 0
+                    && now - conn->lastActivityNs >= idleNs)
+                || (readNs && reading
+                        && now - conn->requestStartNs >= readNs)) {
+            close_connection(conn);
+        }
+        conn = next;
     }
-    size_t written = fwrite(data, 1, size, f);
-    fclose(f);
-    return written == size;
 }
 
-/* detect_and_draw_faces_mutexed()
- * -------------------------------
- * Thread-safe wrapper for detect_and_draw_faces() that uses mutex locking
- * to prevent concurrent access to OpenCV cascade classifiers.
+/* accept_connections()
+ * --------------------
+ * Accepts every pending connection on the listening socket. Stops accepting
+ * while maxconnections clients are connected (across all event loops);
+ * release_socket_slot() resumes accepting once a slot frees up.
  *
- * shared: pointer to shared state containing mutex
- * filename: path to image file to process
+ * loop: event loop owning the listening socket
  *
- * Returns: 0 on success, -1 on failure, -2 if no faces detected
+ * Returns: void
  */
-int detect_and_draw_faces_mutexed(SharedState* shared, const char* filename)
+void accept_connections(EventLoop* loop)
 {
-    int result;
-    pthread_mutex_lock(&shared->fileAndCascadeMutex);
-    result = detect_and_draw_faces(filename);
-    pthread_mutex_unlock(&shared->fileAndCascadeMutex);
-    return result;
+    while (loop->listenFd != -1 && reserve_socket_slot(loop)) {
+        int clientFd = accept(loop->listenFd, NULL, NULL);
+        if (clientFd < 0) {
+            release_socket_slot(loop);
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return; // No more pending connections
+        }
+        if (!create_connection(loop, clientFd)) {
+            close(clientFd);
+            release_socket_slot(loop);
+        }
+    }
 }
 
-/* replace_faces_mutexed()
- * -----------------------
- * Thread-safe wrapper for replace_faces_in_memory() that uses mutex locking
- * to prevent concurrent access to OpenCV cascade classifiers.
+/* reserve_socket_slot()
+ * ---------------------
+ * Counts a connection about to be accepted against maxconnections. If every
+ * slot is taken, the loop is marked as paused so that whichever loop next
+ * frees a slot resumes it; the count is checked again after pausing in case
+ * a slot was freed in between.
  *
- * shared: pointer to shared state containing mutex
- * filename: path to file containing both target and replacement images
+ * loop: event loop about to accept a connection
  *
- * Returns: 0 on success, -1 on failure, -2 if no faces detected
+ * Returns: true if a slot was reserved, false if accepting is paused
+ * Global variables modified: increments activeSocketCount on success
  */
-int replace_faces_mutexed(SharedState* shared, const char* filename)
+bool reserve_socket_slot(EventLoop* loop)
 {
-    int result;
-    pthread_mutex_lock(&shared->fileAndCascadeMutex);
-    result = replace_faces_in_memory(filename);
-    pthread_mutex_unlock(&shared->fileAndCascadeMutex);
-    return result;
+    int* active = &loop->shared->activeSocketCount;
+    int max = loop->params->maxconnections;
+    int count = __atomic_load_n(active, __ATOMIC_SEQ_CST);
+    while (true) {
+        if (max == 0 || count < max) {
+            if (__atomic_compare_exchange_n(active, &count, count + 1, true,
+                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return true;
+            }
+            continue; // count now holds the current value
+        }
+        __atomic_store_n(&loop->acceptPaused, true, __ATOMIC_SEQ_CST);
+        count = __atomic_load_n(active, __ATOMIC_SEQ_CST);
+        if (count >= max) {
+            return false;
+        }
+        __atomic_store_n(&loop->acceptPaused, false, __ATOMIC_SEQ_CST);
+    }
 }
 
-/* read_file_to_buffer()
+/* release_socket_slot()
  * ---------------------
- * Reads the entire contents of a file into a dynamically allocated buffer.
- * Used to load processed images for transmission back to clients.
+ * Frees a connection slot reserved by reserve_socket_slot() and resumes
+ * accepting on every loop that paused for want of one. This loop resumes at
+ * once; other loops are woken through their eventfd.
  *
- * filename: path to file to read
- * length: pointer to store the file size
+ * loop: event loop releasing the slot
  *
- * Returns: pointer to allocated buffer containing file contents, or NULL on
- * failure
+ * Returns: void
+ * Global variables modified: decrements activeSocketCount
  */
-uint8_t* read_file_to_buffer(const char* filename, long* length)
+void release_socket_slot(EventLoop* loop)
 {
-    FILE* f = fopen(filename, "rb");
-    if (!f) {
-        return NULL;
-    }
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    uint8_t* buf = malloc(size);
-    if (!buf) {
-        fclose(f);
-        return NULL;
+    SharedState* shared = loop->shared;
+    __atomic_sub_fetch(&shared->activeSocketCount, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < shared->loopCount; i++) {
+        EventLoop* paused = &shared->loops[i];
+        if (paused == loop
+                || !__atomic_exchange_n(
+                        &paused->acceptPaused, false, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        uint64_t one = 1;
+        __atomic_store_n(&paused->acceptResumed, true, __ATOMIC_RELEASE);
+        if (write(paused->wakeFd, &one, sizeof(one)) == -1) {
+            // Counter is already non-zero; the loop has a wakeup pending
+        }
     }
-    if (fread(buf, 1, (size_t)size, f) != (size_t)size) {
-        fclose(f);
-        free(buf);
-        return NULL;
+    if (__atomic_exchange_n(&loop->acceptPaused, false, __ATOMIC_SEQ_CST)) {
+        accept_connections(loop);
     }
-    fclose(f);
-    *length = size;
-    return buf;
 }
 
-/* send_protocol_image()
- * ---------------------
- * Sends a processed image back to the client using the proper protocol
- * format including prefix, operation type, size, and image data.
+/* create_connection()
+ * -------------------
+ * Sets up state for a newly accepted client and registers it with the event
+ * loop for edge-triggered read and write readiness.
  *
- * sockf: FILE stream for client communication
- * size: size of image data to send
- * data: buffer containing image data
+ * loop: event loop that will service the client
+ * clientFd: socket connected to the client
  *
- * Returns: true on successful transmission, false on error
+ * Returns: true on success, false on failure (caller closes clientFd)
+ * Global variables modified: increments session counts
  */
-bool send_protocol_image(FILE* sockf, long size, uint8_t* data)
+bool create_connection(EventLoop* loop, int clientFd)
 {
-    uint32_t prefix = PROTOCOL_PREFIX;
-    uint32_t imageSize = (uint32_t)size;
-    uint8_t opType = OP_OUTPUT_IMAGE;
-
-    if (fwrite(&prefix, 1, UINT32_NUM_BYTES, sockf) != UINT32_NUM_BYTES) {
+    if (!set_nonblocking(clientFd)) {
         return false;
     }
-    if (fputc(opType, sockf) == EOF) {
+    Connection* conn = calloc(1, sizeof(Connection));
+    if (!conn) {
         return false;
     }
-    if (fwrite(&imageSize, 1, UINT32_NUM_BYTES, sockf) != UINT32_NUM_BYTES) {
+    conn->fd = clientFd;
+    conn->loop = loop;
+    conn->state = READ_PREFIX;
+    conn->lastActivityNs = monotonic_ns();
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, clientFd, &event) == -1) {
+        free(conn);
         return false;
     }
-    if (fwrite(data, 1, size, sockf) != (size_t)size) {
-        return false;
-    }
-    if (fflush(sockf) != 0) {
-        return false;
+    conn->nextOpen = loop->open;
+    if (loop->open) {
+        loop->open->prevOpen = conn;
     }
-
+    loop->open = conn;
+    increment_thread_counts(loop->shared);
     return true;
 }
 
-/* setup_listen_socket()
- * ---------------------
- * Creates and configures a listening socket bound to the specified port.
- * Uses getaddrinfo() for address resolution and sets SO_REUSEADDR option.
+/* close_connection()
+ * ------------------
+ * Closes a client connection and releases its buffers. The Connection itself
+ * is freed by free_closed_connections() at the end of the current batch of
+ * events, or once its last running job has finished if any are in flight.
  *
- * portnum: string representation of port number, or NULL for ephemeral port
+ * conn: connection to close
  *
- * Returns: file descriptor of listening socket, or -1 on failure
+ * Returns: void
+ * Global variables modified: decrements session and socket counts
  */
-int setup_listen_socket(const char* portnum)
+void close_connection(Connection* conn)
 {
-    struct addrinfo hints = {0}, *res, *rp;
-    int listenFd = -1;
-    int optVal = 1;
-
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    // Use "0" for ephemeral port if portnum is NULL
-    if (!portnum) {
-        portnum = "0";
+    EventLoop* loop = conn->loop;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->prevOpen) {
+        conn->prevOpen->nextOpen = conn->nextOpen;
+    } else {
+        loop->open = conn->nextOpen;
     }
-
-    int gai = getaddrinfo(NULL, portnum, &hints, &res);
-    if (gai != 0) {
-        return -1;
+    if (conn->nextOpen) {
+        conn->nextOpen->prevOpen = conn->prevOpen;
     }
-
-    // Try each address until one works
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        listenFd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (listenFd == -1) {
-            continue;
-        }
-        // Allow reuse after close
-        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
-        if (bind(listenFd, rp->ai_addr, rp->ai_addrlen) == 0) {
-            break; // Success
-        }
-        close(listenFd);
-        listenFd = -1;
+    if (conn->current && conn->current->items) {
+        release_batch_ref(conn->current); // Freed once its items finish
+    } else {
+        free_job(conn->current);
     }
-    freeaddrinfo(res);
-
-    if (listenFd == -1) {
-        return -1;
+    conn->current = NULL;
+    while (conn->spareJobs) {
+        ComputeJob* next = conn->spareJobs->next;
+        free_job(conn->spareJobs);
+        conn->spareJobs = next;
     }
-
-    if (listen(listenFd, SOMAXCONN) != 0) {
-        close(listenFd);
-        return -1;
+    for (int i = 0; i < MAX_SESSION_FACES; i++) {
+        release_session_face(conn->sessionFaces[i]);
+        conn->sessionFaces[i] = NULL;
     }
-    return listenFd;
+    free_output(&conn->output);
+    conn->closed = true;
+    if (conn->inFlight == 0) {
+        conn->nextClosed = loop->closed;
+        loop->closed = conn;
+    }
+    decrement_thread_counts(loop->shared);
+    release_socket_slot(loop);
 }
 
-/* print_port_number()
- * -------------------
- * Retrieves and prints the actual port number that the server is listening
- * on to stderr. Used to report ephemeral port assignments.
+/* free_closed_connections()
+ * -------------------------
+ * Frees every connection closed while handling the last batch of events.
  *
- * listenFd: file descriptor of the listening socket
+ * loop: event loop holding the list of closed connections
  *
  * Returns: void
  */
-void print_port_number(int listenFd)
+void free_closed_connections(EventLoop* loop)
 {
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    if (getsockname(listenFd, (struct sockaddr*)&addr, &addrlen) == 0) {
-        fprintf(stderr, "%u\n", ntohs(addr.sin_port));
-        fflush(stderr);
+    while (loop->closed) {
+        Connection* next = loop->closed->nextClosed;
+        free(loop->closed);
+        loop->closed = next;
     }
 }
 
-/* usage_error()
- * -------------
- * Prints the correct usage message to stderr and exits the program
- * with usage error status code.
+/* service_connection()
+ * --------------------
+ * Makes as much progress on a connection as the socket allows without
+ * blocking: flushes pending output, then parses request bytes until a
+ * complete request has been dispatched or the socket has no more data.
+ * Reading pauses while output is pending so a client that never reads its
+ * responses cannot make the server buffer without limit. Reading also
+ * pauses while an untagged request is processed, while a pipelining
+ * client has MAX_PIPELINED_REQUESTS jobs running, or while one of the
+ * connection's jobs is parked waiting for room in the compute pool.
  *
- * Returns: does not return (exits program)
+ * conn: connection to service
+ *
+ * Returns: void
  */
-void usage_error(void)
+void service_connection(Connection* conn)
+{
+    while (!conn->closed) {
+        if (conn->output.head || conn->state == CLOSING) {
+            if (!flush_output(conn)) {
+                return; // Still pending, or connection closed
+            }
+            continue;
+        }
+        if (conn->state == PROCESSING
+                || conn->inFlight >= MAX_PIPELINED_REQUESTS) {
+            return; // Resumed by handle_completed_jobs()
+        }
+        if (conn->parkedJobs) {
+            return; // Resumed by submit_parked_jobs()
+        }
+        if (conn->inputStart < conn->inputEnd) {
+            consume_input(conn);
+            continue;
+        }
+        ssize_t received = receive_input(conn);
+        if (received > 0) {
+            continue;
+        }
+        if (received == 0) {
+            handle_client_eof(conn);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            close_connection(conn);
+        }
+        return;
+    }
+}
+
+/* receive_input()
+ * ---------------
+ * Reads available bytes from a client. Image payloads are read directly into
+ * the image buffer; header fields are read into the connection's small input
+ * buffer, which consume_input() then parses.
+ *
+ * conn: connection to read from (its input buffer must be empty)
+ *
+ * Returns: number of bytes read, 0 on end of file, or -1 with errno set
+ */
+ssize_t receive_input(Connection* conn)
+{
+    if (receiving_image(conn)) {
+        ImageBuffer* target = current_image(conn);
+        ssize_t received = read(conn->fd, target->data + conn->imageFill,
+                target->size - conn->imageFill);
+        if (received > 0) {
+            conn->lastActivityNs = monotonic_ns();
+            conn->imageFill += received;
+            if (conn->imageFill == target->size) {
+                image_received(conn);
+            }
+        }
+        return received;
+    }
+    ssize_t received = read(conn->fd, conn->input, BUFFER_SIZE);
+    if (received > 0) {
+        conn->lastActivityNs = monotonic_ns();
+        conn->inputStart = 0;
+        conn->inputEnd = received;
+    }
+    return received;
+}
+
+/* consume_input()
+ * ---------------
+ * Parses buffered input bytes according to the connection's state, filling
+ * in the current header field or image payload.
+ *
+ * conn: connection with unparsed bytes in its input buffer
+ *
+ * Returns: void
+ */
+void consume_input(Connection* conn)
+{
+    uint8_t* data = conn->input + conn->inputStart;
+    size_t available = conn->inputEnd - conn->inputStart;
+    if (conn->state == DISCARD_IMAGE) {
+        size_t used = conn->discardLeft < available ? conn->discardLeft
+                                                    : available;
+        conn->discardLeft -= used;
+        conn->inputStart += used;
+        if (conn->discardLeft == 0) {
+            image_discarded(conn);
+        }
+        return;
+    }
+    if (receiving_image(conn)) {
+        ImageBuffer* target = current_image(conn);
+        size_t used = target->size - conn->imageFill;
+        if (used > available) {
+            used = available;
+        }
+        memcpy(target->data + conn->imageFill, data, used);
+        conn->imageFill += used;
+        conn->inputStart += used;
+        if (conn->imageFill == target->size) {
+            image_received(conn);
+        }
+        return;
+    }
+    if (conn->state == READ_PREFIX && conn->fieldFill == 0) {
+        conn->requestStartNs = monotonic_ns();
+    }
+    size_t fieldLength = UINT32_NUM_BYTES; // Sizes, IDs, handles, deadlines
+    if (conn->state == READ_OP_TYPE) {
+        fieldLength = 1;
+    } else if (conn->state == READ_ENCODING) {
+        fieldLength = ENCODING_OPTIONS_SIZE;
+    }
+    size_t used = fieldLength - conn->fieldFill;
+    if (used > available) {
+        used = available;
+    }
+    memcpy(conn->field + conn->fieldFill, data, used);
+    conn->fieldFill += used;
+    conn->inputStart += used;
+    if (conn->fieldFill == fieldLength) {
+        conn->fieldFill = 0;
+        field_received(conn);
+    }
+}
+
+/* field_received()
+ * ----------------
+ * Validates a complete header field (prefix, request ID, operation type,
+ * encoding options, deadline, batch size, image size or face handle) and
+ * moves the
+ * connection on to the next part of the request. A wrong prefix is answered
+ * with the response file and an invalid batch size with an error, and the
+ * connection is closed; other protocol errors are reported and the next
+ * request is read.
+ *
+ * conn: connection whose current field has been fully received
+ *
+ * Returns: void
+ */
+void field_received(Connection* conn)
+{
+    uint32_t value = decode_uint32_le(conn->field);
+    uint32_t maxImageSize = conn->loop->params->maxsize;
+    ErrorKind error;
+    switch (conn->state) {
+    case READ_PREFIX:
+        if (value != PROTOCOL_PREFIX && value != PROTOCOL_PREFIX_V2) {
+            queue_responsefile(conn);
+            conn->state = CLOSING;
+        } else {
+            conn->tag.tagged = value == PROTOCOL_PREFIX_V2;
+            conn->tag.id = 0;
+            conn->encoding.format = FORMAT_JPEG;
+            conn->encoding.level = ENCODING_DEFAULT_LEVEL;
+            conn->deadlineNs = 0;
+            conn->state = conn->tag.tagged ? READ_REQUEST_ID : READ_OP_TYPE;
+        }
+        break;
+    case READ_REQUEST_ID:
+        conn->tag.id = value;
+        conn->state = READ_OP_TYPE;
+        break;
+    case READ_OP_TYPE:
+        op_type_received(conn);
+        break;
+    case READ_ENCODING:
+        encoding_received(conn);
+        break;
+    case READ_DEADLINE:
+        if (value != 0) { // 0 is no deadline
+            conn->deadlineNs
+                    = conn->requestStartNs + (uint64_t)value * NS_PER_MS;
+        }
+        next_header_field(conn);
+        break;
+    case READ_BATCH_SIZE:
+        if (value == 0 || value > MAX_BATCH_ITEMS) {
+            // The batch's body cannot be skipped without its size, so the
+            // connection is closed once the error has been sent
+            queue_protocol_error(conn, &conn->tag, ERROR_INVALID_BATCH_SIZE);
+            conn->state = CLOSING;
+        } else {
+            start_batch(conn, value);
+        }
+        break;
+    case READ_ITEM_SIZE:
+        start_batch_item(conn, value);
+        break;
+    case READ_IMAGE_SIZE:
+        if (value == 0) {
+            queue_protocol_error(conn, &conn->tag, ERROR_IMAGE_ZERO_BYTES);
+            conn->state = READ_PREFIX;
+        } else if (maxImageSize != 0 && value > maxImageSize) {
+            queue_protocol_error(conn, &conn->tag, ERROR_IMAGE_TOO_LARGE);
+            conn->state = READ_PREFIX;
+        } else if (!admit_request(conn, value)) {
+            shed_request(conn, value);
+        } else if (!(conn->current = take_job(conn))) {
+            retire_request(conn->loop->shared, value);
+            close_connection(conn);
+        } else {
+            conn->current->admittedBytes = value;
+            conn->current->opType = conn->opType;
+            conn->current->tag = conn->tag;
+            conn->current->encoding = conn->encoding;
+            conn->current->deadlineNs = conn->deadlineNs;
+            start_image(conn, &conn->current->image, value, READ_IMAGE);
+        }
+        break;
+    case READ_FACE_SIZE:
+        if (!conn->current) { // Request is being shed
+            discard_image(conn, value, READ_PREFIX);
+        } else if (!admit_face(conn, value, &error)) {
+            refuse_face(conn, value, error);
+        } else {
+            start_image(conn, &conn->current->face, value, READ_FACE);
+        }
+        break;
+    case READ_FACE_HANDLE:
+        if (conn->current) {
+            face_handle_received(conn, value);
+        } else {
+            conn->state = READ_PREFIX; // Request was shed
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* op_type_received()
+ * ------------------
+ * Handles the operation type of a request. Statistics are answered at once;
+ * other valid operations go on to read their encoding options and deadline
+ * (if the OP_FLAG_ENCODING and OP_FLAG_DEADLINE bits are set) and then
+ * their payload.
+ *
+ * conn: connection whose operation type has been received
+ *
+ * Returns: void
+ */
+void op_type_received(Connection* conn)
+{
+    unsigned char flags
+            = conn->field[0] & (OP_FLAG_ENCODING | OP_FLAG_DEADLINE);
+    unsigned char opType = conn->field[0] & ~flags;
+    if (conn->field[0] == OP_STATS) {
+        record_request(OP_STATS);
+        queue_stats_response(conn);
+        conn->state = READ_PREFIX;
+    } else if (opType != OP_FACE_DETECT && opType != OP_FACE_REPLACE
+            && opType != OP_BATCH && opType != OP_REPLACE_BY_HANDLE
+            && (opType != OP_UPLOAD_FACE || flags)) {
+        queue_protocol_error(conn, &conn->tag, ERROR_INVALID_OP_TYPE);
+        conn->state = READ_PREFIX;
+    } else {
+        record_request(opType);
+        conn->opType = opType;
+        conn->opFlags = flags;
+        next_header_field(conn);
+    }
+}
+
+/* encoding_received()
+ * -------------------
+ * Validates the encoding options of a request: an OutputFormat byte and a
+ * level byte (JPEG or WebP quality 0 to 100, PNG compression 0 to 9, or
+ * ENCODING_DEFAULT_LEVEL for the encoder's default).
+ *
+ * conn: connection whose encoding options have been received
+ *
+ * Returns: void
+ */
+void encoding_received(Connection* conn)
+{
+    unsigned char format = conn->field[0];
+    unsigned char level = conn->field[1];
+    if (format >= FORMAT_COUNT
+            || (level != ENCODING_DEFAULT_LEVEL
+                    && level > encodingMaxLevels[format])) {
+        queue_protocol_error(conn, &conn->tag, ERROR_INVALID_ENCODING);
+        conn->state = READ_PREFIX;
+        return;
+    }
+    conn->encoding.format = format;
+    conn->encoding.level = level;
+    next_header_field(conn);
+}
+
+/* next_header_field()
+ * -------------------
+ * Moves a connection on to the next optional header field its request's
+ * operation type flags announced, or to the request's payload once they
+ * have all been read.
+ *
+ * conn: connection reading a request header
+ *
+ * Returns: void
+ */
+void next_header_field(Connection* conn)
+{
+    if (conn->opFlags & OP_FLAG_ENCODING) {
+        conn->opFlags &= ~OP_FLAG_ENCODING;
+        conn->state = READ_ENCODING;
+    } else if (conn->opFlags & OP_FLAG_DEADLINE) {
+        conn->opFlags &= ~OP_FLAG_DEADLINE;
+        conn->state = READ_DEADLINE;
+    } else {
+        conn->state = conn->opType == OP_BATCH ? READ_BATCH_SIZE
+                                               : READ_IMAGE_SIZE;
+    }
+}
+
+/* deadline_passed()
+ * -----------------
+ * Checks whether a request's deadline has passed.
+ *
+ * deadlineNs: monotonic_ns() time of the deadline, or 0 for none
+ *
+ * Returns: true if the deadline has passed, false otherwise
+ */
+bool deadline_passed(uint64_t deadlineNs)
+{
+    return deadlineNs && monotonic_ns() >= deadlineNs;
+}
+
+/* face_handle_received()
+ * ----------------------
+ * Completes an OP_REPLACE_BY_HANDLE request by looking up the session face
+ * it refers to. The request then proceeds exactly like an OP_FACE_REPLACE
+ * request carrying the same face, sharing its cached output.
+ *
+ * conn: connection whose face handle has been received
+ * handle: face handle sent by the client
+ *
+ * Returns: void
+ */
+void face_handle_received(Connection* conn, uint32_t handle)
+{
+    SessionFace* face
+            = handle ? conn->sessionFaces[(handle - 1) % MAX_SESSION_FACES]
+                     : NULL;
+    if (!face || face->handle != handle) {
+        queue_protocol_error(conn, &conn->tag, ERROR_UNKNOWN_FACE_HANDLE);
+        recycle_job(conn, conn->current);
+        conn->current = NULL;
+        conn->state = READ_PREFIX;
+        return;
+    }
+    face->refCount++;
+    conn->current->sessionFace = face;
+    conn->current->faceKey = face->key;
+    conn->current->opType = OP_FACE_REPLACE;
+    request_received(conn);
+}
+
+/* face_uploaded()
+ * ---------------
+ * Completes an OP_UPLOAD_FACE request. The image buffer is handed over to a
+ * new session face and an OP_FACE_HANDLE response carries its handle. Each
+ * connection keeps its MAX_SESSION_FACES most recent uploads; an older
+ * handle stops being valid once its slot is reused.
+ *
+ * conn: connection whose uploaded face has been received
+ *
+ * Returns: void (closes the connection if memory cannot be allocated)
+ */
+void face_uploaded(Connection* conn)
+{
+    ComputeJob* job = conn->current;
+    SessionFace* face = calloc(1, sizeof(SessionFace));
+    conn->current = NULL;
+    if (!face) {
+        free_job(job);
+        close_connection(conn);
+        return;
+    }
+    record_stage_time(STAGE_RECEIVE, conn->requestStartNs);
+    face->image = job->image;
+    memset(&job->image, 0, sizeof(ImageBuffer));
+    face->key = hash_bytes(face->image.data, face->image.size);
+    if (++conn->lastFaceHandle == 0) {
+        conn->lastFaceHandle = 1; // 0 is never a valid handle
+    }
+    face->handle = conn->lastFaceHandle;
+    face->refCount = 1;
+    SessionFace** slot
+            = &conn->sessionFaces[(face->handle - 1) % MAX_SESSION_FACES];
+    release_session_face(*slot);
+    *slot = face;
+    recycle_job(conn, job);
+
+    unsigned char handle[UINT32_NUM_BYTES];
+    encode_uint32_le(face->handle, handle);
+    queue_protocol_message(
+            conn, &conn->tag, OP_FACE_HANDLE, handle, UINT32_NUM_BYTES);
+    conn->state = READ_PREFIX;
+}
+
+/* release_session_face()
+ * ----------------------
+ * Drops a reference to a session face, freeing it when none remain.
+ *
+ * face: session face (may be NULL)
+ *
+ * Returns: void
+ */
+void release_session_face(SessionFace* face)
+{
+    if (face && --face->refCount == 0) {
+        free_image_buffer(&face->image);
+        free(face);
+    }
+}
+
+/* admit_request()
+ * ---------------
+ * Admission control, applied before an image is received. A request is
+ * refused if the server already has --maxqueued requests queued or running,
+ * or if its image would take the bytes held by such requests over
+ * --maxinflight (an image larger than that is still admitted when nothing
+ * else is in flight). Admitted requests hold their share until
+ * retire_request() is called as their job is released.
+ *
+ * conn: connection the request arrived on
+ * size: size of the request's image in bytes
+ *
+ * Returns: true if the request is admitted
+ */
+bool admit_request(Connection* conn, uint64_t size)
+{
+    SharedState* shared = conn->loop->shared;
+    CmdLineParams* params = conn->loop->params;
+    unsigned int queued
+            = __atomic_add_fetch(&shared->queuedRequests, 1, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_add_fetch(
+            &shared->inFlightBytes, size, __ATOMIC_RELAXED);
+    if ((params->maxqueued && queued > params->maxqueued)
+            || (params->maxinflight && bytes > params->maxinflight
+                    && bytes != size)) {
+        retire_request(shared, size);
+        return false;
+    }
+    return true;
+}
+
+/* admit_face()
+ * ------------
+ * Admission control for a replacement face, applied before it is received.
+ * The face belongs to a request or batch that is already under way, so it
+ * is not another queued request, but it must be within --maxsize and its
+ * bytes are held in flight along with the request's, subject to the same
+ * --maxinflight limit as admit_request() applies.
+ *
+ * conn: connection receiving the request (or batch) the face belongs to
+ * size: size of the face in bytes
+ * error: set to the error to report if the face is refused
+ *
+ * Returns: true if the face is admitted
+ */
+bool admit_face(Connection* conn, uint32_t size, ErrorKind* error)
+{
+    SharedState* shared = conn->loop->shared;
+    CmdLineParams* params = conn->loop->params;
+    ComputeJob* job = conn->current;
+    if (params->maxsize && size > params->maxsize) {
+        *error = ERROR_IMAGE_TOO_LARGE;
+        return false;
+    }
+    uint64_t bytes = __atomic_add_fetch(
+            &shared->inFlightBytes, size, __ATOMIC_RELAXED);
+    if (params->maxinflight && bytes > params->maxinflight
+            && bytes != job->admittedBytes + size) {
+        __atomic_sub_fetch(&shared->inFlightBytes, size, __ATOMIC_RELAXED);
+        *error = ERROR_SERVER_BUSY;
+        return false;
+    }
+    job->admittedBytes += size;
+    return true;
+}
+
+/* retire_request()
+ * ----------------
+ * Releases the admission control share held by a request.
+ *
+ * shared: shared server state
+ * size: bytes admitted for the request
+ *
+ * Returns: void
+ */
+void retire_request(SharedState* shared, uint64_t size)
+{
+    __atomic_sub_fetch(&shared->queuedRequests, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&shared->inFlightBytes, size, __ATOMIC_RELAXED);
+}
+
+/* shed_request()
+ * --------------
+ * Refuses a request that admission control turned away. The "server busy"
+ * error is queued straight away, before any of the image has been
+ * received, and the rest of the request is read and discarded so that the
+ * client can carry on using the connection.
+ *
+ * conn: connection the request arrived on
+ * size: size of the request's image in bytes
+ *
+ * Returns: void
+ */
+void shed_request(Connection* conn, uint32_t size)
+{
+    queue_protocol_error(conn, &conn->tag, ERROR_SERVER_BUSY);
+    ConnectionState next = READ_PREFIX;
+    if (conn->opType == OP_FACE_REPLACE) {
+        next = READ_FACE_SIZE;
+    } else if (conn->opType == OP_REPLACE_BY_HANDLE) {
+        next = READ_FACE_HANDLE;
+    }
+    discard_image(conn, size, next);
+}
+
+/* refuse_face()
+ * -------------
+ * Refuses a replacement face that admission control turned away, reading
+ * and discarding its bytes so that the client can carry on using the
+ * connection. A replace request is answered with the error straight away.
+ * The rest of a batch is still read, but each of its items is answered with
+ * the error.
+ *
+ * conn: connection receiving the request (or batch) the face belongs to
+ * size: size of the face in bytes
+ * error: reason the face was refused
+ *
+ * Returns: void
+ */
+void refuse_face(Connection* conn, uint32_t size, ErrorKind error)
+{
+    ComputeJob* job = conn->current;
+    if (job->opType == OP_BATCH) {
+        job->result = OPENCV_INVALID_IMAGE;
+        job->error = error;
+        discard_image(conn, size, READ_ITEM_SIZE);
+        return;
+    }
+    queue_protocol_error(conn, &job->tag, error);
+    recycle_job(conn, job);
+    conn->current = NULL;
+    discard_image(conn, size, READ_PREFIX);
+}
+
+/* discard_image()
+ * ---------------
+ * Skips over an image payload without storing it.
+ *
+ * conn: connection to read from
+ * size: size of the image in bytes
+ * next: state to move to once the image has been skipped
+ *
+ * Returns: void
+ */
+void discard_image(Connection* conn, uint32_t size, ConnectionState next)
+{
+    conn->discardLeft = size;
+    conn->afterDiscard = next;
+    conn->state = DISCARD_IMAGE;
+    if (size == 0) {
+        image_discarded(conn);
+    }
+}
+
+/* image_discarded()
+ * -----------------
+ * Moves a connection on once a discarded image has been skipped.
+ *
+ * conn: connection that has skipped an image
+ *
+ * Returns: void
+ */
+void image_discarded(Connection* conn)
+{
+    if (conn->afterDiscard == READ_ITEM_SIZE) {
+        next_batch_item(conn);
+    } else {
+        conn->state = conn->afterDiscard;
+    }
+}
+
+/* start_image()
+ * -------------
+ * Makes room in the connection's buffer for an incoming image payload and
+ * switches the connection to reading it.
+ *
+ * conn: connection receiving the image
+ * image: buffer to receive into
+ * size: size of the image in bytes
+ * state: READ_IMAGE or READ_FACE
+ *
+ * Returns: void (closes the connection if memory cannot be allocated)
+ */
+void start_image(Connection* conn, ImageBuffer* image, uint32_t size,
+        ConnectionState state)
+{
+    if (!reserve_image_buffer(image, size, conn->loop->params->maxsize)) {
+        close_connection(conn);
+        return;
+    }
+    image->size = size;
+    conn->imageFill = 0;
+    conn->state = state;
+    if (size == 0) {
+        image_received(conn);
+    }
+}
+
+/* reserve_image_buffer()
+ * ----------------------
+ * Ensures an image buffer can hold size bytes. Buffers are kept between
+ * requests, so a connection sending similar images allocates only once. A
+ * buffer that must grow at least doubles, but never beyond the maxsize
+ * limit. Existing contents are not preserved.
+ *
+ * image: buffer to grow
+ * size: number of bytes needed
+ * limit: largest image the server accepts (0 for no limit)
+ *
+ * Returns: true on success, false if memory could not be allocated
+ */
+bool reserve_image_buffer(ImageBuffer* image, uint32_t size, uint32_t limit)
+{
+    if (image->data && image->capacity >= size) {
+        return true;
+    }
+    uint64_t capacity = (uint64_t)image->capacity * 2;
+    if (limit != 0 && capacity > limit) {
+        capacity = limit;
+    }
+    if (capacity < size) {
+        capacity = size;
+    }
+    free(image->data);
+    image->data = malloc(capacity ? capacity : 1);
+    image->capacity = image->data ? capacity : 0;
+    return image->data != NULL;
+}
+
+/* trim_image_buffer()
+ * -------------------
+ * Called when a request has finished with an image buffer. A connection
+ * that has gone idle gives back any buffer larger than IDLE_BUFFER_LIMIT.
+ * Otherwise, every BUFFER_TRIM_INTERVAL requests the buffer is shrunk to
+ * the largest image seen in that interval if it is more than twice that
+ * size, so one huge upload does not pin memory for the life of the
+ * connection.
+ *
+ * image: buffer to trim
+ * idle: whether the connection has no further request data waiting
+ *
+ * Returns: void
+ */
+void trim_image_buffer(ImageBuffer* image, bool idle)
+{
+    if (image->size > image->peak) {
+        image->peak = image->size;
+    }
+    image->size = 0;
+    if (idle && image->capacity > IDLE_BUFFER_LIMIT) {
+        free_image_buffer(image);
+        return;
+    }
+    if (++image->uses < BUFFER_TRIM_INTERVAL) {
+        return;
+    }
+    if (image->capacity > 2 * (uint64_t)image->peak) {
+        free(image->data);
+        image->data = image->peak ? malloc(image->peak) : NULL;
+        image->capacity = image->data ? image->peak : 0;
+    }
+    image->peak = 0;
+    image->uses = 0;
+}
+
+/* free_image_buffer()
+ * -------------------
+ * Frees an image buffer's memory and resets it to empty.
+ *
+ * image: buffer to free
+ *
+ * Returns: void
+ */
+void free_image_buffer(ImageBuffer* image)
+{
+    free(image->data);
+    memset(image, 0, sizeof(ImageBuffer));
+}
+
+/* current_image()
+ * ---------------
+ * Returns the image buffer currently being received on a connection.
+ *
+ * conn: connection in the READ_IMAGE, READ_FACE or READ_ITEM state
+ *
+ * Returns: pointer to the detect, replacement or batch item image buffer
+ */
+ImageBuffer* current_image(Connection* conn)
+{
+    ComputeJob* job = conn->current;
+    if (conn->state == READ_ITEM) {
+        return &job->items[job->itemCount - 1]->image;
+    }
+    return conn->state == READ_FACE ? &job->face : &job->image;
+}
+
+/* receiving_image()
+ * -----------------
+ * Determines whether a connection is part way through an image payload.
+ *
+ * conn: connection to check
+ *
+ * Returns: true if the connection is reading image bytes
+ */
+bool receiving_image(const Connection* conn)
+{
+    return conn->state == READ_IMAGE || conn->state == READ_FACE
+            || conn->state == READ_ITEM;
+}
+
+/* image_received()
+ * ----------------
+ * Called once an image payload is complete. Moves on to the rest of the
+ * request (replacement face or face handle) or completes it.
+ *
+ * conn: connection whose current image has been fully received
+ *
+ * Returns: void
+ */
+void image_received(Connection* conn)
+{
+    ComputeJob* job = conn->current;
+    if (job->opType == OP_BATCH) {
+        batch_image_received(conn);
+    } else if (job->opType == OP_UPLOAD_FACE) {
+        face_uploaded(conn);
+    } else if (conn->state == READ_IMAGE && job->opType == OP_FACE_REPLACE) {
+        conn->state = READ_FACE_SIZE;
+    } else if (job->opType == OP_REPLACE_BY_HANDLE) {
+        conn->state = READ_FACE_HANDLE;
+    } else {
+        if (job->opType == OP_FACE_REPLACE) {
+            job->faceKey = hash_bytes(job->face.data, job->face.size);
+        }
+        request_received(conn);
+    }
+}
+
+/* request_received()
+ * ------------------
+ * Called once a detect or replace request is complete. Either answers it
+ * from the output cache, reports that its deadline has already passed or
+ * dispatches it to the compute pool.
+ *
+ * conn: connection whose current request has been fully received
+ *
+ * Returns: void
+ */
+void request_received(Connection* conn)
+{
+    ComputeJob* job = conn->current;
+    record_stage_time(STAGE_RECEIVE, conn->requestStartNs);
+    conn->current = NULL;
+    job->imageKey = hash_bytes(job->image.data, job->image.size);
+    job->outputKey = output_cache_key(job,
+            __atomic_load_n(&conn->loop->shared->cascadeGeneration,
+                    __ATOMIC_RELAXED));
+    if (queue_cached_response(conn, job)) {
+        recycle_job(conn, job);
+        conn->state = READ_PREFIX;
+        return;
+    }
+    if (deadline_passed(job->deadlineNs)) {
+        queue_protocol_error(conn, &job->tag, ERROR_DEADLINE_EXCEEDED);
+        recycle_job(conn, job);
+        conn->state = READ_PREFIX;
+        return;
+    }
+    dispatch_job(conn, job);
+}
+
+/* start_batch()
+ * -------------
+ * Starts receiving an OP_BATCH request. After the batch size comes a
+ * replacement face (size then bytes, where a size of 0 means the items are
+ * only searched for faces), followed by each item's size and image bytes.
+ * The batch counts as one request in flight until its response is queued.
+ *
+ * conn: connection the request arrived on
+ * batchSize: number of images in the batch
+ *
+ * Returns: void (closes the connection if memory cannot be allocated)
+ */
+void start_batch(Connection* conn, uint32_t batchSize)
+{
+    ComputeJob* batch = take_job(conn);
+    ComputeJob** items = calloc(batchSize, sizeof(ComputeJob*));
+    if (!batch || !items) {
+        free_job(batch);
+        free(items);
+        close_connection(conn);
+        return;
+    }
+    batch->opType = OP_BATCH;
+    batch->tag = conn->tag;
+    batch->encoding = conn->encoding;
+    batch->deadlineNs = conn->deadlineNs;
+    batch->items = items;
+    batch->batchSize = batchSize;
+    batch->pending = 1; // Released once every item has been received
+    conn->current = batch;
+    conn->inFlight++;
+    conn->loop->inFlight++;
+    conn->state = READ_FACE_SIZE;
+}
+
+/* start_batch_item()
+ * ------------------
+ * Starts receiving the next image of a batch. Items that are empty, larger
+ * than the maximum image size or refused by admission control, and every
+ * item of a batch whose face was refused, get an error in the batch
+ * response (their bytes are read and discarded) and the rest of the batch
+ * carries on.
+ *
+ * conn: connection receiving the batch
+ * size: size of the item's image in bytes
+ *
+ * Returns: void (closes the connection if memory cannot be allocated)
+ */
+void start_batch_item(Connection* conn, uint32_t size)
+{
+    ComputeJob* batch = conn->current;
+    uint32_t maxImageSize = conn->loop->params->maxsize;
+    ComputeJob* item = calloc(1, sizeof(ComputeJob));
+    if (!item) {
+        close_connection(conn);
+        return;
+    }
+    item->conn = conn;
+    item->batch = batch;
+    item->opType = batch->face.size ? OP_FACE_REPLACE : OP_FACE_DETECT;
+    item->encoding = batch->encoding;
+    item->deadlineNs = batch->deadlineNs;
+    batch->items[batch->itemCount++] = item;
+    if (batch->result != OPENCV_SUCCESS || size == 0
+            || (maxImageSize != 0 && size > maxImageSize)
+            || !admit_request(conn, size)) {
+        item->result = OPENCV_INVALID_IMAGE;
+        item->error = ERROR_SERVER_BUSY;
+        if (batch->result != OPENCV_SUCCESS) {
+            item->error = batch->error;
+        } else if (size == 0) {
+            item->error = ERROR_IMAGE_ZERO_BYTES;
+        } else if (maxImageSize != 0 && size > maxImageSize) {
+            item->error = ERROR_IMAGE_TOO_LARGE;
+        }
+        discard_image(conn, size, READ_ITEM_SIZE);
+        return;
+    }
+    item->admittedBytes = size;
+    start_image(conn, &item->image, size, READ_ITEM);
+}
+
+/* batch_image_received()
+ * ----------------------
+ * Handles a complete image within a batch. Once the face has arrived its
+ * hash is kept for the items' cache keys. Each item is answered from the
+ * output cache if possible and otherwise submitted to the compute pool
+ * straight away, so items are processed while the rest are received. An
+ * item that finds the pool's queue full is parked like any other job, and
+ * the rest of the batch is not read until it has been queued. Items
+ * received after the batch's deadline are not run.
+ *
+ * conn: connection receiving the batch
+ *
+ * Returns: void
+ */
+void batch_image_received(Connection* conn)
+{
+    ComputeJob* batch = conn->current;
+    if (conn->state == READ_FACE) {
+        if (batch->face.size > 0) {
+            batch->faceKey = hash_bytes(batch->face.data, batch->face.size);
+        }
+        conn->state = READ_ITEM_SIZE;
+        return;
+    }
+    ComputeJob* item = batch->items[batch->itemCount - 1];
+    item->imageKey = hash_bytes(item->image.data, item->image.size);
+    item->faceKey = batch->faceKey;
+    item->outputKey = output_cache_key(item,
+            __atomic_load_n(&conn->loop->shared->cascadeGeneration,
+                    __ATOMIC_RELAXED));
+    item->cached
+            = lru_cache_get(conn->loop->shared->outputCache, item->outputKey);
+    if (item->cached) {
+        item->result = OPENCV_SUCCESS;
+    } else if (deadline_passed(item->deadlineNs)) {
+        item->result = OPENCV_DEADLINE_EXCEEDED;
+        item->error = ERROR_DEADLINE_EXCEEDED;
+    } else {
+        __atomic_add_fetch(&batch->pending, 1, __ATOMIC_RELAXED);
+        submit_job(conn, item);
+    }
+    next_batch_item(conn);
+}
+
+/* next_batch_item()
+ * -----------------
+ * Moves a connection on to the next item of the batch it is receiving, or
+ * finishes receiving the batch after its last item. As with other requests,
+ * a tagged batch lets the connection read on while its items run.
+ *
+ * conn: connection receiving the batch
+ *
+ * Returns: void
+ */
+void next_batch_item(Connection* conn)
+{
+    ComputeJob* batch = conn->current;
+    if (batch->itemCount < batch->batchSize) {
+        conn->state = READ_ITEM_SIZE;
+        return;
+    }
+    record_stage_time(STAGE_RECEIVE, conn->requestStartNs);
+    conn->current = NULL;
+    conn->state = batch->tag.tagged ? READ_PREFIX : PROCESSING;
+    release_batch_ref(batch);
+}
+
+/* release_batch_ref()
+ * -------------------
+ * Drops one reference to a batch: either the event loop's (held while the
+ * batch is being received) or that of an item which has finished running.
+ * The last reference hands the batch back to its event loop.
+ *
+ * batch: batch job
+ *
+ * Returns: void
+ */
+void release_batch_ref(ComputeJob* batch)
+{
+    if (__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        complete_job(batch);
+    }
+}
+
+/* dispatch_job()
+ * --------------
+ * Submits a fully received request to the compute pool. A tagged (version
+ * 2) request lets the connection carry on reading the next request at once
+ * (unless the job has to be parked); an untagged request pauses reading
+ * until its response has been queued.
+ *
+ * conn: connection the request arrived on
+ * job: job holding the request
+ *
+ * Returns: void
+ */
+void dispatch_job(Connection* conn, ComputeJob* job)
+{
+    conn->inFlight++;
+    conn->loop->inFlight++;
+    conn->state = job->tag.tagged ? READ_PREFIX : PROCESSING;
+    submit_job(conn, job);
+}
+
+/* submit_job()
+ * ------------
+ * Queues a job on the compute pool without blocking the event loop. If the
+ * pool's queue is full, or other jobs are already parked ahead of it, the
+ * job is parked on the loop's list instead and its connection stops reading
+ * until submit_parked_jobs() has queued it.
+ *
+ * conn: connection the job's request arrived on
+ * job: job to run
+ *
+ * Returns: void
+ */
+void submit_job(Connection* conn, ComputeJob* job)
+{
+    EventLoop* loop = conn->loop;
+    WorkPool* pool = loop->shared->computePool;
+    if (!loop->parked && try_submit_task(pool, run_compute_job, job)) {
+        return;
+    }
+    job->next = NULL;
+    if (loop->parked) {
+        loop->parkedTail->next = job;
+    } else {
+        loop->parked = job;
+    }
+    loop->parkedTail = job;
+    conn->parkedJobs++;
+}
+
+/* submit_parked_jobs()
+ * --------------------
+ * Queues as many of an event loop's parked jobs on the compute pool as it
+ * has room for, oldest first, and resumes reading from each connection
+ * that no longer has a job parked. The loop asks to be woken before trying,
+ * so that room made after a failed attempt is not missed.
+ *
+ * loop: event loop whose parked jobs should be retried
+ *
+ * Returns: void
+ */
+void submit_parked_jobs(EventLoop* loop)
+{
+    if (!loop->parked) {
+        return;
+    }
+    WorkPool* pool = loop->shared->computePool;
+    __atomic_store_n(&loop->roomWanted, true, __ATOMIC_SEQ_CST);
+    while (loop->parked) {
+        ComputeJob* job = loop->parked;
+        ComputeJob* next = job->next; // A worker may reuse it once queued
+        Connection* conn = job->conn;
+        if (!try_submit_task(pool, run_compute_job, job)) {
+            return;
+        }
+        loop->parked = next;
+        if (--conn->parkedJobs == 0 && !conn->closed) {
+            service_connection(conn);
+        }
+    }
+    __atomic_store_n(&loop->roomWanted, false, __ATOMIC_SEQ_CST);
+}
+
+/* compute_room_freed()
+ * --------------------
+ * Compute pool room hook, called by a worker that has just taken a task from
+ * the full queue. Wakes each event loop waiting for room so it can queue its
+ * parked jobs.
+ *
+ * arg: pointer to the server's SharedState
+ *
+ * Returns: void
+ */
+void compute_room_freed(void* arg)
+{
+    SharedState* shared = (SharedState*)arg;
+    for (int i = 0; i < shared->loopCount; i++) {
+        EventLoop* loop = &shared->loops[i];
+        if (__atomic_exchange_n(&loop->roomWanted, false, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            if (write(loop->wakeFd, &one, sizeof(one)) == -1) {
+                // Counter is already non-zero; the loop has a wakeup pending
+            }
+        }
+    }
+}
+
+/* take_job()
+ * ----------
+ * Gets a job for a new request on a connection, reusing a finished job (and
+ * its image buffers) when one is available.
+ *
+ * conn: connection the request arrived on
+ *
+ * Returns: an empty job, or NULL if memory could not be allocated
+ */
+ComputeJob* take_job(Connection* conn)
+{
+    ComputeJob* job = conn->spareJobs;
+    if (job) {
+        conn->spareJobs = job->next;
+        job->next = NULL;
+    } else {
+        job = calloc(1, sizeof(ComputeJob));
+    }
+    if (job) {
+        job->conn = conn;
+    }
+    return job;
+}
+
+/* recycle_job()
+ * -------------
+ * Resets a finished job and keeps it on the connection for the next request.
+ *
+ * conn: connection that owns the job
+ * job: finished job
+ *
+ * Returns: void
+ */
+void recycle_job(Connection* conn, ComputeJob* job)
+{
+    release_job(job, conn->inputStart == conn->inputEnd);
+    job->conn = conn;
+    job->next = conn->spareJobs;
+    conn->spareJobs = job;
+}
+
+/* free_job()
+ * ----------
+ * Frees a job along with its image buffers, output and any batch items.
+ *
+ * job: job to free (may be NULL)
+ *
+ * Returns: void
+ */
+void free_job(ComputeJob* job)
+{
+    if (job) {
+        release_job(job, true);
+        free_image_buffer(&job->image);
+        free_image_buffer(&job->face);
+        free(job);
+    }
+}
+
+/* output_cache_key()
+ * ------------------
+ * Computes the output cache key for a request from its operation type,
+ * output encoding and the hashes of its images, so identical requests share
+ * a cached response. The cascade generation is included so that responses
+ * from cascades that have since been reloaded are not reused.
+ *
+ * job: job holding the complete request, with imageKey (and faceKey for
+ *      replacement) already set
+ * generation: generation of the cascades the output is detected with
+ *
+ * Returns: cache key for the request's output image
+ */
+CacheKey output_cache_key(const ComputeJob* job, unsigned int generation)
+{
+    CacheKey key = combine_cache_key(job->imageKey, job->opType);
+    key = combine_cache_key(key,
+            (job->encoding.format << BITS_PER_BYTE) | job->encoding.level);
+    key = combine_cache_key(key, generation);
+    if (job->opType == OP_FACE_REPLACE) {
+        key = combine_cache_key(key, job->faceKey.high);
+        key = combine_cache_key(key, job->faceKey.low);
+    }
+    return key;
+}
+
+/* queue_cached_response()
+ * -----------------------
+ * Queues the cached output image for a request if an identical request has
+ * been answered recently, skipping decode, detection and encode. The image
+ * is sent straight from the cache entry.
+ *
+ * conn: connection the request arrived on
+ * job: job holding the fully received request
+ *
+ * Returns: true if the response was queued from the cache, false otherwise
+ */
+bool queue_cached_response(Connection* conn, ComputeJob* job)
+{
+    LruCache* cache = conn->loop->shared->outputCache;
+    CacheEntry* entry = lru_cache_get(cache, job->outputKey);
+    if (!entry) {
+        return false;
+    }
+    if (!queue_protocol_header(conn, &job->tag, OP_OUTPUT_IMAGE, entry->size)
+            || !queue_cached_output(conn, &entry)) {
+        release_cache_entry(entry);
+        return true; // Connection has been closed
+    }
+    if (!conn->sendStartNs) {
+        conn->sendStartNs = monotonic_ns();
+    }
+    return true;
+}
+
+/* handle_client_eof()
+ * -------------------
+ * Handles the client closing its end of the connection. A request cut off
+ * in its header is reported as an invalid message before closing, as is an
+ * untagged client closing between requests. The
+ * connection stays open until the responses to any running requests have
+ * been sent, so a pipelining client may shut down writing once it has sent
+ * its last request.
+ *
+ * conn: connection that reached end of file
+ *
+ * Returns: void
+ */
+void handle_client_eof(Connection* conn)
+{
+    RequestTag untagged = {false, 0};
+    switch (conn->state) {
+    case READ_PREFIX:
+        if (!conn->tag.tagged) {
+            queue_protocol_error(conn, &untagged, ERROR_INVALID_MESSAGE);
+        }
+        conn->state = CLOSING;
+        break;
+    case READ_REQUEST_ID:
+        queue_protocol_error(conn, &untagged, ERROR_INVALID_MESSAGE);
+        conn->state = CLOSING;
+        break;
+    case READ_OP_TYPE:
+    case READ_ENCODING:
+    case READ_DEADLINE:
+    case READ_IMAGE_SIZE:
+    case READ_BATCH_SIZE:
+        queue_protocol_error(conn, &conn->tag, ERROR_INVALID_MESSAGE);
+        conn->state = CLOSING;
+        break;
+    default:
+        close_connection(conn);
+        break;
+    }
+}
+
+/* queue_output()
+ * --------------
+ * Appends a copy of some bytes to a connection's pending output, growing
+ * the output buffer as needed. Used for headers and other small pieces;
+ * consecutive copies share one segment. The bytes are written by
+ * flush_output().
+ *
+ * conn: connection to send the bytes to
+ * data: bytes to send
+ * size: number of bytes to send
+ *
+ * Returns: true on success, false if memory could not be allocated (the
+ *          connection is closed)
+ */
+bool queue_output(Connection* conn, const void* data, size_t size)
+{
+    OutputBuffer* out = &conn->output;
+    if (out->size + size > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity : BUFFER_SIZE;
+        while (capacity < out->size + size) {
+            capacity *= 2;
+        }
+        uint8_t* grown = realloc(out->data, capacity);
+        if (!grown) {
+            close_connection(conn);
+            return false;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+    OutputSegment* tail = out->tail;
+    if (!tail || tail->data || tail->file
+            || tail->offset + tail->size != out->size) {
+        if (!(tail = append_segment(conn))) {
+            return false;
+        }
+        tail->offset = out->size;
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+    tail->size += size;
+    return true;
+}
+
+/* append_segment()
+ * ----------------
+ * Adds an empty segment to the end of a connection's pending output,
+ * reusing a segment that has already been written when one is available.
+ *
+ * conn: connection to send the segment to
+ *
+ * Returns: the new segment, or NULL if memory could not be allocated (the
+ *          connection is closed)
+ */
+OutputSegment* append_segment(Connection* conn)
+{
+    OutputBuffer* out = &conn->output;
+    OutputSegment* segment = out->spareSegments;
+    if (segment) {
+        out->spareSegments = segment->next;
+    } else if (!(segment = malloc(sizeof(OutputSegment)))) {
+        close_connection(conn);
+        return NULL;
+    }
+    memset(segment, 0, sizeof(OutputSegment));
+    if (out->tail) {
+        out->tail->next = segment;
+    } else {
+        out->head = segment;
+    }
+    out->tail = segment;
+    return segment;
+}
+
+/* queue_encoded_output()
+ * ----------------------
+ * Queues an encoded image to be sent from the encoder's buffer without
+ * copying it. The segment takes over the image, which is released once it
+ * has been written.
+ *
+ * conn: connection to send the image to
+ * encoded: encoded image (a single row of bytes); set to NULL on success
+ *
+ * Returns: true on success, false if memory could not be allocated (the
+ *          connection is closed and the image is left with the caller)
+ */
+bool queue_encoded_output(Connection* conn, CvMat** encoded)
+{
+    OutputSegment* segment = append_segment(conn);
+    if (!segment) {
+        return false;
+    }
+    segment->data = (*encoded)->data.ptr;
+    segment->size = (*encoded)->rows * (*encoded)->cols;
+    segment->encoded = *encoded;
+    *encoded = NULL;
+    return true;
+}
+
+/* queue_cached_output()
+ * ---------------------
+ * Queues an output cache entry to be sent straight from the cache without
+ * copying it. The segment takes over the caller's reference to the entry,
+ * which keeps it alive until it has been written even if it is evicted.
+ *
+ * conn: connection to send the entry to
+ * entry: referenced cache entry; set to NULL on success
+ *
+ * Returns: true on success, false if memory could not be allocated (the
+ *          connection is closed and the reference is left with the caller)
+ */
+bool queue_cached_output(Connection* conn, CacheEntry** entry)
+{
+    OutputSegment* segment = append_segment(conn);
+    if (!segment) {
+        return false;
+    }
+    segment->data = (*entry)->data;
+    segment->size = (*entry)->size;
+    segment->entry = *entry;
+    *entry = NULL;
+    return true;
+}
+
+/* queue_job_output()
+ * ------------------
+ * Queues the payload of a finished job's response: its output image, taken
+ * over from the job without copying, or its error message.
+ *
+ * conn: connection the job's request arrived on
+ * job: finished job
+ *
+ * Returns: true on success, false if memory could not be allocated (the
+ *          connection is closed)
+ */
+bool queue_job_output(Connection* conn, ComputeJob* job)
+{
+    if (job->result != OPENCV_SUCCESS) {
+        const char* msg = error_message(job->error);
+        return queue_output(conn, msg, strlen(msg));
+    }
+    if (job->cached) {
+        return queue_cached_output(conn, &job->cached);
+    }
+    return queue_encoded_output(conn, &job->encoded);
+}
+
+/* release_segment()
+ * -----------------
+ * Releases the image, cache entry or response file held by an output
+ * segment.
+ *
+ * segment: segment that has been written or abandoned
+ *
+ * Returns: void
+ */
+void release_segment(OutputSegment* segment)
+{
+    if (segment->encoded) {
+        cvReleaseMat(&segment->encoded);
+    }
+    release_cache_entry(segment->entry);
+    segment->entry = NULL;
+    release_responsefile(segment->file);
+    segment->file = NULL;
+}
+
+/* free_output()
+ * -------------
+ * Frees a closed connection's output buffer along with every segment still
+ * waiting to be written.
+ *
+ * out: output to free
+ *
+ * Returns: void
+ */
+void free_output(OutputBuffer* out)
+{
+    while (out->head) {
+        OutputSegment* next = out->head->next;
+        release_segment(out->head);
+        free(out->head);
+        out->head = next;
+    }
+    while (out->spareSegments) {
+        OutputSegment* next = out->spareSegments->next;
+        free(out->spareSegments);
+        out->spareSegments = next;
+    }
+    free(out->data);
+    memset(out, 0, sizeof(OutputBuffer));
+}
+
+/* queue_protocol_message()
+ * ------------------------
+ * Queues a complete protocol message: header followed by payload.
+ *
+ * conn: connection to send the message to
+ * tag: request the message answers
+ * opType: operation type of the message
+ * data: message payload
+ * size: size of the payload in bytes
+ *
+ * Returns: void
+ */
+void queue_protocol_message(Connection* conn, const RequestTag* tag,
+        unsigned char opType, const void* data, uint32_t size)
+{
+    if (queue_protocol_header(conn, tag, opType, size)) {
+        queue_output(conn, data, size);
+    }
+}
+
+/* queue_protocol_header()
+ * -----------------------
+ * Queues a protocol message header: prefix, request ID (tagged responses
+ * only), operation type and payload size.
+ *
+ * conn: connection to send the message to
+ * tag: request the message answers
+ * opType: operation type of the message
+ * size: size of the payload that will follow, in bytes
+ *
+ * Returns: true on success, false if the connection was closed
+ */
+bool queue_protocol_header(Connection* conn, const RequestTag* tag,
+        unsigned char opType, uint32_t size)
+{
+    unsigned char header[PROTOCOL_HEADER_SIZE + REQUEST_ID_SIZE];
+    unsigned char* next = header;
+    encode_uint32_le(tag->tagged ? PROTOCOL_PREFIX_V2 : PROTOCOL_PREFIX, next);
+    next += UINT32_NUM_BYTES;
+    if (tag->tagged) {
+        encode_uint32_le(tag->id, next);
+        next += REQUEST_ID_SIZE;
+    }
+    *next++ = opType;
+    encode_uint32_le(size, next);
+    next += UINT32_NUM_BYTES;
+    return queue_output(conn, header, next - header);
+}
+
+/* queue_protocol_error()
+ * ----------------------
+ * Queues an OP_ERROR_MSG message carrying the text for an error and counts
+ * the error in the server statistics.
+ *
+ * conn: connection to send the error to
+ * tag: request the error answers
+ * kind: kind of error to report
+ *
+ * Returns: void
+ */
+void queue_protocol_error(
+        Connection* conn, const RequestTag* tag, ErrorKind kind)
+{
+    const char* msg = error_message(kind);
+    record_error(kind);
+    queue_protocol_message(conn, tag, OP_ERROR_MSG, msg, strlen(msg));
+}
+
+/* error_message()
+ * ---------------
+ * Maps an error kind to the message text sent to clients.
+ *
+ * kind: kind of error
+ *
+ * Returns: error message string
+ */
+const char* error_message(ErrorKind kind)
+{
+    switch (kind) {
+    case ERROR_INVALID_OP_TYPE:
+        return invalidOpType;
+    case ERROR_INVALID_MESSAGE:
+        return invalidMessage;
+    case ERROR_IMAGE_ZERO_BYTES:
+        return imageZeroBytes;
+    case ERROR_IMAGE_TOO_LARGE:
+        return imageTooLarge;
+    case ERROR_NO_FACES:
+        return invalidNoFaces;
+    case ERROR_INVALID_BATCH_SIZE:
+        return invalidBatchSize;
+    case ERROR_UNKNOWN_FACE_HANDLE:
+        return unknownFaceHandle;
+    case ERROR_INVALID_ENCODING:
+        return invalidEncoding;
+    case ERROR_SERVER_BUSY:
+        return serverBusy;
+    case ERROR_DEADLINE_EXCEEDED:
+        return deadlineExceeded;
+    default:
+        return invalidImage;
+    }
+}
+
+/* queue_stats_response()
+ * ----------------------
+ * Queues an OP_STATS message carrying a text snapshot of the server's
+ * connection counts, request and error counters, stage latency histograms
+ * and compute pool state. Snapshots are cheap, so they are built on the
+ * event loop rather than the compute pool.
+ *
+ * conn: connection that requested the statistics
+ *
+ * Returns: void (closes the connection if memory cannot be allocated)
+ */
+void queue_stats_response(Connection* conn)
+{
+    SharedState* shared = conn->loop->shared;
+    char* text = NULL;
+    size_t length = 0;
+    FILE* stream = open_memstream(&text, &length);
+    if (!stream) {
+        close_connection(conn);
+        return;
+    }
+    fprintf(stream, "connections_active %d\n",
+            __atomic_load_n(&shared->activeSocketCount, __ATOMIC_RELAXED));
+    fprintf(stream, "connections_total %d\n",
+            __atomic_load_n(&shared->totalThreadCount, __ATOMIC_RELAXED));
+    fprintf(stream, "requests_queued %d\n",
+            __atomic_load_n(&shared->queuedRequests, __ATOMIC_RELAXED));
+    fprintf(stream, "bytes_in_flight %lu\n", (unsigned long)__atomic_load_n(
+            &shared->inFlightBytes, __ATOMIC_RELAXED));
+    write_stats(stream, shared->computePool);
+    write_cache_stats(stream, shared->outputCache, "output");
+    write_cache_stats(stream, shared->rectCache, "rectangles");
+    write_cache_stats(stream, shared->faceCache, "faces");
+    fclose(stream);
+    queue_protocol_message(conn, &conn->tag, OP_STATS, text, length);
+    free(text);
+}
+
+/* queue_responsefile()
+ * --------------------
+ * Queues the response file, sent to clients whose first message has the
+ * wrong prefix. It is sent straight from the descriptor opened when it was
+ * loaded with sendfile(), so it is never copied through the server.
+ *
+ * conn: connection to send the response file to
+ *
+ * Returns: void
+ */
+void queue_responsefile(Connection* conn)
+{
+    ResponseFile* file = acquire_responsefile(conn->loop->shared);
+    if (!file) {
+        return;
+    }
+    OutputSegment* segment = append_segment(conn);
+    if (!segment) {
+        release_responsefile(file);
+        return;
+    }
+    segment->file = file;
+    segment->size = file->size;
+}
+
+/* load_responsefile()
+ * -------------------
+ * Opens the response file and checks that it is a non-empty regular file.
+ * This is done once at startup and again on SIGHUP, rather than for every
+ * client with a wrong prefix.
+ *
+ * Returns: the loaded response file with one reference, or NULL if it is
+ *          missing or unusable
+ */
+ResponseFile* load_responsefile(void)
+{
+    struct stat info;
+    int fd = open(responseFile, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    ResponseFile* file = NULL;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0
+            && (file = malloc(sizeof(ResponseFile)))) {
+        file->fd = fd;
+        file->size = info.st_size;
+        file->refCount = 1;
+        return file;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* acquire_responsefile()
+ * ----------------------
+ * Takes a reference to the current response file.
+ *
+ * shared: shared state holding the response file
+ *
+ * Returns: the response file (release with release_responsefile()), or
+ *          NULL if none is loaded
+ */
+ResponseFile* acquire_responsefile(SharedState* shared)
+{
+    pthread_mutex_lock(&shared->responseLock);
+    ResponseFile* file = shared->responseFile;
+    if (file) {
+        __atomic_add_fetch(&file->refCount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shared->responseLock);
+    return file;
+}
+
+/* release_responsefile()
+ * ----------------------
+ * Drops a reference to a response file, closing it once it has been
+ * replaced and is no longer being sent to anyone.
+ *
+ * file: response file (may be NULL)
+ *
+ * Returns: void
+ */
+void release_responsefile(ResponseFile* file)
+{
+    if (file
+            && __atomic_sub_fetch(&file->refCount, 1, __ATOMIC_ACQ_REL)
+                    == 0) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+/* reload_responsefile()
+ * ---------------------
+ * Loads the response file again and makes it current. Clients part way
+ * through receiving the old file finish receiving it. If the file is now
+ * missing or unusable, the old one is kept.
+ *
+ * shared: shared state holding the response file
+ *
+ * Returns: void
+ */
+void reload_responsefile(SharedState* shared)
+{
+    ResponseFile* file = load_responsefile();
+    if (!file) {
+        return;
+    }
+    pthread_mutex_lock(&shared->responseLock);
+    ResponseFile* old = shared->responseFile;
+    shared->responseFile = file;
+    pthread_mutex_unlock(&shared->responseLock);
+    release_responsefile(old);
+}
+
+/* server_signals()
+ * ----------------
+ * Fills in the set of signals the server handles through its signalfd:
+ * SIGHUP (reload) and SIGTERM (drain).
+ *
+ * signals: set to fill in
+ *
+ * Returns: void
+ */
+void server_signals(sigset_t* signals)
+{
+    sigemptyset(signals);
+    sigaddset(signals, SIGHUP);
+    sigaddset(signals, SIGTERM);
+}
+
+/* block_signals()
+ * ---------------
+ * Blocks the signals the event loop handles through its signalfd so that
+ * they are never delivered asynchronously. Must be called before any
+ * threads are created, as they inherit the signal mask.
+ *
+ * Returns: void
+ */
+void block_signals(void)
+{
+    sigset_t signals;
+    server_signals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+/* handle_signals()
+ * ----------------
+ * Runs on the event loop when its signalfd is readable. SIGHUP reloads the
+ * response file and the cascades; SIGTERM starts draining the server.
+ *
+ * loop: event loop that received the signals
+ *
+ * Returns: void
+ */
+void handle_signals(EventLoop* loop)
+{
+    struct signalfd_siginfo info;
+    while (read(loop->signalFd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGHUP) {
+            reload_responsefile(loop->shared);
+            reload_cascades(loop->shared);
+        } else if (info.ssi_signo == SIGTERM) {
+            start_drain(loop->shared);
+        }
+    }
+}
+
+/* start_drain()
+ * -------------
+ * Puts the server into drain mode and wakes every event loop so that each
+ * stops accepting and winds down (see drain_event_loop()). The server exits
+ * once all of them have drained.
+ *
+ * shared: shared server state
+ *
+ * Returns: void
+ */
+void start_drain(SharedState* shared)
+{
+    __atomic_store_n(&shared->draining, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < shared->loopCount; i++) {
+        uint64_t one = 1;
+        if (write(shared->loops[i].wakeFd, &one, sizeof(one)) == -1) {
+            // Counter is already non-zero; the loop has a wakeup pending
+        }
+    }
+}
+
+/* flush_output()
+ * --------------
+ * Writes as much pending output as the socket accepts. A connection in the
+ * CLOSING state is shut down and closed once everything has been written
+ * and no requests are still running.
+ *
+ * conn: connection to flush
+ *
+ * Returns: true if all output was written and the connection remains open,
+ *          false if output is still pending or the connection was closed
+ */
+bool flush_output(Connection* conn)
+{
+    OutputBuffer* out = &conn->output;
+    while (out->head) {
+        ssize_t sent = write_output(conn);
+        if (sent > 0) {
+            output_written(out, sent);
+            conn->lastActivityNs = monotonic_ns();
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false; // Wait for EPOLLOUT
+        } else {
+            close_connection(conn);
+            return false;
+        }
+    }
+    out->size = 0;
+    if (conn->sendStartNs) {
+        record_stage_time(STAGE_SEND, conn->sendStartNs);
+        conn->sendStartNs = 0;
+    }
+    if (conn->state == CLOSING) {
+        if (conn->inFlight == 0) {
+            shutdown(conn->fd, SHUT_WR);
+            close_connection(conn);
+        }
+        return false;
+    }
+    return true;
+}
+
+/* write_output()
+ * --------------
+ * Makes one attempt to write pending output. A file segment at the head of
+ * the output is written with sendfile(); otherwise the segments up to the
+ * next file segment (at most MAX_IOVECS of them) are gathered and written
+ * together with a single sendmsg().
+ *
+ * conn: connection with pending output
+ *
+ * Returns: number of bytes written, or -1 with errno set
+ */
+ssize_t write_output(Connection* conn)
+{
+    OutputBuffer* out = &conn->output;
+    OutputSegment* segment = out->head;
+    if (segment->file) {
+        off_t offset = segment->sent;
+        return sendfile(conn->fd, segment->file->fd, &offset,
+                segment->size - segment->sent);
+    }
+    struct iovec iov[MAX_IOVECS];
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    for (; segment && !segment->file && msg.msg_iovlen < MAX_IOVECS;
+            segment = segment->next) {
+        const uint8_t* data
+                = segment->data ? segment->data : out->data + segment->offset;
+        iov[msg.msg_iovlen].iov_base = (void*)(data + segment->sent);
+        iov[msg.msg_iovlen].iov_len = segment->size - segment->sent;
+        msg.msg_iovlen++;
+    }
+    return sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+}
+
+/* output_written()
+ * ----------------
+ * Advances past output that has been written, releasing (and keeping for
+ * reuse) each segment once all of it has been sent.
+ *
+ * out: output that was written
+ * sent: number of bytes written
+ *
+ * Returns: void
+ */
+void output_written(OutputBuffer* out, size_t sent)
+{
+    while (sent > 0 || (out->head && out->head->sent == out->head->size)) {
+        OutputSegment* segment = out->head;
+        size_t used = segment->size - segment->sent;
+        if (used > sent) {
+            used = sent;
+        }
+        segment->sent += used;
+        sent -= used;
+        if (segment->sent < segment->size) {
+            return;
+        }
+        release_segment(segment);
+        out->head = segment->next;
+        if (!out->head) {
+            out->tail = NULL;
+        }
+        segment->next = out->spareSegments;
+        out->spareSegments = segment;
+    }
+}
+
+/* run_compute_job()
+ * -----------------
+ * Compute pool task that performs the face detection or replacement for a
+ * request or batch item, then hands the job back to its event loop. A job
+ * whose deadline passed while it was queued is not run at all. The job uses
+ * the detector pool that is current when it starts throughout, even if the
+ * cascades are reloaded while it runs.
+ *
+ * arg: pointer to the ComputeJob to run
+ *
+ * Returns: void
+ */
+void run_compute_job(void* arg)
+{
+    ComputeJob* job = (ComputeJob*)arg;
+    Connection* conn = job->conn;
+    SharedState* shared = conn->loop->shared;
+    PipelineConfig config = {acquire_detector_pool(shared), shared->rectCache,
+            shared->faceCache, shared->computePool,
+            conn->loop->params->detectsize, job->encoding, job->deadlineNs};
+    if (deadline_passed(job->deadlineNs)) {
+        job->result = OPENCV_DEADLINE_EXCEEDED;
+    } else if (job->opType == OP_FACE_REPLACE) {
+        const ImageBuffer* face = &job->face;
+        if (job->batch) {
+            face = &job->batch->face;
+        } else if (job->sessionFace) {
+            face = &job->sessionFace->image;
+        }
+        job->result = replace_faces_in_memory(&job->image, face,
+                job->imageKey, job->faceKey, &config, &job->encoded);
+    } else {
+        job->result = detect_and_draw_faces(
+                &job->image, job->imageKey, &config, &job->encoded);
+    }
+    if (job->result == OPENCV_SUCCESS) {
+        // Keyed by the cascades actually used, which a reload since the
+        // request was received may have changed. The cache takes over the
+        // encoded image without copying it, and the response is sent from
+        // the entry as it is for a cache hit
+        job->outputKey = output_cache_key(job, config.detectors->generation);
+        job->cached = lru_cache_put_owned(shared->outputCache,
+                job->outputKey, job->encoded->data.ptr,
+                job->encoded->rows * job->encoded->cols, release_encoded,
+                job->encoded);
+        if (job->cached) {
+            job->encoded = NULL;
+        }
+    } else if (job->result == OPENCV_DEADLINE_EXCEEDED) {
+        job->error = ERROR_DEADLINE_EXCEEDED;
+    } else {
+        job->error = job->result == OPENCV_NO_FACES ? ERROR_NO_FACES
+                                                    : ERROR_INVALID_IMAGE;
+    }
+    release_detector_pool(config.detectors);
+    if (job->batch) {
+        release_batch_ref(job->batch);
+    } else {
+        complete_job(job);
+    }
+}
+
+/* release_encoded()
+ * -----------------
+ * Output cache release function for an encoded image it has taken over.
+ *
+ * owner: the encoded image (CvMat*)
+ *
+ * Returns: void
+ */
+void release_encoded(void* owner)
+{
+    CvMat* encoded = (CvMat*)owner;
+    cvReleaseMat(&encoded);
+}
+
+/* complete_job()
+ * --------------
+ * Hands a finished job back to its connection's event loop through the
+ * loop's completed list and eventfd.
+ *
+ * job: finished job (a single request or a whole batch)
+ *
+ * Returns: void
+ */
+void complete_job(ComputeJob* job)
+{
+    EventLoop* loop = job->conn->loop;
+    pthread_mutex_lock(&loop->completedLock);
+    job->next = loop->completed;
+    loop->completed = job;
+    pthread_mutex_unlock(&loop->completedLock);
+    uint64_t one = 1;
+    if (write(loop->wakeFd, &one, sizeof(one)) == -1) {
+        // Counter is already non-zero; the loop has a wakeup pending
+    }
+}
+
+/* handle_completed_jobs()
+ * -----------------------
+ * Runs on the event loop when compute workers signal the eventfd. Queues the
+ * response for each finished job and resumes servicing its connection. Jobs
+ * whose connection has closed are freed, along with the connection once its
+ * last job is done.
+ *
+ * loop: event loop whose completed jobs should be handled
+ *
+ * Returns: void
+ */
+void handle_completed_jobs(EventLoop* loop)
+{
+    uint64_t count;
+    while (read(loop->wakeFd, &count, sizeof(count)) > 0) {
+        // Drain the eventfd counter
+    }
+    pthread_mutex_lock(&loop->completedLock);
+    ComputeJob* job = loop->completed;
+    loop->completed = NULL;
+    pthread_mutex_unlock(&loop->completedLock);
+
+    while (job) {
+        ComputeJob* next = job->next;
+        Connection* conn = job->conn;
+        if (!conn->closed) {
+            queue_job_response(conn, job);
+        }
+        conn->inFlight--;
+        loop->inFlight--;
+        if (conn->closed) {
+            free_job(job);
+            if (conn->inFlight == 0) {
+                conn->nextClosed = loop->closed;
+                loop->closed = conn;
+            }
+        } else {
+            recycle_job(conn, job);
+            if (conn->state == PROCESSING) {
+                conn->state = READ_PREFIX;
+            }
+            service_connection(conn);
+        }
+        job = next;
+    }
+}
+
+/* queue_job_response()
+ * --------------------
+ * Queues the response for a finished job: the encoded output image (sent
+ * from the output cache entry holding it), an error message if the image was
+ * invalid or contained no faces, or the combined response to a batch.
+ *
+ * conn: connection the job's request arrived on
+ * job: finished job
+ *
+ * Returns: void
+ */
+void queue_job_response(Connection* conn, ComputeJob* job)
+{
+    if (job->opType == OP_BATCH) {
+        queue_batch_response(conn, job);
+    } else if (job->result != OPENCV_SUCCESS) {
+        queue_protocol_error(conn, &job->tag, job->error);
+    } else {
+        const void* data;
+        uint32_t size;
+        job_output(job, &data, &size);
+        if (!queue_protocol_header(conn, &job->tag, OP_OUTPUT_IMAGE, size)
+                || !queue_job_output(conn, job)) {
+            return;
+        }
+        if (!conn->sendStartNs) {
+            conn->sendStartNs = monotonic_ns();
+        }
+    }
+}
+
+/* queue_batch_response()
+ * ----------------------
+ * Queues an OP_BATCH response. Its payload is the number of items followed,
+ * for each item in request order, by an operation type (OP_OUTPUT_IMAGE or
+ * OP_ERROR_MSG), a size and the output image or error message. Output
+ * images are sent from where they are held rather than copied.
+ *
+ * conn: connection the batch arrived on
+ * batch: finished batch job
+ *
+ * Returns: void
+ */
+void queue_batch_response(Connection* conn, ComputeJob* batch)
+{
+    const void* data;
+    uint32_t size;
+    uint64_t total = UINT32_NUM_BYTES;
+    for (uint32_t i = 0; i < batch->itemCount; i++) {
+        job_output(batch->items[i], &data, &size);
+        total += BATCH_ITEM_HEADER_SIZE + size;
+    }
+    if (total > UINT32_MAX) {
+        queue_protocol_error(conn, &batch->tag, ERROR_IMAGE_TOO_LARGE);
+        return;
+    }
+    unsigned char header[BATCH_ITEM_HEADER_SIZE];
+    encode_uint32_le(batch->itemCount, header);
+    if (!queue_protocol_header(conn, &batch->tag, OP_BATCH, total)
+            || !queue_output(conn, header, UINT32_NUM_BYTES)) {
+        return;
+    }
+    for (uint32_t i = 0; i < batch->itemCount; i++) {
+        header[0] = job_output(batch->items[i], &data, &size);
+        if (header[0] == OP_ERROR_MSG) {
+            record_error(batch->items[i]->error);
+        }
+        encode_uint32_le(size, header + 1);
+        if (!queue_output(conn, header, BATCH_ITEM_HEADER_SIZE)
+                || !queue_job_output(conn, batch->items[i])) {
+            return;
+        }
+    }
+    if (!conn->sendStartNs) {
+        conn->sendStartNs = monotonic_ns();
+    }
+}
+
+/* job_output()
+ * ------------
+ * Finds the response payload for a finished job.
+ *
+ * job: finished job
+ * data: set to the output image or error message
+ * size: set to the size of the output image or error message
+ *
+ * Returns: OP_OUTPUT_IMAGE, or OP_ERROR_MSG if the job failed
+ */
+unsigned char job_output(
+        const ComputeJob* job, const void** data, uint32_t* size)
+{
+    if (job->result != OPENCV_SUCCESS) {
+        *data = error_message(job->error);
+        *size = strlen(*data);
+        return OP_ERROR_MSG;
+    }
+    if (job->cached) {
+        *data = job->cached->data;
+        *size = job->cached->size;
+    } else {
+        *data = job->encoded->data.ptr;
+        *size = job->encoded->rows * job->encoded->cols;
+    }
+    return OP_OUTPUT_IMAGE;
+}
+
+/* release_job()
+ * -------------
+ * Frees the output and batch items held by a job and resets it for the next
+ * request. The image buffers are kept for reuse, subject to
+ * trim_image_buffer().
+ *
+ * job: job to release
+ * idle: whether the connection has no further request data waiting
+ *
+ * Returns: void
+ */
+void release_job(ComputeJob* job, bool idle)
+{
+    if (job->encoded) {
+        cvReleaseMat(&job->encoded);
+    }
+    release_cache_entry(job->cached);
+    release_session_face(job->sessionFace);
+    if (job->opType == OP_BATCH) {
+        // Only a batch's face is held by the batch; its items are requests
+        __atomic_sub_fetch(&job->conn->loop->shared->inFlightBytes,
+                job->admittedBytes, __ATOMIC_RELAXED);
+    } else if (job->admittedBytes) {
+        retire_request(job->conn->loop->shared, job->admittedBytes);
+    }
+    for (uint32_t i = 0; i < job->itemCount; i++) {
+        free_job(job->items[i]);
+    }
+    free(job->items);
+    ImageBuffer image = job->image;
+    ImageBuffer face = job->face;
+    trim_image_buffer(&image, idle);
+    trim_image_buffer(&face, idle);
+    memset(job, 0, sizeof(ComputeJob));
+    job->image = image;
+    job->face = face;
+}
+
+/* setup_listen_socket()
+ * ---------------------
+ * Creates and configures a listening socket bound to the specified port.
+ * Uses getaddrinfo() for address resolution and sets SO_REUSEADDR option,
+ * and SO_REUSEPORT if other listening sockets are to share the port.
+ *
+ * portnum: string representation of port number, or NULL for ephemeral port
+ * reusePort: whether to let other sockets listen on the same port
+ *
+ * Returns: file descriptor of listening socket, or -1 on failure
+ */
+int setup_listen_socket(const char* portnum, bool reusePort)
+{
+    struct addrinfo hints = {0}, *res, *rp;
+    int listenFd = -1;
+    int optVal = 1;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    // Use "0" for ephemeral port if portnum is NULL
+    if (!portnum) {
+        portnum = "0";
+    }
+
+    int gai = getaddrinfo(NULL, portnum, &hints, &res);
+    if (gai != 0) {
+        return -1;
+    }
+
+    // Try each address until one works
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        listenFd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (listenFd == -1) {
+            continue;
+        }
+        // Allow reuse after close
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
+        if ((!reusePort
+                    || setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &optVal,
+                               sizeof(optVal))
+                            == 0)
+                && bind(listenFd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break; // Success
+        }
+        close(listenFd);
+        listenFd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (listenFd == -1) {
+        return -1;
+    }
+
+    if (listen(listenFd, SOMAXCONN) != 0) {
+        close(listenFd);
+        return -1;
+    }
+    return listenFd;
+}
+
+/* listen_port()
+ * -------------
+ * Finds the port number a listening socket is bound to.
+ *
+ * listenFd: file descriptor of the listening socket
+ *
+ * Returns: port number, or 0 if it cannot be determined
+ */
+unsigned int listen_port(int listenFd)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(listenFd, (struct sockaddr*)&addr, &addrlen) != 0) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+/* print_port_number()
+ * -------------------
+ * Retrieves and prints the actual port number that the server is listening
+ * on to stderr. Used to report ephemeral port assignments.
+ *
+ * listenFd: file descriptor of the listening socket
+ *
+ * Returns: void
+ */
+void print_port_number(int listenFd)
+{
+    unsigned int port = listen_port(listenFd);
+    if (port) {
+        fprintf(stderr, "%u\n", port);
+        fflush(stderr);
+    }
+}
+
+/* usage_error()
+ * -------------
+ * Prints the correct usage message to stderr and exits the program
+ * with usage error status code.
+ *
+ * Returns: does not return (exits program)
+ */
+void usage_error(void)
 {
     fprintf(stderr, usageErrorMessage);
     exit(EXIT_USAGE_STATUS);
 }
 
-/* load_cascade()
- * --------------
- * Loads a Haar cascade classifier from the specified file path for use
- * in face or eye detection.
+/* load_cascade()
+ * --------------
+ * Loads a Haar cascade classifier from the specified file path for use
+ * in face or eye detection.
+ *
+ * path: file path to the cascade classifier XML file
+ *
+ * Returns: pointer to loaded cascade classifier, or NULL on failure
+ */
+CvHaarClassifierCascade* load_cascade(const char* path)
+{
+    return (CvHaarClassifierCascade*)cvLoad(path, 0, 0, 0);
+}
+
+/* search_faces()
+ * --------------
+ * Runs the cascades over a decoded image and collects the face rectangles,
+ * and optionally the eye rectangles within each face, in full image
+ * coordinates.
+ *
+ * img: decoded colour image
+ * cascades: cascade classifiers, used by this thread only
+ * config: image pipeline configuration
+ * withEyes: whether to search each face for eyes
+ *
+ * Returns: newly allocated Detections (free with free()), or NULL if memory
+ *          could not be allocated
+ */
+Detections* search_faces(IplImage* img, CascadeRegistry* cascades,
+        const PipelineConfig* config, bool withEyes)
+{
+    double scale;
+    IplImage* grey = make_greyscale(img, config->maxDimension, &scale);
+    CvMemStorage* storage = cvCreateMemStorage(0);
+    CvSeq* faces = detect_faces(grey, cascades->faceCascade, storage);
+    withEyes = withEyes && cascades->eyeCascade;
+    Detections* detections = NULL;
+    EyeSearch* search = create_eye_search(grey, faces, config->detectors);
+    if (search) {
+        if (withEyes) {
+            run_eye_search(search, cascades->eyeCascade, config->computePool);
+        }
+        if (!search->failed) {
+            detections = collect_detections(search, scale, img, withEyes);
+        }
+        release_eye_search(search);
+    }
+    cvReleaseImage(&grey);
+    cvReleaseMemStorage(&storage);
+    return detections;
+}
+
+/* create_eye_search()
+ * -------------------
+ * Sets up the eye searches for the faces found in an image.
+ *
+ * grey: equalised greyscale image the faces were found in
+ * faces: face rectangles in greyscale coordinates (may be NULL)
+ * detectors: pool helpers borrow eye cascades from (the search holds a
+ *            reference to it)
+ *
+ * Returns: new search holding one reference, or NULL if memory could not be
+ *          allocated
+ */
+EyeSearch* create_eye_search(
+        IplImage* grey, CvSeq* faces, DetectorPool* detectors)
+{
+    int faceCount = faces ? faces->total : 0;
+    size_t slots = faceCount ? faceCount : 1;
+    EyeSearch* search = calloc(1, sizeof(EyeSearch));
+    CvRect* rects = malloc(slots * sizeof(CvRect));
+    CvRect** eyes = calloc(slots, sizeof(CvRect*));
+    int* eyeCounts = calloc(slots, sizeof(int));
+    if (!search || !rects || !eyes || !eyeCounts) {
+        free(search);
+        free(rects);
+        free(eyes);
+        free(eyeCounts);
+        return NULL;
+    }
+    for (int i = 0; i < faceCount; ++i) {
+        rects[i] = *(CvRect*)cvGetSeqElem(faces, i);
+    }
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->finished, NULL);
+    search->grey = grey;
+    search->faces = rects;
+    search->eyes = eyes;
+    search->eyeCounts = eyeCounts;
+    search->faceCount = faceCount;
+    search->refCount = 1;
+    search->detectors = detectors;
+    __atomic_add_fetch(&detectors->refCount, 1, __ATOMIC_RELAXED);
+    return search;
+}
+
+/* run_eye_search()
+ * ----------------
+ * Searches every face for eyes. Idle compute pool workers are asked to
+ * help, one per extra face up to the pool size, while the calling thread
+ * searches faces itself. Helpers are only queued if there is room and only
+ * search if a detector is free, so a busy server simply searches the faces
+ * one after another on the calling thread and can never deadlock waiting
+ * for help.
+ *
+ * search: search to run
+ * eyeCascade: eye cascade of the calling thread's detector
+ * computePool: pool to ask for helpers (may be NULL)
+ *
+ * Returns: void (once every face has been searched)
+ */
+void run_eye_search(EyeSearch* search, CvHaarClassifierCascade* eyeCascade,
+        WorkPool* computePool)
+{
+    int helpers = search->faceCount - 1;
+    if (!computePool) {
+        helpers = 0;
+    } else if (helpers > computePool->threadCount - 1) {
+        helpers = computePool->threadCount - 1;
+    }
+    for (int i = 0; i < helpers; ++i) {
+        __atomic_add_fetch(&search->refCount, 1, __ATOMIC_RELAXED);
+        if (!try_submit_task(computePool, eye_search_task, search)) {
+            __atomic_sub_fetch(&search->refCount, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    search_claimed_faces(search, eyeCascade);
+    pthread_mutex_lock(&search->lock);
+    while (search->doneCount < search->faceCount) {
+        pthread_cond_wait(&search->finished, &search->lock);
+    }
+    pthread_mutex_unlock(&search->lock);
+}
+
+/* eye_search_task()
+ * -----------------
+ * Compute pool task helping with an eye search, using whichever detector is
+ * free. Does nothing if every detector is in use.
+ *
+ * arg: pointer to the EyeSearch to help with
+ *
+ * Returns: void
+ */
+void eye_search_task(void* arg)
+{
+    EyeSearch* search = (EyeSearch*)arg;
+    CascadeRegistry* detector = try_acquire_detector(search->detectors);
+    if (detector) {
+        search_claimed_faces(search, detector->eyeCascade);
+        release_detector(search->detectors, detector);
+    }
+    release_eye_search(search);
+}
+
+/* search_claimed_faces()
+ * ----------------------
+ * Claims unsearched faces one at a time and searches each for eyes until
+ * none are left.
  *
- * path: file path to the cascade classifier XML file
+ * search: search to work on
+ * eyeCascade: eye cascade classifier, used by this thread only
  *
- * Returns: pointer to loaded cascade classifier, or NULL on failure
+ * Returns: void
  */
-CvHaarClassifierCascade* load_cascade(const char* path)
+void search_claimed_faces(
+        EyeSearch* search, CvHaarClassifierCascade* eyeCascade)
 {
-    return (CvHaarClassifierCascade*)cvLoad(path, 0, 0, 0);
+    int i;
+    while ((i = __atomic_fetch_add(&search->nextFace, 1, __ATOMIC_RELAXED))
+            < search->faceCount) {
+        int count = search_eyes(
+                search->grey, search->faces[i], eyeCascade, &search->eyes[i]);
+        pthread_mutex_lock(&search->lock);
+        if (count < 0) {
+            search->failed = true;
+        } else {
+            search->eyeCounts[i] = count;
+        }
+        if (++search->doneCount == search->faceCount) {
+            pthread_cond_signal(&search->finished);
+        }
+        pthread_mutex_unlock(&search->lock);
+    }
 }
 
-/* make_greyscale()
- * ----------------
- * Converts a color image to greyscale and applies histogram equalization
- * to improve contrast for feature detection.
+/* release_eye_search()
+ * --------------------
+ * Drops a reference to an eye search, freeing it (and releasing its detector
+ * pool) when none remain.
  *
- * img: pointer to source color image
+ * search: search to release
  *
- * Returns: pointer to newly created greyscale image
+ * Returns: void
  */
+void release_eye_search(EyeSearch* search)
+{
+    if (__atomic_sub_fetch(&search->refCount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    for (int i = 0; i < search->faceCount; ++i) {
+        free(search->eyes[i]);
+    }
+    pthread_mutex_destroy(&search->lock);
+    pthread_cond_destroy(&search->finished);
+    free(search->faces);
+    free(search->eyes);
+    free(search->eyeCounts);
+    release_detector_pool(search->detectors);
+    free(search);
+}
 
-IplImage* make_greyscale(IplImage* img)
+/* collect_detections()
+ * --------------------
+ * Merges the faces and the per-face eye search results into a single
+ * Detections block in full image coordinates.
+ *
+ * search: completed eye search
+ * scale: factor mapping greyscale coordinates back to img
+ * img: full size image
+ * eyesSearched: whether the faces were searched for eyes
+ *
+ * Returns: newly allocated Detections (free with free()), or NULL if memory
+ *          could not be allocated
+ */
+Detections* collect_detections(const EyeSearch* search, double scale,
+        const IplImage* img, bool eyesSearched)
 {
-    IplImage* grey = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, 1);
-    cvCvtColor(img, grey, CV_BGR2GRAY);
-    cvEqualizeHist(grey, grey);
-    return grey;
+    int eyeCount = 0;
+    for (int i = 0; i < search->faceCount; ++i) {
+        eyeCount += search->eyeCounts[i];
+    }
+    Detections* detections
+            = malloc(detections_size(search->faceCount, eyeCount));
+    if (!detections) {
+        return NULL;
+    }
+    detections->faceCount = search->faceCount;
+    detections->eyeCount = eyeCount;
+    detections->eyesSearched = eyesSearched;
+    CvRect* eyes = detection_eyes(detections);
+    int next = 0;
+    for (int i = 0; i < search->faceCount; ++i) {
+        detection_faces(detections)[i]
+                = scale_rect(search->faces[i], scale, img);
+        for (int j = 0; j < search->eyeCounts[i]; ++j) {
+            eyes[next++] = scale_rect(search->eyes[i][j], scale, img);
+        }
+        detection_eye_ends(detections)[i] = next;
+    }
+    return detections;
 }
 
-/* draw_faces_and_eyes()
- * ---------------------
- * Draws detection markers on an image for detected faces and eyes.
- * Draws magenta ellipses around faces and green circles around eyes.
- *
- * img: image to draw on
- * faces: sequence of detected face rectangles
- * storage: memory storage for eye detection
- * eyeCascade: cascade classifier for eye detection (may be NULL)
- * grey: greyscale version of image for eye detection
- *
- * Returns: void
- */
-void draw_faces_and_eyes(IplImage* img, CvSeq* faces, CvMemStorage* storage,
-        CvHaarClassifierCascade* eyeCascade, IplImage* grey)
-{
-    for (int i = 0; i < (faces ? faces->total : 0); ++i) {
-        CvRect* r = (CvRect*)cvGetSeqElem(faces, i);
-        CvPoint center = {cvRound(r->x + r->width * HALF),
-                cvRound(r->y + r->height * HALF)};
-        cvEllipse(img, center, cvSize(r->width / 2, r->height / 2), 0, 0,
-                DEGREES_IN_CIRCLE, cvScalar(COLOUR_MAX, 0, COLOUR_MAX, 0),
-                LINE_THICKNESS, LINE_TYPE, 0);
-        if (eyeCascade) {
-            cvSetImageROI(grey, *r);
-            CvSeq* eyes = cvHaarDetectObjects(grey, eyeCascade, storage,
-                    SCALE_FACTOR, LINE_THICKNESS, 0,
-                    cvSize(EYE_MIN_SIZE, EYE_MIN_SIZE), cvSize(0, 0));
-            for (int j = 0; j < (eyes ? eyes->total : 0); ++j) {
-                CvRect* er = (CvRect*)cvGetSeqElem(eyes, j);
-                CvPoint eyeCentre = {r->x + er->x + er->width / 2,
-                        r->y + er->y + er->height / 2};
-                int radius
-                        = cvRound((er->width + er->height) * EYE_RADIUS_FACTOR);
-                cvCircle(img, eyeCentre, radius, cvScalar(0, COLOUR_MAX, 0, 0),
-                        LINE_THICKNESS, LINE_TYPE, 0);
+/* find_faces()
+ * ------------
+ * Finds the faces, and optionally eyes, in a decoded image. Detections are
+ * kept in the rectangle cache under the hash of the encoded image and the
+ * cascade generation, so an image that has been searched recently (for
+ * example detected once and then used for several replacements) skips the
+ * cascade search entirely. A cascade set is only borrowed from the detector
+ * pool on a cache miss.
+ *
+ * img: decoded colour image
+ * imageKey: hash of the encoded image bytes
+ * config: image pipeline configuration
+ * withEyes: whether eye rectangles are needed
+ *
+ * Returns: newly allocated Detections (free with free()), or NULL if memory
+ *          could not be allocated
+ */
+Detections* find_faces(IplImage* img, CacheKey imageKey,
+        const PipelineConfig* config, bool withEyes)
+{
+    CacheKey rectKey
+            = combine_cache_key(imageKey, config->detectors->generation);
+    CacheEntry* entry = lru_cache_get(config->rectCache, rectKey);
+    if (entry) {
+        Detections* cached = (Detections*)entry->data;
+        Detections* detections = NULL;
+        if (cached->eyesSearched || !withEyes) {
+            detections = malloc(entry->size);
+            if (detections) {
+                memcpy(detections, cached, entry->size);
             }
-            cvResetImageROI(grey);
         }
+        release_cache_entry(entry);
+        if (detections) {
+            return detections;
+        }
+    }
+    CascadeRegistry* detector = acquire_detector(config->detectors);
+    Detections* detections = search_faces(img, detector, config, withEyes);
+    release_detector(config->detectors, detector);
+    if (detections) {
+        lru_cache_put(config->rectCache, rectKey, detections,
+                detections_size(
+                        detections->faceCount, detections->eyeCount));
     }
+    return detections;
 }
 
 /* detect_and_draw_faces()
  * -----------------------
- * Loads an image file, detects faces and eyes using Haar cascade classifiers,
- * draws detection markers, and saves the annotated image back to the file.
+ * Decodes an image, finds faces and eyes using the Haar cascade classifiers
+ * (or the rectangle cache), draws detection markers, and encodes the
+ * annotated image.
  *
- * filename: path to image file to process
+ * image: encoded image received from the client
+ * imageKey: hash of the encoded image bytes
+ * config: image pipeline configuration
+ * encoded: set to the encoded output image on success
  *
- * Returns: 0 on success, -1 on file/cascade loading failure, -2 if no faces
+ * Returns: 0 on success, -1 on decode or encode failure, -2 if no faces,
+ *          -3 if the deadline passed before the image was encoded
  */
-int detect_and_draw_faces(const char* filename)
+int detect_and_draw_faces(const ImageBuffer* image, CacheKey imageKey,
+        const PipelineConfig* config, CvMat** encoded)
 {
-    CvHaarClassifierCascade* faceCascade = load_cascade(FACE_CASCADE);
-    CvHaarClassifierCascade* eyeCascade = load_cascade(EYE_CASCADE);
-    if (!faceCascade || !eyeCascade) {
-        return -1;
-    }
-    IplImage* img = cvLoadImage(filename, CV_LOAD_IMAGE_COLOR);
+    IplImage* img = decode_image(image->data, image->size);
     if (!img) {
-        // Free cascades before return
-        cvRelease((void**)&faceCascade);
-        cvRelease((void**)&eyeCascade);
         return -1;
     }
-    IplImage* grey = make_greyscale(img);
-    CvMemStorage* storage = cvCreateMemStorage(0);
-    CvSeq* faces = cvHaarDetectObjects(grey, faceCascade, storage, SCALE_FACTOR,
-            MIN_NEIGHBOURS, 0, cvSize(FACE_MIN_SIZE, FACE_MIN_SIZE),
-            cvSize(0, 0));
-    if (!faces || faces->total == 0) {
-        // Free all
+    Detections* detections = find_faces(img, imageKey, config, true);
+    if (!detections || detections->faceCount == 0) {
+        cvReleaseImage(&img);
+        free(detections);
+        return detections ? -2 : -1; // No faces
+    }
+    draw_detections(img, detections);
+    free(detections);
+    if (deadline_passed(config->deadlineNs)) {
         cvReleaseImage(&img);
-        cvReleaseImage(&grey);
-        cvRelease((void**)&faceCascade);
-        cvRelease((void**)&eyeCascade);
-        cvReleaseMemStorage(&storage);
-        return -2; // No faces
-    }
-    draw_faces_and_eyes(img, faces, storage, eyeCascade, grey);
-    int saved = cvSaveImage(filename, img, 0);
+        return OPENCV_DEADLINE_EXCEEDED; // Not worth encoding
+    }
+    *encoded = encode_image(img, &config->encoding);
     cvReleaseImage(&img);
-    cvReleaseImage(&grey);
-    cvRelease((void**)&faceCascade);
-    cvRelease((void**)&eyeCascade);
-    cvReleaseMemStorage(&storage);
-    return saved ? 0 : -1;
+    return *encoded ? 0 : -1;
 }
 
 /* replace_faces_in_memory()
  * -------------------------
- * Detects faces in an image and replaces them with a scaled version of
- * a replacement face image. Both images are loaded from the same file path.
+ * Finds faces in an image (searching only if the image is not in the
+ * rectangle cache) and replaces them with a scaled version of a replacement
+ * face image. The replacement face is only decoded the first time it is
+ * seen, and each size it is scaled to is kept in the face cache, so faces
+ * of the same size (in this or later requests) share one resize.
  *
- * filename: path to file containing both the target image and replacement face
+ * image: encoded image in which to replace faces
+ * face: encoded replacement face image
+ * imageKey: hash of the encoded image bytes
+ * faceKey: hash of the encoded replacement face bytes
+ * config: image pipeline configuration
+ * encoded: set to the encoded output image on success
  *
- * Returns: 0 on success, -1 on loading failure, -2 if no faces detected
+ * Returns: 0 on success, -1 on decode or encode failure, -2 if no faces,
+ *          -3 if the deadline passed before the image was encoded
  */
-int replace_faces_in_memory(const char* filename)
+int replace_faces_in_memory(const ImageBuffer* image, const ImageBuffer* face,
+        CacheKey imageKey, CacheKey faceKey, const PipelineConfig* config,
+        CvMat** encoded)
 {
-    CvHaarClassifierCascade* faceCascade = load_cascade(FACE_CASCADE);
-    if (!faceCascade) {
-        return -1;
-    }
-    IplImage* img = cvLoadImage(filename, CV_LOAD_IMAGE_COLOR); // main image
+    IplImage* img = decode_image(image->data, image->size); // main image
     if (!img) {
-        cvRelease((void**)&faceCascade);
         return -1;
     }
 
-    IplImage* face = cvLoadImage(filename, CV_LOAD_IMAGE_COLOR); // face image
-    if (!face) {
+    CacheEntry* faceEntry;
+    IplImage* faceImg = load_replacement_face(
+            face, faceKey, config->faceCache, &faceEntry);
+    if (!faceImg) {
         cvReleaseImage(&img);
-        cvRelease((void**)&faceCascade);
         return -1;
     }
 
-    IplImage* grey = make_greyscale(img);
-    CvMemStorage* storage = cvCreateMemStorage(0);
-    CvSeq* faces = cvHaarDetectObjects(grey, faceCascade, storage, SCALE_FACTOR,
-            MIN_NEIGHBOURS, 0, cvSize(FACE_MIN_SIZE, FACE_MIN_SIZE),
-            cvSize(0, 0));
-    if (!faces || faces->total == 0) {
+    Detections* detections = find_faces(img, imageKey, config, false);
+    if (!detections || detections->faceCount == 0) {
+        cvReleaseImage(&img);
+        release_cached_image(&faceImg, faceEntry);
+        free(detections);
+        return detections ? -2 : -1;
+    }
+    for (int i = 0; i < detections->faceCount; ++i) {
+        CvRect r = detection_faces(detections)[i];
+        CacheEntry* entry;
+        IplImage* resized = resized_face(faceImg, faceKey,
+                cvSize(r.width, r.height), config->faceCache, &entry);
+        paste_face(img, r, resized);
+        release_cached_image(&resized, entry);
+    }
+    release_cached_image(&faceImg, faceEntry);
+    free(detections);
+    if (deadline_passed(config->deadlineNs)) {
         cvReleaseImage(&img);
-        cvReleaseImage(&face);
-        cvReleaseImage(&grey);
-        cvRelease((void**)&faceCascade);
-        cvReleaseMemStorage(&storage);
-        return -2;
-    }
-    for (int i = 0; i < faces->total; ++i) {
-        CvRect* r = (CvRect*)cvGetSeqElem(faces, i);
-        IplImage* resized = cvCreateImage(
-                cvSize(r->width, r->height), face->depth, face->nChannels);
-        cvResize(face, resized, CV_INTER_LINEAR);
-        cvSetImageROI(img, *r);
-        cvCopy(resized, img, NULL);
-        cvResetImageROI(img);
-        cvReleaseImage(&resized);
-    }
-    int saved = cvSaveImage(filename, img, 0);
+        return OPENCV_DEADLINE_EXCEEDED; // Not worth encoding
+    }
+    *encoded = encode_image(img, &config->encoding);
     cvReleaseImage(&img);
-    cvReleaseImage(&face);
-    cvReleaseImage(&grey);
-    cvRelease((void**)&faceCascade);
-    cvReleaseMemStorage(&storage);
-    return saved ? 0 : -1;
+    return *encoded ? 0 : -1;
+}
+
+/* load_replacement_face()
+ * -----------------------
+ * Gets a decoded replacement face, from the face cache if it has been
+ * decoded before and otherwise by decoding it and caching the pixels.
+ *
+ * face: encoded replacement face image
+ * faceKey: hash of the encoded replacement face bytes
+ * cache: face cache
+ * entry: set to the cache entry holding the pixels, or NULL if decoded
+ *
+ * Returns: decoded face (release with release_cached_image()), or NULL if
+ *          the face cannot be decoded
+ */
+IplImage* load_replacement_face(const ImageBuffer* face, CacheKey faceKey,
+        LruCache* cache, CacheEntry** entry)
+{
+    CacheKey key = combine_cache_key(faceKey, 0);
+    IplImage* faceImg = cached_image(cache, key, entry);
+    if (!faceImg && (faceImg = decode_image(face->data, face->size))) {
+        cache_image(cache, key, faceImg);
+    }
+    return faceImg;
+}
+
+/* resized_face()
+ * --------------
+ * Gets a replacement face scaled to a given size, from the face cache if
+ * possible and otherwise by resizing it and caching the result.
+ *
+ * faceImg: decoded replacement face
+ * faceKey: hash of the encoded replacement face bytes
+ * size: size to scale the face to
+ * cache: face cache
+ * entry: set to the cache entry holding the pixels, or NULL if resized
+ *
+ * Returns: scaled face (release with release_cached_image())
+ */
+IplImage* resized_face(const IplImage* faceImg, CacheKey faceKey,
+        CvSize size, LruCache* cache, CacheEntry** entry)
+{
+    // Variants are keyed by size; the decoded face itself uses 0
+    CacheKey key = combine_cache_key(faceKey,
+            ((uint64_t)size.width << BITS_PER_INT) | (uint32_t)size.height);
+    IplImage* resized = cached_image(cache, key, entry);
+    if (!resized) {
+        resized = cvCreateImage(size, faceImg->depth, faceImg->nChannels);
+        cvResize(faceImg, resized, CV_INTER_LINEAR);
+        cache_image(cache, key, resized);
+    }
+    return resized;
+}
+
+/* cached_image()
+ * --------------
+ * Looks up decoded pixels in a cache and wraps them in an image header
+ * without copying them.
+ *
+ * cache: cache to look in
+ * key: key the pixels were cached under
+ * entry: set to the entry holding the pixels, which must stay referenced
+ *        while the image is used (NULL if not found)
+ *
+ * Returns: read-only image, or NULL if the pixels are not cached
+ */
+IplImage* cached_image(LruCache* cache, CacheKey key, CacheEntry** entry)
+{
+    *entry = lru_cache_get(cache, key);
+    if (!*entry) {
+        return NULL;
+    }
+    const PixelBlock* block = (const PixelBlock*)(*entry)->data;
+    IplImage* img = cvCreateImageHeader(cvSize(block->width, block->height),
+            block->depth, block->channels);
+    cvSetData(img, (*entry)->data + sizeof(PixelBlock), block->widthStep);
+    return img;
+}
+
+/* cache_image()
+ * -------------
+ * Copies the pixels of an image into a cache. They are copied once, into a
+ * block the cache then takes over.
+ *
+ * cache: cache to add the pixels to
+ * key: key to cache the pixels under
+ * img: image to cache (without a region of interest)
+ *
+ * Returns: void (the image is simply not cached if memory is short)
+ */
+void cache_image(LruCache* cache, CacheKey key, const IplImage* img)
+{
+    if (!cache) {
+        return;
+    }
+    PixelBlock block = {img->width, img->height, img->depth, img->nChannels,
+            img->widthStep, img->imageSize};
+    size_t size = sizeof(PixelBlock) + img->imageSize;
+    uint8_t* data = malloc(size);
+    if (!data) {
+        return;
+    }
+    memcpy(data, &block, sizeof(PixelBlock));
+    memcpy(data + sizeof(PixelBlock), img->imageData, img->imageSize);
+    CacheEntry* entry = lru_cache_put_owned(cache, key, data, size, NULL, NULL);
+    if (!entry) {
+        free(data);
+    }
+    release_cache_entry(entry);
+}
+
+/* release_cached_image()
+ * ----------------------
+ * Releases an image obtained from cached_image(), or one that owns its
+ * pixels if it did not come from a cache.
+ *
+ * img: image to release (set to NULL)
+ * entry: cache entry holding the image's pixels, or NULL
+ *
+ * Returns: void
+ */
+void release_cached_image(IplImage** img, CacheEntry* entry)
+{
+    if (entry) {
+        cvReleaseImageHeader(img);
+        release_cache_entry(entry);
+    } else {
+        cvReleaseImage(img);
+    }
+}
+
+/* increment_thread_counts()
+ * -------------------------
+ * Atomically increments the total and active thread counts in shared state.
+ * Clients are served by sessions on the event loops rather than dedicated
+ * threads, so the thread counts track client sessions. The active socket
+ * count is taken by reserve_socket_slot() before accepting. The count files
+ * are updated by the count flusher thread, so this makes no system calls.
+ *
+ * shared: pointer to shared state structure
+ *
+ * Returns: void
+ * Global variables modified: increments totalThreadCount and
+ *                            activeThreadCount
+ */
+void increment_thread_counts(SharedState* shared)
+{
+    __atomic_add_fetch(&shared->totalThreadCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared->activeThreadCount, 1, __ATOMIC_RELAXED);
+}
+
+/* decrement_thread_counts()
+ * -------------------------
+ * Atomically decrements the active thread count in shared state. Used
+ * during client cleanup, along with release_socket_slot().
+ *
+ * shared: pointer to shared state structure
+ *
+ * Returns: void
+ * Global variables modified: decrements activeThreadCount
+ */
+void decrement_thread_counts(SharedState* shared)
+{
+    __atomic_sub_fetch(&shared->activeThreadCount, 1, __ATOMIC_RELAXED);
 }
 
 /* write_count_to_file()
@@ -1052,24 +4153,372 @@ void write_count_to_file(const char* path, int count)
     }
 }
 
-/* cascade_check()
+/* start_count_flusher()
+ * ---------------------
+ * Starts a detached background thread that keeps the count files up to date,
+ * taking file writes off the connection accept and close paths.
+ *
+ * shared: pointer to shared state holding the counts
+ *
+ * Returns: void
+ */
+void start_count_flusher(SharedState* shared)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, count_flusher, shared) == 0) {
+        pthread_detach(tid);
+    }
+}
+
+/* count_flusher()
  * ---------------
- * Verifies that required Haar cascade classifier files can be loaded
- * at program startup. Exits if cascades cannot be loaded.
+ * Thread function that periodically rewrites any count file whose value has
+ * changed since it was last written.
+ *
+ * arg: pointer to the SharedState holding the counts
+ *
+ * Returns: does not return (runs indefinitely)
+ */
+void* count_flusher(void* arg)
+{
+    SharedState* shared = (SharedState*)arg;
+    int lastTotalThreads = 0;
+    int lastActiveThreads = 0;
+    int lastActiveSockets = 0;
+    struct timespec interval = {0, COUNT_FLUSH_INTERVAL_NS};
+    while (1) {
+        nanosleep(&interval, NULL);
+        flush_count(totalThreadCountFile, &shared->totalThreadCount,
+                &lastTotalThreads);
+        flush_count(activeThreadCountFile, &shared->activeThreadCount,
+                &lastActiveThreads);
+        flush_count(activeSocketCountFile, &shared->activeSocketCount,
+                &lastActiveSockets);
+    }
+    return NULL;
+}
+
+/* flush_count()
+ * -------------
+ * Writes a count to its file if it differs from the value last written.
+ *
+ * path: file path to write the count to
+ * count: pointer to the shared count (read atomically)
+ * lastWritten: value most recently written to the file (updated)
  *
  * Returns: void
+ */
+void flush_count(const char* path, int* count, int* lastWritten)
+{
+    int value = __atomic_load_n(count, __ATOMIC_RELAXED);
+    if (value != *lastWritten) {
+        write_count_to_file(path, value);
+        *lastWritten = value;
+    }
+}
+
+/* load_cascades()
+ * ---------------
+ * Loads the face and eye Haar cascade classifiers once at program startup so
+ * that they can be shared by every client instead of being parsed from XML
+ * on each request. Exits if either cascade cannot be loaded.
+ *
+ * Returns: CascadeRegistry holding both loaded classifiers
  * Errors: exits with code 18 if cascade files cannot be loaded
  */
-void cascade_check(void)
+CascadeRegistry load_cascades(void)
 {
-    CvHaarClassifierCascade* faceCascade
-            = (CvHaarClassifierCascade*)cvLoad(FACE_CASCADE, 0, 0, 0);
-    CvHaarClassifierCascade* eyeCascade
-            = (CvHaarClassifierCascade*)cvLoad(EYE_CASCADE, 0, 0, 0);
-    if (!faceCascade || !eyeCascade) {
+    CascadeRegistry cascades;
+    if (!try_load_cascades(&cascades)) {
         fprintf(stderr, cascadeErrorMessage);
         exit(EXIT_CASCADE_STATUS);
     }
-    cvRelease((void**)&faceCascade);
-    cvRelease((void**)&eyeCascade);
-}
\ No newline at end of file
+    return cascades;
+}
+
+/* try_load_cascades()
+ * -------------------
+ * Loads the face and eye Haar cascade classifiers from their files.
+ *
+ * cascades: registry to fill with the loaded classifiers
+ *
+ * Returns: true on success, false if either cascade cannot be loaded (none
+ *          are left loaded)
+ */
+bool try_load_cascades(CascadeRegistry* cascades)
+{
+    cascades->faceCascade = load_cascade(FACE_CASCADE);
+    cascades->eyeCascade = load_cascade(EYE_CASCADE);
+    if (!cascades->faceCascade || !cascades->eyeCascade) {
+        free_cascades(cascades);
+        return false;
+    }
+    return true;
+}
+
+/* reload_cascades()
+ * -----------------
+ * Starts loading the cascade files again on a thread of its own, so that
+ * the event loop carries on while the XML is parsed. Does nothing if a
+ * reload is already under way.
+ *
+ * shared: shared state holding the detector pool
+ *
+ * Returns: void
+ */
+void reload_cascades(SharedState* shared)
+{
+    if (__atomic_exchange_n(&shared->reloading, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cascade_reloader, shared) != 0) {
+        __atomic_store_n(&shared->reloading, false, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* cascade_reloader()
+ * ------------------
+ * Thread start routine that loads fresh cascades and swaps a detector pool
+ * cloned from them in for the current one. Requests already running finish
+ * on the old pool, which is freed once the last of them releases it. If
+ * the cascades cannot be loaded, the current pool is kept.
+ *
+ * arg: pointer to the SharedState
+ *
+ * Returns: NULL
+ */
+void* cascade_reloader(void* arg)
+{
+    SharedState* shared = (SharedState*)arg;
+    CascadeRegistry master;
+    if (try_load_cascades(&master)) {
+        unsigned int generation = __atomic_load_n(
+                                          &shared->cascadeGeneration,
+                                          __ATOMIC_RELAXED)
+                + 1;
+        DetectorPool* pool = create_detector_pool(
+                &master, shared->workerCount, generation);
+        free_cascades(&master);
+        if (pool) {
+            pthread_mutex_lock(&shared->detectorLock);
+            DetectorPool* old = shared->detectors;
+            shared->detectors = pool;
+            __atomic_store_n(
+                    &shared->cascadeGeneration, generation, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&shared->detectorLock);
+            release_detector_pool(old);
+        }
+    }
+    __atomic_store_n(&shared->reloading, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* free_cascades()
+ * ---------------
+ * Releases the cascade classifiers held by a cascade registry.
+ *
+ * cascades: registry whose classifiers should be released
+ *
+ * Returns: void
+ */
+void free_cascades(CascadeRegistry* cascades)
+{
+    if (cascades->faceCascade) {
+        cvRelease((void**)&cascades->faceCascade);
+    }
+    if (cascades->eyeCascade) {
+        cvRelease((void**)&cascades->eyeCascade);
+    }
+}
+
+/* clone_cascades()
+ * ----------------
+ * Makes a private copy of each classifier in a registry. Cloning copies the
+ * already parsed classifier so no XML parsing is repeated.
+ *
+ * master: registry loaded at startup
+ * clone: registry to fill with the copies
+ *
+ * Returns: true on success, false if either classifier could not be cloned
+ */
+bool clone_cascades(const CascadeRegistry* master, CascadeRegistry* clone)
+{
+    clone->faceCascade = (CvHaarClassifierCascade*)cvClone(master->faceCascade);
+    clone->eyeCascade = (CvHaarClassifierCascade*)cvClone(master->eyeCascade);
+    if (!clone->faceCascade || !clone->eyeCascade) {
+        free_cascades(clone);
+        return false;
+    }
+    return true;
+}
+
+/* online_core_count()
+ * -------------------
+ * Determines how many processor cores are currently online.
+ *
+ * Returns: number of online cores, or 1 if it cannot be determined
+ */
+int online_core_count(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/* create_detector_pool()
+ * ----------------------
+ * Creates a pool of independent cascade clones. OpenCV cascades keep
+ * per-image state while detecting, so each concurrent detection needs a
+ * classifier of its own.
+ *
+ * master: registry of loaded cascades to clone from
+ * size: number of detectors in the pool (normally the core count)
+ * generation: cascade generation the pool's detections belong to
+ *
+ * Returns: pointer to the new pool holding one reference, or NULL if memory
+ *          could not be allocated or the classifiers could not be cloned
+ */
+DetectorPool* create_detector_pool(
+        const CascadeRegistry* master, int size, unsigned int generation)
+{
+    DetectorPool* pool = malloc(sizeof(DetectorPool));
+    CascadeRegistry* detectors = calloc(size, sizeof(CascadeRegistry));
+    CascadeRegistry** freeDetectors = malloc(size * sizeof(CascadeRegistry*));
+    int cloned = 0;
+    if (pool && detectors && freeDetectors) {
+        while (cloned < size && clone_cascades(master, &detectors[cloned])) {
+            freeDetectors[cloned] = &detectors[cloned];
+            cloned++;
+        }
+    }
+    if (cloned < size) {
+        while (cloned > 0) {
+            free_cascades(&detectors[--cloned]);
+        }
+        free(pool);
+        free(detectors);
+        free(freeDetectors);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->detectors = detectors;
+    pool->freeDetectors = freeDetectors;
+    pool->freeCount = size;
+    pool->size = size;
+    pool->generation = generation;
+    pool->refCount = 1;
+    return pool;
+}
+
+/* free_detector_pool()
+ * --------------------
+ * Releases every detector in a pool along with the pool itself.
+ *
+ * pool: pool to free (no detectors may be checked out)
+ *
+ * Returns: void
+ */
+void free_detector_pool(DetectorPool* pool)
+{
+    for (int i = 0; i < pool->size; i++) {
+        free_cascades(&pool->detectors[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->available);
+    free(pool->detectors);
+    free(pool->freeDetectors);
+    free(pool);
+}
+
+/* acquire_detector_pool()
+ * -----------------------
+ * Takes a reference to the current detector pool.
+ *
+ * shared: shared state holding the detector pool
+ *
+ * Returns: the current pool (release with release_detector_pool())
+ */
+DetectorPool* acquire_detector_pool(SharedState* shared)
+{
+    pthread_mutex_lock(&shared->detectorLock);
+    DetectorPool* pool = shared->detectors;
+    __atomic_add_fetch(&pool->refCount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shared->detectorLock);
+    return pool;
+}
+
+/* release_detector_pool()
+ * -----------------------
+ * Drops a reference to a detector pool, freeing it once it has been
+ * replaced and the last request using it has finished.
+ *
+ * pool: pool to release
+ *
+ * Returns: void
+ */
+void release_detector_pool(DetectorPool* pool)
+{
+    if (__atomic_sub_fetch(&pool->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_detector_pool(pool);
+    }
+}
+
+/* acquire_detector()
+ * ------------------
+ * Checks a detector out of the pool, waiting until one is free. This also
+ * caps the number of simultaneous detections at the size of the pool.
+ *
+ * pool: pool to take a detector from
+ *
+ * Returns: detector reserved for the caller's exclusive use
+ */
+CascadeRegistry* acquire_detector(DetectorPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->freeCount == 0) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+    CascadeRegistry* detector = pool->freeDetectors[--pool->freeCount];
+    pthread_mutex_unlock(&pool->lock);
+    return detector;
+}
+
+/* try_acquire_detector()
+ * ----------------------
+ * Checks a detector out of the pool if one is free, without waiting.
+ *
+ * pool: pool to take a detector from
+ *
+ * Returns: detector reserved for the caller's exclusive use, or NULL if all
+ *          detectors are in use
+ */
+CascadeRegistry* try_acquire_detector(DetectorPool* pool)
+{
+    CascadeRegistry* detector = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->freeCount > 0) {
+        detector = pool->freeDetectors[--pool->freeCount];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return detector;
+}
+
+/* release_detector()
+ * ------------------
+ * Returns a detector previously obtained from acquire_detector() to the pool.
+ *
+ * pool: pool the detector belongs to
+ * detector: detector to return
+ *
+ * Returns: void
+ */
+void release_detector(DetectorPool* pool, CascadeRegistry* detector)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->freeDetectors[pool->freeCount++] = detector;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,81 @@
+/* CSSE2310 2025 Assignment Four
+ * util.c
+ *
+ * Written by William White
+ */
+
+#include "util.h"
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000
+
+/* monotonic_ns()
+ * --------------
+ * Reads the monotonic clock, which is unaffected by changes to the system
+ * time.
+ *
+ * Returns: current monotonic time in nanoseconds
+ */
+uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+/* is_number()
+ * -----------
+ * Checks if a string represents a valid positive integer, optionally
+ * with a leading '+' sign.
+ *
+ * str: string to validate as a number
+ *
+ * Returns: true if string is a valid positive integer, false otherwise
+ */
+bool is_number(const char* str)
+{
+    if (!str || *str == '\0') { // Check if empty
+        return false;
+    }
+
+    // Check if negative number
+    if (*str == '+') {
+        str++;
+        if (*str == '\0') {
+            return false; // Only '+' was given
+        }
+    }
+
+    while (*str) {
+        if (!isdigit((unsigned char)*str)) {
+            return false;
+        }
+        str++;
+    }
+    return true;
+}
+
+/* valid_range()
+ * -------------
+ * Checks if a numeric string is within the valid range by comparing
+ * string length and lexicographic order against maximum value.
+ *
+ * str: string representation of number to check
+ * maxValue: string representation of maximum allowed value
+ *
+ * Returns: true if str represents a number <= maxValue, false otherwise
+ */
+bool valid_range(const char* str, const char* maxValue)
+{
+    size_t strLength = strlen(str);
+    size_t maxLength = strlen(maxValue);
+    if (strLength < maxLength) {
+        return true;
+    }
+    if (strLength > maxLength) {
+        return false;
+    }
+    return strcmp(str, maxValue) <= 0;
+}
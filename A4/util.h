@@ -0,0 +1,16 @@
+/* CSSE2310 2025 Assignment Four
+ * util.h
+ *
+ * Written by William White
+ */
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Function Prototypes
+uint64_t monotonic_ns(void);
+bool is_number(const char* str);
+bool valid_range(const char* str, const char* maxValue);
+#endif
@@ -0,0 +1,174 @@
+/* CSSE2310 2025 Assignment Four
+ * workpool.c
+ *
+ * Written by William White
+ */
+
+#include "workpool.h"
+#include <stdlib.h>
+
+/* work_pool_thread()
+ * ------------------
+ * Body of each worker thread. Repeatedly takes the oldest task from the
+ * queue and runs it until the pool is stopped and the queue is empty. Taking
+ * a task from a full queue calls the pool's room hook, if it has one.
+ *
+ * arg: pointer to the WorkPool the thread belongs to
+ *
+ * Returns: NULL when the pool is stopped
+ */
+static void* work_pool_thread(void* arg)
+{
+    WorkPool* pool = arg;
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->notEmpty, &pool->lock);
+        }
+        if (pool->count == 0) { // Stopping and nothing left to run
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        Task task = pool->queue[pool->head];
+        bool wasFull = pool->count == pool->capacity;
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        if (wasFull && pool->roomHook) {
+            pool->roomHook(pool->roomHookArg);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        task.run(task.arg);
+    }
+}
+
+/* create_work_pool()
+ * ------------------
+ * Creates a pool of worker threads that run tasks taken from a bounded
+ * queue. The thread count stays fixed for the life of the pool, so the
+ * number of threads doing work never grows with load.
+ *
+ * threadCount: number of worker threads to start
+ * queueCapacity: maximum number of tasks waiting to run
+ *
+ * Returns: pointer to the new pool, or NULL on failure
+ */
+WorkPool* create_work_pool(int threadCount, int queueCapacity)
+{
+    WorkPool* pool = calloc(1, sizeof(WorkPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->queue = malloc(queueCapacity * sizeof(Task));
+    pool->threads = malloc(threadCount * sizeof(pthread_t));
+    if (!pool->queue || !pool->threads) {
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->notEmpty, NULL);
+    pool->capacity = queueCapacity;
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&pool->threads[i], NULL, work_pool_thread, pool)
+                != 0) {
+            break;
+        }
+        pool->threadCount++;
+    }
+    if (pool->threadCount == 0) {
+        free_work_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* try_submit_task()
+ * -----------------
+ * Queues a task to be run by one of the pool's worker threads if there is
+ * space, without waiting. Safe to call from a worker thread.
+ *
+ * pool: pool to run the task on
+ * run: function to call on a worker thread
+ * arg: argument to pass to run
+ *
+ * Returns: true if the task was queued, false if the queue is full
+ */
+bool try_submit_task(WorkPool* pool, TaskFunction run, void* arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    bool queued = pool->count < pool->capacity;
+    if (queued) {
+        int tail = (pool->head + pool->count) % pool->capacity;
+        pool->queue[tail].run = run;
+        pool->queue[tail].arg = arg;
+        pool->count++;
+        pthread_cond_signal(&pool->notEmpty);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return queued;
+}
+
+/* set_work_pool_room_hook()
+ * --------------------------
+ * Sets a function for the pool's workers to call whenever they take a task
+ * from a full queue, so that a submitter turned away by try_submit_task()
+ * can be told there is room without polling. The hook is called with the
+ * pool's lock held: it must be quick and must not submit tasks. Once this
+ * returns, the previous hook is no longer running and will not be called.
+ *
+ * pool: pool whose workers should call the hook
+ * hook: function to call, or NULL for none
+ * arg: argument to pass to hook
+ *
+ * Returns: void
+ */
+void set_work_pool_room_hook(WorkPool* pool, TaskFunction hook, void* arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->roomHook = hook;
+    pool->roomHookArg = arg;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* work_pool_queue_depth()
+ * ------------------------
+ * Reports how many submitted tasks are waiting for a worker.
+ *
+ * pool: the pool to inspect
+ *
+ * Returns: number of queued tasks not yet started
+ */
+int work_pool_queue_depth(WorkPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    int depth = pool->count;
+    pthread_mutex_unlock(&pool->lock);
+    return depth;
+}
+
+/* free_work_pool()
+ * ----------------
+ * Stops the pool once all queued tasks have run, joins its worker threads
+ * and frees it.
+ *
+ * pool: pool to free
+ *
+ * Returns: void
+ */
+void free_work_pool(WorkPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->notEmpty);
+    free(pool->queue);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,41 @@
+/* CSSE2310 2025 Assignment Four
+ * workpool.h
+ *
+ * Written by William White
+ */
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef void (*TaskFunction)(void* arg);
+
+// A unit of work queued for the pool
+typedef struct {
+    TaskFunction run;
+    void* arg;
+} Task;
+
+// Fixed set of worker threads fed by a bounded circular task queue
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    Task* queue;
+    int capacity;
+    int head;
+    int count;
+    pthread_t* threads;
+    int threadCount;
+    bool stopping;
+    TaskFunction roomHook;
+    void* roomHookArg;
+} WorkPool;
+
+// Function Prototypes
+WorkPool* create_work_pool(int threadCount, int queueCapacity);
+bool try_submit_task(WorkPool* pool, TaskFunction run, void* arg);
+void set_work_pool_room_hook(WorkPool* pool, TaskFunction hook, void* arg);
+int work_pool_queue_depth(WorkPool* pool);
+void free_work_pool(WorkPool* pool);
+#endif